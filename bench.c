@@ -0,0 +1,669 @@
+#define FUSE_USE_VERSION 29
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fuse.h>
+
+#include "sfs.h"
+#include "bench.h"
+
+typedef struct bench_walk_args {
+    uint32_t target;
+    uint32_t blk;
+} bench_walk_args;
+
+bool bench_walk_cb(uint32_t *block, fs_index i, void *vargs) {
+    if (i.pre || i.post) return true;
+    bench_walk_args *args = (bench_walk_args *)vargs;
+    if (i.index < args->target) return true;
+    args->blk = *block;
+    return false;
+}
+
+typedef struct bench_sys_impl {
+    const char *name;
+    void (*memcpy)(void *, const void *, size_t);
+    void (*memset)(void *, uint8_t, size_t);
+    size_t (*strcmp)(const char *, const char *);
+    size_t (*strlen)(const char *);
+} bench_sys_impl;
+
+// block copies, block zeroing and dentry name compares for each variant
+void bench_sys(size_t iters) {
+    bench_sys_impl impls[] = {
+        { "byte", sys_memcpy_byte, sys_memset_byte, sys_strcmp_byte, sys_strlen_byte },
+        { "word", sys_memcpy_word, sys_memset_word, sys_strcmp_word, sys_strlen_word },
+#ifdef SYS_SSE2
+        { "sse2", sys_memcpy_sse2, sys_memset_sse2, sys_strcmp_sse2, sys_strlen_sse2 },
+        { "avx2", sys_memcpy_avx2, sys_memset_avx2, sys_strcmp_sse2, sys_strlen_sse2 },
+#endif
+    };
+
+    uint8_t (*blocks)[FS_BLOCK_SIZE] = calloc(2, FS_BLOCK_SIZE);
+    char names[2][FS_NAME_LEN_MAX] = { "bench-directory-entry", "bench-directory-entrz" };
+    size_t sink = 0;
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+#ifdef SYS_SSE2
+        if (impls[i].memcpy == sys_memcpy_avx2 && !sys_has_avx2()) continue;
+#endif
+        bench_sys_impl *impl = &impls[i];
+        double start = bench_now();
+        for (size_t j = 0; j < iters; j++) {
+            impl->memcpy(blocks[j & 1], blocks[~j & 1], FS_BLOCK_SIZE);
+        }
+        double copy = bench_now() - start;
+
+        start = bench_now();
+        for (size_t j = 0; j < iters; j++) {
+            impl->memset(blocks[j & 1], j, FS_BLOCK_SIZE);
+        }
+        double zero = bench_now() - start;
+
+        start = bench_now();
+        for (size_t j = 0; j < iters; j++) {
+            sink += impl->strcmp(names[0], names[j & 1]);
+            sink += impl->strlen(names[j & 1]);
+        }
+        double name = bench_now() - start;
+
+        printf("sys %s: copy %8.1f MB/s   zero %8.1f MB/s   names %6.1f ns\n", impl->name,
+            iters * FS_BLOCK_SIZE / copy / 1e6, iters * FS_BLOCK_SIZE / zero / 1e6, name / iters * 1e9);
+    }
+
+    if (sink == 0) printf("sys: names never differed\n");
+    free(blocks);
+}
+
+// resolves random logical blocks of a file with the callback walk and bmap
+void bench_bmap(fs_fs *fs, uint32_t ino, uint32_t blocks, size_t iters) {
+    uint32_t *targets = malloc(iters * sizeof(uint32_t));
+    srand(42);
+    for (size_t i = 0; i < iters; i++) targets[i] = rand() % blocks;
+
+    uint64_t sum_walk = 0;
+    double start = bench_now();
+    for (size_t i = 0; i < iters; i++) {
+        bench_walk_args args = { targets[i], BLK_INVALID };
+        fs_ino_enumerate_blocks(fs, ino, bench_walk_cb, &args);
+        sum_walk += args.blk;
+    }
+    double walk = bench_now() - start;
+
+    uint64_t sum_bmap = 0;
+    start = bench_now();
+    for (size_t i = 0; i < iters; i++) {
+        sum_bmap += fs_ino_bmap(fs, ino, targets[i], false);
+    }
+    double bmap = bench_now() - start;
+
+    printf("bmap %6d blocks: walk %8.1f ns/op   bmap %6.1f ns/op   %s\n",
+        blocks, walk / iters * 1e9, bmap / iters * 1e9,
+        sum_walk == sum_bmap ? "ok" : "MISMATCH");
+    free(targets);
+}
+
+// resolves blocks of files up to 12 MiB on an image of the given block size
+void bench_geometry(uint32_t block_size) {
+    uint64_t size = 16 * 1024 * 1024;
+    char *buffer = calloc(1, size);
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_create(fs, buffer, size, block_size);
+
+    printf("block size %u\n", block_size);
+    uint32_t bytes[] = { 4096, 64 * 1024, 1024 * 1024, 12 * 1024 * 1024 };
+    for (size_t i = 0; i < sizeof(bytes) / sizeof(bytes[0]); i++) {
+        uint32_t ino = fs_ino_mknod(fs, fs->header->root_ino, "bench", S_IFREG >> 3);
+        fs_ino_truncate(fs, ino, bytes[i]);
+        fs_ino_allocate(fs, ino, 0, bytes[i] / block_size);
+        bench_bmap(fs, ino, bytes[i] / block_size, 20000);
+        fs_ino_unlink(fs, fs->header->root_ino, "bench");
+    }
+
+    free(fs);
+    free(buffer);
+}
+
+// whole-file and positional I/O, links and path lookups on an in-memory
+// image, timed per call
+void bench_core(size_t ops) {
+    uint64_t size = 64 * 1024 * 1024;
+    char *buffer = calloc(1, size);
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_create(fs, buffer, size, FS_BLOCK_SIZE);
+    fs->dcache = (fs_dcache *)calloc(1, sizeof(fs_dcache));
+    MUTEX_INIT(&fs->dcache->lock);
+    uint32_t root = fs->header->root_ino;
+
+    bench_lat lat;
+    uint64_t start;
+    uint8_t chunk[4096] = { 1 };
+    char path[64];
+    srand(42);
+
+    uint32_t ino = fs_ino_mknod(fs, root, "file", S_IFREG >> 3);
+    bench_lat_init(&lat, "core.write.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        start = bench_ns();
+        fs_ino_write(fs, ino, chunk, sizeof(chunk));
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "core.read.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        start = bench_ns();
+        fs_ino_read(fs, ino, chunk, sizeof(chunk));
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    size_t chunks = 4 * 1024 * 1024 / sizeof(chunk);
+    bench_lat_init(&lat, "core.pwrite.seq.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        start = bench_ns();
+        fs_ino_pwrite(fs, ino, chunk, sizeof(chunk), i % chunks * sizeof(chunk));
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "core.pread.seq.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        start = bench_ns();
+        fs_ino_pread(fs, ino, chunk, sizeof(chunk), i % chunks * sizeof(chunk));
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "core.pwrite.rand.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        size_t offset = rand() % chunks * sizeof(chunk);
+        start = bench_ns();
+        fs_ino_pwrite(fs, ino, chunk, sizeof(chunk), offset);
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "core.pread.rand.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        size_t offset = rand() % chunks * sizeof(chunk);
+        start = bench_ns();
+        fs_ino_pread(fs, ino, chunk, sizeof(chunk), offset);
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+    fs_ino_unlink(fs, root, "file");
+
+    // hard links to a single file in a directory that keeps growing
+    size_t files = ops < 4096 ? ops : 4096;
+    uint32_t dir = fs_ino_mkdir(fs, root, "links", 0);
+    ino = fs_ino_mknod(fs, dir, "target", S_IFREG >> 3);
+    bench_lat_init(&lat, "core.link", files);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(path, "link-%ld", i);
+        start = bench_ns();
+        fs_ino_link(fs, dir, ino, path);
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "core.unlink", files);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(path, "link-%ld", i);
+        start = bench_ns();
+        fs_ino_unlink(fs, dir, path);
+        bench_lat_add(&lat, start);
+    }
+    bench_lat_report(&lat);
+
+    // lookups four levels deep, through the dentry cache and without it
+    dir = root;
+    const char *levels[] = { "a", "b", "c", "d" };
+    for (size_t i = 0; i < 4; i++) dir = fs_ino_mkdir(fs, dir, levels[i], 0);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(path, "f%ld", i);
+        fs_ino_mknod(fs, dir, path, S_IFREG >> 3);
+    }
+
+    const char *names[] = { "core.path.dcache", "core.path.nocache" };
+    fs_dcache *dcache = fs->dcache;
+    for (size_t j = 0; j < 2; j++) {
+        fs->dcache = j == 0 ? dcache : NULL;
+        bench_lat_init(&lat, names[j], ops);
+        for (size_t i = 0; i < ops; i++) {
+            sprintf(path, "/a/b/c/d/f%d", rand() % (int)files);
+            start = bench_ns();
+            fs_path_to_ino(fs, path);
+            bench_lat_add(&lat, start);
+        }
+        bench_lat_report(&lat);
+    }
+
+    free(dcache);
+    free(fs);
+    free(buffer);
+}
+
+uint8_t *bench_image;
+
+int32_t bench_read_block(void *ctx, uint32_t blk, void *buffer, uint32_t size) {
+    UNUSED(ctx);
+    _memcpy(buffer, bench_image + (size_t)blk * size, size);
+    return SUCCESS;
+}
+
+int32_t bench_read_blocks(void *ctx, uint32_t blk, uint32_t count, void *buffer, uint32_t size) {
+    UNUSED(ctx);
+    _memcpy(buffer, bench_image + (size_t)blk * size, (size_t)count * size);
+    return SUCCESS;
+}
+
+int32_t bench_write_block(void *ctx, uint32_t blk, const void *buffer, uint32_t size) {
+    UNUSED(ctx);
+    _memcpy(bench_image + (size_t)blk * size, buffer, size);
+    return SUCCESS;
+}
+
+// rewrites and reads back a file in 4 KiB chunks
+double bench_io(fs_fs *fs, size_t size, size_t iters) {
+    uint8_t chunk[4096] = { 1 };
+    uint32_t ino = fs_ino_mknod(fs, fs->header->root_ino, "io", S_IFREG >> 3);
+
+    double start = bench_now();
+    for (size_t i = 0; i < iters; i++) {
+        for (size_t off = 0; off < size; off += sizeof(chunk)) {
+            fs_ino_pwrite(fs, ino, chunk, sizeof(chunk), off);
+            fs_journal_tick(fs);
+        }
+        for (size_t off = 0; off < size; off += sizeof(chunk)) {
+            fs_ino_pread(fs, ino, chunk, sizeof(chunk), off);
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    fs_ino_unlink(fs, fs->header->root_ino, "io");
+    return (double)size * 2 * iters / elapsed / MB;
+}
+
+// the same workload on a mapped image and through the buffer cache
+void bench_bcache(size_t size, size_t iters) {
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    bench_image = calloc(1, DISK_SIZE);
+    fs_create(fs, bench_image, DISK_SIZE, FS_BLOCK_SIZE);
+    double raw = bench_io(fs, size, iters);
+
+    fs_dev dev = { NULL, bench_read_block, bench_write_block, NULL, bench_read_blocks };
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    _memset(bench_image, 0, DISK_SIZE);
+    fs_create_dev(fs, &dev, bcache, DISK_SIZE, FS_BLOCK_SIZE);
+    double cached = bench_io(fs, size, iters);
+    fs_sync(fs);
+
+    printf("io %7ld bytes: raw %8.1f MB/s   bcache %8.1f MB/s   hits %lu misses %lu writebacks %lu\n",
+        size, raw, cached, bcache->hits, bcache->misses, bcache->writebacks);
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(fs);
+}
+
+uint64_t bench_flushes;
+
+int32_t bench_flush(void *ctx) {
+    UNUSED(ctx);
+    bench_flushes++;
+    return SUCCESS;
+}
+
+// creates files through the FUSE handlers with a given commit interval
+void bench_journal(uint32_t interval, size_t files) {
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_dev dev = { NULL, bench_read_block, bench_write_block, bench_flush, bench_read_blocks };
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    bench_image = calloc(1, DISK_SIZE);
+    fs_create_dev(fs, &dev, bcache, DISK_SIZE, FS_BLOCK_SIZE);
+    fs->journal.interval = interval;
+    FS = fs;
+
+    char path[32];
+    bench_flushes = 0;
+    double start = bench_now();
+    sfs_mkdir("/dir", 0755);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(path, "/dir/%ld", i);
+        sfs_mknod(path, 0644, 0);
+    }
+    fs_sync(fs);
+    double elapsed = bench_now() - start;
+
+    printf("journal interval %4d ms: %8.0f creates/s   commits %lu   flushes %lu\n",
+        interval, files / elapsed, fs->journal.commits, bench_flushes);
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(fs);
+}
+
+// small appends through the FUSE handlers, as written by echo >> or a logger
+void bench_append(size_t ops) {
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    char *buffer = calloc(1, DISK_SIZE);
+    fs_create(fs, buffer, DISK_SIZE, FS_BLOCK_SIZE);
+    FS = fs;
+
+    struct fuse_file_info fi = { 0 };
+    const char line[] = "append 0123456\n";
+    bench_lat lat;
+    uint64_t start;
+    sfs_create("/log", 0644, &fi);
+    bench_lat_init(&lat, "sfs.append.16", ops);
+    for (size_t i = 0; i < ops; i++) {
+        start = bench_ns();
+        sfs_write("/log", line, sizeof(line) - 1, i * (sizeof(line) - 1), &fi);
+        bench_lat_add(&lat, start);
+    }
+    sfs_release("/log", &fi);
+    bench_lat_report(&lat);
+    free(buffer);
+    free(fs);
+}
+
+uint64_t bench_reads;
+uint64_t bench_seeks;
+uint64_t bench_distance;
+uint64_t bench_blocks_read;
+uint64_t bench_blocks_written;
+uint32_t bench_last;
+
+// counts the reads that do not continue where the previous one ended
+int32_t bench_seek_read(void *ctx, uint32_t blk, uint32_t count, void *buffer, uint32_t size) {
+    UNUSED(ctx);
+    if (blk != bench_last) {
+        bench_seeks++;
+        bench_distance += blk > bench_last ? blk - bench_last : bench_last - blk;
+    }
+    bench_reads++;
+    bench_blocks_read += count;
+    bench_last = blk + count;
+    _memcpy(buffer, bench_image + (size_t)blk * size, (size_t)count * size);
+    return SUCCESS;
+}
+
+int32_t bench_seek_read_block(void *ctx, uint32_t blk, void *buffer, uint32_t size) {
+    return bench_seek_read(ctx, blk, 1, buffer, size);
+}
+
+// Fills dirs directories with one file after another in each, round robin
+// as by several writers at once, then reads the tree back one directory at
+// a time from a cold cache, like find or a tree copy, and counts the seeks.
+void bench_locality(uint32_t dirs, uint32_t files, size_t size) {
+    size_t image = 64 * MB;
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_dev dev = { NULL, bench_seek_read_block, bench_write_block, NULL, bench_seek_read };
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    bench_image = calloc(1, image);
+    fs_create_dev(fs, &dev, bcache, image, FS_BLOCK_SIZE);
+
+    uint8_t *data = calloc(1, size);
+    char name[32];
+    uint32_t *dir_inos = (uint32_t *)malloc(dirs * sizeof(uint32_t));
+    for (uint32_t d = 0; d < dirs; d++) {
+        sprintf(name, "dir%u", d);
+        dir_inos[d] = fs_ino_mkdir(fs, fs->header->root_ino, name, 0);
+        fs_journal_tick(fs);
+    }
+    for (uint32_t f = 0; f < files; f++) {
+        for (uint32_t d = 0; d < dirs; d++) {
+            sprintf(name, "file%u", f);
+            int32_t ino = fs_ino_mknod(fs, dir_inos[d], name, S_IFREG >> 3);
+            fs_journal_tick(fs);
+            for (size_t off = 0; off < size; off += 4096) {
+                fs_ino_pwrite(fs, ino, data, MIN(4096, size - off), off);
+                fs_journal_tick(fs);
+            }
+        }
+    }
+    fs_sync(fs);
+
+    fs_mount_dev(fs, &dev, bcache, image);
+    bench_reads = bench_seeks = bench_distance = 0;
+    for (uint32_t d = 0; d < dirs; d++) {
+        for (uint32_t f = 0; f < files; f++) {
+            sprintf(name, "file%u", f);
+            int32_t ino = fs_name_to_ino(fs, dir_inos[d], name);
+            fs_ino_pread(fs, ino, data, size, 0);
+        }
+    }
+    printf("locality %u dirs x %u files of %lu bytes: reads %lu seeks %lu avg distance %.0f blocks\n",
+        dirs, files, size, bench_reads, bench_seeks, (double)bench_distance / MAX(bench_seeks, 1));
+    free(dir_inos);
+    free(data);
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(fs);
+}
+
+#define BENCH_DEVICE_US 100     // latency of one device read
+#define BENCH_WORK_US 200       // time the reader spends on each request
+
+uint64_t bench_requests;
+
+void bench_sleep_us(uint64_t us) {
+    struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+// a device whose every read request takes BENCH_DEVICE_US
+int32_t bench_slow_read(void *ctx, uint32_t blk, uint32_t count, void *buffer, uint32_t size) {
+    __atomic_add_fetch(&bench_requests, 1, __ATOMIC_RELAXED);
+    bench_sleep_us(BENCH_DEVICE_US);
+    return bench_read_blocks(ctx, blk, count, buffer, size);
+}
+
+int32_t bench_slow_read_block(void *ctx, uint32_t blk, void *buffer, uint32_t size) {
+    return bench_slow_read(ctx, blk, 1, buffer, size);
+}
+
+// Reads a file sequentially through the FUSE handlers from a cold cache
+// on a slow device, with some work on every 128 KiB, with and without the
+// prefetcher reading ahead in the background.
+void bench_prefetch(size_t size, bool prefetch) {
+    size_t image = 64 * MB;
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_dev dev = { NULL, bench_slow_read_block, bench_write_block, NULL, bench_slow_read };
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    bench_image = calloc(1, image);
+    fs_create_dev(fs, &dev, bcache, image, FS_BLOCK_SIZE);
+    FS = fs;
+
+    static char chunk[SFS_MAX_REQUEST];
+    struct fuse_file_info fi = { 0 };
+    sfs_create("/seq", 0644, &fi);
+    for (size_t off = 0; off < size; off += sizeof(chunk)) sfs_write("/seq", chunk, sizeof(chunk), off, &fi);
+    sfs_release("/seq", &fi);
+    fs_sync(fs);
+    fs_mount_dev(fs, &dev, bcache, image);
+
+    struct fuse_conn_info conn = { 0 };
+    if (prefetch) sfs_init(&conn);
+    bench_requests = 0;
+    double start = bench_now();
+    sfs_open("/seq", &fi);
+    for (size_t off = 0; off < size; off += sizeof(chunk)) {
+        sfs_read("/seq", chunk, sizeof(chunk), off, &fi);
+        bench_sleep_us(BENCH_WORK_US);
+    }
+    sfs_release("/seq", &fi);
+    double elapsed = bench_now() - start;
+    if (prefetch) sfs_destroy(NULL);
+
+    printf("prefetch %-3s %lu bytes: %8.1f MB/s   device reads %lu\n",
+        prefetch ? "on" : "off", size, size / elapsed / MB, bench_requests);
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(fs);
+}
+
+int32_t bench_count_write(void *ctx, uint32_t blk, const void *buffer, uint32_t size) {
+    bench_blocks_written++;
+    return bench_write_block(ctx, blk, buffer, size);
+}
+
+// Writes a JSON log in 4 KiB appends and reads it back from a cold cache,
+// plain and compressed, counting the blocks that reach the device.
+void bench_compress(size_t size) {
+    size_t image = 64 * MB;
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_dev dev = { NULL, bench_seek_read_block, bench_count_write, NULL, bench_seek_read };
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    bench_image = calloc(1, image);
+    fs_create_dev(fs, &dev, bcache, image, FS_BLOCK_SIZE);
+    fs_ccache *ccache = (fs_ccache *)calloc(1, sizeof(fs_ccache));
+    MUTEX_INIT(&ccache->lock);
+    ccache->data = (uint8_t *)malloc(FS_CCACHE_SIZE * fs_cluster_size(fs));
+
+    uint8_t *data = malloc(size);
+    size_t len = 0;
+    for (uint32_t i = 0; len < size; i++) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "{\"seq\": %u, \"sensor\": \"temp%u\", \"value\": %u.%u, \"ok\": true}\n",
+            i, i % 8, 20 + i * 7 % 13, i % 10);
+        _memcpy(data + len, line, MIN((size_t)n, size - len));
+        len += n;
+    }
+
+    for (int compressed = 0; compressed < 2; compressed++) {
+        const char *name = compressed ? "zlog" : "log";
+        fs->ccache = ccache;
+        uint32_t blocks = fs->header->blocks;
+        int32_t ino = fs_ino_mknod(fs, fs->header->root_ino, name, S_IFREG >> 3);
+        if (compressed) fs_ino_compress(fs, ino, true);
+
+        bench_blocks_written = 0;
+        double start = bench_now();
+        for (size_t off = 0; off < size; off += 4096) {
+            fs_ino_pwrite(fs, ino, data + off, MIN(4096, size - off), off);
+            fs_journal_tick(fs);
+        }
+        fs_sync(fs);
+        double write = bench_now() - start;
+        blocks = fs->header->blocks - blocks;
+        uint64_t written = bench_blocks_written;
+
+        fs_mount_dev(fs, &dev, bcache, image);
+        fs->ccache = ccache;
+        bench_blocks_read = 0;
+        start = bench_now();
+        for (size_t off = 0; off < size; off += 4096) {
+            fs_ino_pread(fs, ino, data, MIN(4096, size - off), off);
+        }
+        double read = bench_now() - start;
+        printf("compress %-4s %lu bytes: %u blocks, written %lu read %lu, write %.1f MB/s read %.1f MB/s\n",
+            compressed ? "on" : "off", size, blocks, written, bench_blocks_read,
+            size / write / MB, size / read / MB);
+    }
+    free(data);
+    free(ccache->data);
+    free(ccache);
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(fs);
+}
+
+typedef struct bench_thread_args {
+    char path[32];
+    size_t ops;
+    uint32_t seed;
+} bench_thread_args;
+
+void *bench_reader(void *vargs) {
+    bench_thread_args *args = (bench_thread_args *)vargs;
+    struct fuse_file_info fi = { 0 };
+    char buffer[4096];
+    if (sfs_open(args->path, &fi) < 0) return NULL;
+    for (size_t i = 0; i < args->ops; i++) {
+        off_t offset = (rand_r(&args->seed) % 16) * sizeof(buffer);
+        sfs_read(args->path, buffer, sizeof(buffer), offset, &fi);
+    }
+    sfs_release(args->path, &fi);
+    return NULL;
+}
+
+// 4 KiB reads through the FUSE handlers from several threads, either each
+// on its own file or all on the same one
+void bench_threads(fs_fs *fs, const char *name, size_t threads, bool shared, size_t ops) {
+    pthread_t tids[16];
+    bench_thread_args args[16];
+    FS = fs;
+
+    char buffer[4096] = { 1 };
+    for (size_t i = 0; i < threads; i++) {
+        sprintf(args[i].path, "/r%ld", shared ? 0 : i);
+        args[i].ops = ops;
+        args[i].seed = i;
+        if (fs_path_to_ino(fs, args[i].path) > 0) continue;
+        struct fuse_file_info fi = { 0 };
+        sfs_create(args[i].path, 0644, &fi);
+        for (size_t j = 0; j < 16; j++) sfs_write(args[i].path, buffer, sizeof(buffer), j * sizeof(buffer), &fi);
+        sfs_release(args[i].path, &fi);
+    }
+
+    double start = bench_now();
+    for (size_t i = 0; i < threads; i++) pthread_create(&tids[i], NULL, bench_reader, &args[i]);
+    for (size_t i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double elapsed = bench_now() - start;
+
+    printf("read %-6s %2ld threads %-9s %10.0f ops/s\n",
+        name, threads, shared ? "same file" : "own file", threads * ops / elapsed);
+}
+
+int main() {
+    bench_core(50000);
+
+    bench_sys(2000000);
+
+    bench_geometry(512);
+    bench_geometry(4096);
+
+    bench_bcache(16 * 1024, 200);
+    bench_bcache(256 * 1024, 20);
+
+    bench_journal(0, 1000);
+    bench_journal(FS_JOURNAL_INTERVAL, 1000);
+
+    bench_append(50000);
+
+    bench_locality(16, 32, 16 * 1024);
+
+    bench_compress(4 * MB);
+
+    bench_prefetch(16 * MB, false);
+    bench_prefetch(16 * MB, true);
+
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    char *buffer = calloc(1, DISK_SIZE);
+    fs_create(fs, buffer, DISK_SIZE, FS_BLOCK_SIZE);
+    fs_dev dev = { NULL, bench_read_block, bench_write_block, NULL, bench_read_blocks };
+    fs_fs *cached = (fs_fs *)malloc(sizeof(fs_fs));
+    fs_bcache *bcache = calloc(1, sizeof(fs_bcache));
+    bench_image = calloc(1, DISK_SIZE);
+    fs_create_dev(cached, &dev, bcache, DISK_SIZE, FS_BLOCK_SIZE);
+
+    size_t threads[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        bench_threads(fs, "raw", threads[i], false, 50000);
+        bench_threads(fs, "raw", threads[i], true, 50000);
+        bench_threads(cached, "bcache", threads[i], false, 50000);
+        bench_threads(cached, "bcache", threads[i], true, 50000);
+    }
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(bench_image);
+    free(cached);
+    free(fs);
+    free(buffer);
+    return 0;
+}
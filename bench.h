@@ -0,0 +1,74 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// per-operation latencies of one benchmark, reported as a single line
+// `name ops=N ops_s=N p50_ns=N p90_ns=N p99_ns=N max_ns=N` so that runs of
+// two builds can be compared with diff or join. ops_s is the throughput
+// over the wall-clock time from the start of the first sample to the end
+// of the last one, so the work between samples counts as well.
+typedef struct bench_lat {
+    const char *name;
+    uint64_t *samples;
+    size_t count;
+    size_t size;
+    uint64_t first;     // start of the first sample
+    uint64_t last;      // end of the last one
+} bench_lat;
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t bench_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_lat_init(bench_lat *lat, const char *name, size_t size) {
+    lat->name = name;
+    lat->samples = malloc(size * sizeof(uint64_t));
+    lat->count = 0;
+    lat->size = size;
+    lat->first = 0;
+    lat->last = 0;
+}
+
+void bench_lat_add(bench_lat *lat, uint64_t start) {
+    uint64_t end = bench_ns();
+    if (lat->count == 0) lat->first = start;
+    lat->last = end;
+    if (lat->count < lat->size) lat->samples[lat->count++] = end - start;
+}
+
+int bench_lat_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t bench_lat_pct(bench_lat *lat, size_t pct) {
+    if (lat->count == 0) return 0;
+    return lat->samples[(lat->count - 1) * pct / 100];
+}
+
+void bench_lat_report(bench_lat *lat) {
+    uint64_t wall = lat->last - lat->first;
+    qsort(lat->samples, lat->count, sizeof(uint64_t), bench_lat_cmp);
+
+    printf("%s ops=%lu ops_s=%.0f p50_ns=%lu p90_ns=%lu p99_ns=%lu max_ns=%lu\n",
+        lat->name, lat->count, wall ? lat->count * 1e9 / wall : 0.0,
+        bench_lat_pct(lat, 50), bench_lat_pct(lat, 90),
+        bench_lat_pct(lat, 99), bench_lat_pct(lat, 100));
+    fflush(stdout);
+    free(lat->samples);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#define FSCK_NO_MAIN
+#include "fsck.c"
+
+// Crash test of the journal. A scenario runs on an image in memory that
+// loses every write from a given one on, once for each write of its final
+// sync, which covers the data written back before the commit record. The
+// image is then mounted like after a crash, checked and its files read.
+
+#define CRASH_IMAGE (4 * MB)
+#define CRASH_FILE (64 * 1024)  // past the direct pointers at any block size
+
+typedef struct crash_dev {
+    uint8_t *image;
+    uint32_t writes;    // seen so far
+    uint32_t cut;       // this one and all later ones are lost
+} crash_dev;
+
+int32_t crash_read_block(void *ctx, uint32_t blk, void *buffer, uint32_t size) {
+    crash_dev *dev = (crash_dev *)ctx;
+    memcpy(buffer, dev->image + (size_t)blk * size, size);
+    return SUCCESS;
+}
+
+int32_t crash_write_block(void *ctx, uint32_t blk, const void *buffer, uint32_t size) {
+    crash_dev *dev = (crash_dev *)ctx;
+    if (dev->writes++ < dev->cut) memcpy(dev->image + (size_t)blk * size, buffer, size);
+    return SUCCESS;
+}
+
+int32_t crash_write_file(fs_fs *fs, const char *name, uint8_t fill) {
+    static uint8_t data[CRASH_FILE];
+    memset(data, fill, CRASH_FILE);
+    int32_t ino = fs_ino_mk(fs, fs->header->root_ino, name, S_IFREG >> 3);
+    CHECK_INO(ino);
+    int32_t written = fs_ino_pwrite(fs, ino, data, CRASH_FILE, 0);
+    if (written < 0) return written;
+    return written == CRASH_FILE ? SUCCESS : -ENOSPC;
+}
+
+// Commits /a, then truncates it and writes /b and /c in one transaction.
+// The blocks of /a, its indirect block among them, must not be handed
+// to /b or /c before that transaction commits.
+int32_t crash_scenario(fs_fs *fs) {
+    ERR(crash_write_file(fs, "a", 'a'));
+    ERR(fs_sync(fs));
+    int32_t ino = fs_path_to_ino(fs, "/a");
+    CHECK_INO(ino);
+    ERR(fs_ino_truncate(fs, ino, 0));
+    ERR(crash_write_file(fs, "b", 'b'));
+    return crash_write_file(fs, "c", 'c');
+}
+
+// a file is either missing, empty or whole
+bool crash_file_ok(fs_fs *fs, const char *path, uint8_t fill) {
+    static uint8_t data[CRASH_FILE + 1];
+    int32_t ino = fs_path_to_ino(fs, path);
+    if (ino < 0) return true;
+    int32_t read = fs_ino_pread(fs, ino, data, sizeof(data), 0);
+    if (read != 0 && read != CRASH_FILE) return false;
+    for (int32_t i = 0; i < read; i++) {
+        if (data[i] != fill) return false;
+    }
+    return true;
+}
+
+// Runs the scenario and loses the writes of its final sync from cut on.
+// Returns the writes the sync made, or a negative error.
+int32_t crash_run(uint32_t block_size, uint32_t cut, uint8_t *image, uint32_t *failures) {
+    memset(image, 0, CRASH_IMAGE);
+    crash_dev dev = { image, 0, UINT32_MAX };
+    fs_dev ops = { &dev, crash_read_block, crash_write_block, NULL, NULL };
+    fs_bcache *bcache = (fs_bcache *)calloc(1, sizeof(fs_bcache));
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    if (bcache == NULL || fs == NULL) return -ENOMEM;
+    ERR(fs_create_dev(fs, &ops, bcache, CRASH_IMAGE, block_size));
+    ERR(crash_scenario(fs));
+
+    uint32_t before = dev.writes;
+    dev.cut = before + cut;
+    ERR(fs_sync(fs));
+    uint32_t writes = dev.writes - before;
+    fs_bcache_free(bcache);
+    free(bcache);
+    free(fs);
+
+    // like the next mount, replaying the journal
+    fs_fs check;
+    if (fs_open_raw(&check, image, CRASH_IMAGE) < 0 || fsck(&check, false, 1) != FSCK_OK
+        || !crash_file_ok(&check, "/a", 'a') || !crash_file_ok(&check, "/b", 'b')
+        || !crash_file_ok(&check, "/c", 'c')) {
+        printf("block size %u: crash at write %u of the sync is not consistent\n", block_size, cut);
+        (*failures)++;
+    }
+    return writes;
+}
+
+int main() {
+    uint8_t *image = (uint8_t *)malloc(CRASH_IMAGE);
+    if (image == NULL) return 1;
+    uint32_t sizes[] = { 512, 4096 };
+    uint32_t points = 0;
+    uint32_t failures = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int32_t writes = crash_run(sizes[i], UINT32_MAX, image, &failures);
+        if (writes < 0) {
+            printf("block size %u: %s\n", sizes[i], strerror(-writes));
+            return 1;
+        }
+        for (int32_t cut = 0; cut < writes; cut++) {
+            if (crash_run(sizes[i], cut, image, &failures) < 0) failures++;
+            points++;
+        }
+    }
+    printf("%u crash points, %u inconsistent\n", points, failures);
+    free(image);
+    return failures > 0;
+}
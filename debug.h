@@ -25,42 +25,85 @@ void print_statistics(size_t ino_size, size_t block_size) {
 
 void print_header(fs_header *header) {
     printf("-------- HEADER --------\n");
-    printf("blocks_all: %d\n", header->blocks_all);
-    printf("blocks_header: %d\n", header->blocks_header);
-    printf("blocks_inode: %d\n\n", header->blocks_inode);
-
-    printf("blocks: %d\n", header->blocks);
-    printf("blocks_free: %d\n", header->blocks_total - header->blocks);
-    printf("blocks_avail: %d\n", header->blocks_total - header->blocks);
-    printf("blocks_total: %d\n\n", header->blocks_total);
-
-    printf("inodes: %d\n", header->inodes);
-    printf("inodes_free: %d\n", header->inodes_total - header->inodes);
-    printf("inodes_avail: %d\n", header->inodes_total - header->inodes);
-    printf("inodes_total: %d\n\n", header->inodes_total);
-
-    printf("header_size: %d B\n", header->header_size);
-    printf("inode_size: %d B\n", header->inode_size);
-    printf("block_size: %d B\n", header->block_size);
-    printf("blockp_len: %d\n\n", header->blockp_len);
-
-    printf("max_ino: %d\n", header->max_ino);
-    printf("root_ino: %d\n", header->root_ino);
-    printf("free_ino: %d\n", header->free_ino);
-    printf("free_blk: %d\n", header->free_blk);
+    printf("blocks_all: %u\n", header->blocks_all);
+    printf("blocks_header: %u\n", header->blocks_header);
+    printf("blocks_bitmap: %u\n", header->blocks_bitmap);
+    printf("blocks_journal: %u\n", header->blocks_journal);
+    printf("blocks_inode: %u\n\n", header->blocks_inode);
+
+    printf("blocks: %u\n", header->blocks);
+    printf("blocks_free: %u\n", header->blocks_total - header->blocks);
+    printf("blocks_avail: %u\n", header->blocks_total - header->blocks);
+    printf("blocks_total: %u\n\n", header->blocks_total);
+
+    printf("inodes: %u\n", header->inodes);
+    printf("inodes_free: %u\n", header->inodes_total - header->inodes);
+    printf("inodes_avail: %u\n", header->inodes_total - header->inodes);
+    printf("inodes_total: %u\n\n", header->inodes_total);
+
+    printf("header_size: %u B\n", header->header_size);
+    printf("inode_size: %u B\n", header->inode_size);
+    printf("block_size: %u B\n", header->block_size);
+    printf("blockp_len: %u\n\n", header->blockp_len);
+
+    printf("max_ino: %u\n", header->max_ino);
+    printf("root_ino: %u\n", header->root_ino);
+    printf("free_blk: %u\n", header->free_blk);
+    printf("groups: %u\n", header->groups);
+    printf("inodes_group: %u\n", header->inodes_group);
+    printf("journal_seq: %u\n", header->journal_seq);
+    printf("------------------------\n");
+}
+
+void print_dcache(fs_fs *fs) {
+    if (fs->dcache == NULL) return;
+    printf("-------- DCACHE --------\n");
+    printf("hits: %lu\n", fs->dcache->hits);
+    printf("negative_hits: %lu\n", fs->dcache->negative_hits);
+    printf("misses: %lu\n", fs->dcache->misses);
+    printf("------------------------\n");
+}
+
+void print_ccache(fs_fs *fs) {
+    if (fs->ccache == NULL) return;
+    printf("-------- CCACHE --------\n");
+    printf("hits: %lu\n", fs->ccache->hits);
+    printf("misses: %lu\n", fs->ccache->misses);
+    printf("------------------------\n");
+}
+
+void print_bcache(fs_fs *fs) {
+    if (fs->bcache == NULL) return;
+    printf("-------- BCACHE --------\n");
+    printf("hits: %lu\n", fs->bcache->hits);
+    printf("misses: %lu\n", fs->bcache->misses);
+    printf("writebacks: %lu\n", fs->bcache->writebacks);
+    printf("------------------------\n");
+}
+
+void print_journal(fs_fs *fs) {
+    if (fs->journal.capacity == 0) return;
+    printf("-------- JOURNAL -------\n");
+    printf("commits: %lu\n", fs->journal.commits);
+    printf("logged: %lu\n", fs->journal.logged);
+    printf("overruns: %lu\n", fs->journal.overruns);
     printf("------------------------\n");
 }
 
 void print_debug(fs_fs *fs) {
     printf("-------- DEBUG ---------\n");
-    for (uint16_t i = 1; i < fs->header->inodes_total; i++) {
-        if (fs->inodes[i].ino != i) continue;
-        printf("ino: %d [%d]\n", i, fs->inodes[i].size);
-        uint16_t *p = &fs->inodes[i].block[0];
-        for (size_t j = 0; j < 4; j++) {
-            if (p[j] == BLK_INVALID) continue;
-            printf("  blk: %d    idx: %ld\n", p[j], j);
+    for (uint32_t i = 1; i < fs->header->inodes_total; i++) {
+        fs_inode *inode = fs_get_inode(fs, i);
+        if (inode == NULL) break;
+        if (inode->ino == i) {
+            printf("ino: %u [%lu]%s\n", i, inode->size, fs_inode_inline(inode) ? " inline" : "");
+            uint32_t *p = &inode->block[0];
+            for (size_t j = 0; j < FS_BLOCK_POINTERS + FS_BLOCK_LEVELS && !fs_inode_inline(inode); j++) {
+                if (p[j] == BLK_INVALID) continue;
+                printf("  blk: %u    idx: %ld\n", p[j], j);
+            }
         }
+        fs_put_inode(fs, inode, false);
     }
     printf("------------------------\n");
 }
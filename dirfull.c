@@ -0,0 +1,48 @@
+#define FSCK_NO_MAIN
+#include "fsck.c"
+
+// Fills a directory with links to one file until the bucket of the next
+// name is full and there are FS_DIR_BUCKETS_MAX buckets already. That name
+// must fail with -EMLINK while the disk has room, and the directory must
+// still check out with every name in it.
+
+#define DIRFULL_IMAGE (64 * MB)
+
+int main() {
+    uint8_t *image = (uint8_t *)calloc(1, DIRFULL_IMAGE);
+    fs_fs fs;
+    if (image == NULL || fs_create(&fs, image, DIRFULL_IMAGE, FS_BLOCK_SIZE_MIN) < 0) return 1;
+    int32_t dir = fs_ino_mkdir(&fs, fs.header->root_ino, "dir", 0);
+    int32_t file = fs_ino_mknod(&fs, fs.header->root_ino, "file", S_IFREG >> 3);
+    if (dir < 0 || file < 0) return 1;
+
+    char name[16];
+    uint32_t count = 0;
+    int32_t err;
+    while (true) {
+        snprintf(name, sizeof(name), "%u", count);
+        err = fs_ino_link(&fs, dir, file, name);
+        if (err < 0) break;
+        count++;
+    }
+
+    fs_dir_header *header = fs_dir_get_header(&fs, dir);
+    uint32_t buckets = header != NULL ? fs_dir_buckets(header) : 0;
+    if (header != NULL) fs_put_block(&fs, header, false);
+    uint32_t room = fs.header->blocks_total - fs.header->blocks;
+    printf("%u entries in %u buckets, then %s with %u blocks free\n",
+        count, buckets, strerror(-err), room);
+
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%u", i);
+        if (fs_name_to_ino(&fs, dir, name) != file) missing++;
+    }
+    // a name that is gone makes room again
+    bool reused = fs_ino_unlink(&fs, dir, "0") >= 0 && fs_ino_link(&fs, dir, file, "0") >= 0;
+    bool ok = err == -EMLINK && buckets == FS_DIR_BUCKETS_MAX && room > 0
+        && missing == 0 && reused && fsck(&fs, false, 1) == FSCK_OK;
+    if (missing > 0) printf("%u names missing\n", missing);
+    free(image);
+    return !ok;
+}
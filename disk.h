@@ -0,0 +1,230 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "sfs.h"
+
+// The image behind a FUSE frontend, either mapped or read and written
+// through the buffer cache.
+typedef struct disk {
+    char *path;
+    void *raw;          // NULL with --cache
+    size_t size;
+    int32_t fd;         // -1 without --cache
+    fs_dev dev;
+    fs_bcache *bcache;
+} disk;
+
+// maps the image file, creating it with DISK_SIZE bytes if it is empty
+void *map_disk(char *path, size_t *size) {
+    int32_t fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        *size = DISK_SIZE;
+        if (ftruncate(fd, *size) < 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *raw = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return raw == MAP_FAILED ? NULL : raw;
+}
+
+// True for a new image, or one whose header block holds nothing but
+// zeros. Only that block is read, however large and sparse the image.
+bool blank_disk(const void *raw, size_t size) {
+    const fs_header *header = (const fs_header *)raw;
+    if (size >= sizeof(fs_header) && header->magic == FS_MAGIC) return false;
+    const uint8_t *bytes = (const uint8_t *)raw;
+    for (size_t i = 0; i < MIN(size, FS_BLOCK_SIZE_MIN); i++) {
+        if (bytes[i] != 0) return false;
+    }
+    return true;
+}
+
+int32_t sync_disk(fs_fs *fs) {
+    size_t size = (size_t)fs->header->blocks_all * fs->header->block_size;
+    if (msync(fs->raw, size, MS_SYNC) < 0) return -errno;
+    return SUCCESS;
+}
+
+// block device on top of an image file descriptor, used with --cache
+int32_t file_read_block(void *ctx, uint32_t blk, void *buffer, uint32_t size) {
+    int32_t fd = (intptr_t)ctx;
+    ssize_t n = pread(fd, buffer, size, (off_t)blk * size);
+    if (n < 0) return -errno;
+    if (n != size) return -EIO;
+    return SUCCESS;
+}
+
+int32_t file_read_blocks(void *ctx, uint32_t blk, uint32_t count, void *buffer, uint32_t size) {
+    int32_t fd = (intptr_t)ctx;
+    size_t bytes = (size_t)count * size;
+    ssize_t n = pread(fd, buffer, bytes, (off_t)blk * size);
+    if (n < 0) return -errno;
+    if ((size_t)n != bytes) return -EIO;
+    return SUCCESS;
+}
+
+int32_t file_write_block(void *ctx, uint32_t blk, const void *buffer, uint32_t size) {
+    int32_t fd = (intptr_t)ctx;
+    ssize_t n = pwrite(fd, buffer, size, (off_t)blk * size);
+    if (n < 0) return -errno;
+    if (n != size) return -EIO;
+    return SUCCESS;
+}
+
+int32_t file_flush(void *ctx) {
+    if (fsync((intptr_t)ctx) < 0) return -errno;
+    return SUCCESS;
+}
+
+void populate(fs_fs *fs) {
+    fs_ino_mkdir(fs, fs->header->root_ino, "mydir", 0);
+    uint32_t mydir2 = fs_ino_mkdir(fs, fs->header->root_ino, "mydir2", 0);
+    uint32_t mydir3 = fs_ino_mkdir(fs, mydir2, "mydir3", 0);
+    UNUSED(mydir3);
+    uint32_t abc = fs_ino_mknod(fs, fs->header->root_ino, "abc.txt", S_IFREG >> 3);
+    fs_ino_write_cstr(fs, abc, "Hello world! :)\n");
+    fs_ino_symlink(fs, fs->header->root_ino, "abc", "abc.txt");
+
+    uint32_t xyz = fs_ino_mknod(fs, fs->header->root_ino, "xyz", S_IFREG >> 3);
+    fs_ino_write_cstr(fs, xyz, "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"
+    " :)\n");
+}
+
+// Takes the sfs options and the image filename out of argv, leaving the
+// arguments for FUSE, then mounts the image, formatting it if it is blank,
+// and makes it FS. --cache goes through the buffer cache instead of mapping
+// the image, --commit=MS sets the journal commit interval and
+// --block-size=N the block size of newly formatted images.
+int32_t open_disk(disk *d, int32_t *argc, char **argv) {
+    bool use_cache = false;
+    int32_t commit_interval = -1;
+    uint32_t block_size = FS_BLOCK_SIZE;
+    for (int32_t i = 1; i < *argc;) {
+        if (!strcmp(argv[i], "--cache")) use_cache = true;
+        else if (!strncmp(argv[i], "--commit=", 9)) commit_interval = atoi(argv[i] + 9);
+        else if (!strncmp(argv[i], "--block-size=", 13)) block_size = atoi(argv[i] + 13);
+        else {
+            i++;
+            continue;
+        }
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(argv[0]));
+        (*argc)--;
+    }
+
+    // the image is the first non-option
+    d->path = NULL;
+    int32_t i = 1;
+    while (i < *argc && argv[i][0] == '-') {
+        if (argv[i][1] == 'o' && argv[i][2] == '\0') i++;
+        i++;
+    }
+    if (i < *argc - 1) {
+        d->path = argv[i];
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(argv[0]));
+        (*argc)--;
+    }
+    if (d->path == NULL) d->path = "./disk";
+
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    d->raw = NULL;
+    d->fd = -1;
+    d->dev = (fs_dev){ NULL, file_read_block, file_write_block, file_flush, file_read_blocks };
+    d->bcache = NULL;
+
+    d->raw = map_disk(d->path, &d->size);      // creates and sizes the image
+    if (d->raw == NULL) {
+        perror(d->path);
+        return -1;
+    }
+    bool blank = blank_disk(d->raw, d->size);
+    fs_header *header = (fs_header *)d->raw;
+    if (!blank && header->magic == FS_MAGIC && !fs_version_supported(header->version)) {
+        fprintf(stderr, "%s: sfs version %u is not supported, only %u to %u, "
+            "copy its files to a newly formatted image\n",
+            d->path, header->version, FS_VERSION_MIN, FS_VERSION);
+        return -1;
+    }
+    int32_t err;
+    if (use_cache) {
+        munmap(d->raw, d->size);
+        d->raw = NULL;
+        d->fd = open(d->path, O_RDWR);
+        if (d->fd < 0) {
+            perror(d->path);
+            return -1;
+        }
+        d->dev.ctx = (void *)(intptr_t)d->fd;
+        d->bcache = (fs_bcache *)calloc(1, sizeof(fs_bcache));
+        err = fs_mount_dev(fs, &d->dev, d->bcache, d->size);
+    }
+    else {
+        err = fs_mount(fs, d->raw, d->size);
+    }
+
+    // only an image with a blank header block is formatted, anything else
+    // that does not mount is left alone
+    if (err < 0 && !blank) {
+        fprintf(stderr, "%s: cannot mount: %s\n", d->path, strerror(-err));
+        return -1;
+    }
+    if (err < 0) {
+        printf("formatting %s\n", d->path);
+        err = use_cache
+            ? fs_create_dev(fs, &d->dev, d->bcache, d->size, block_size)
+            : fs_create(fs, d->raw, d->size, block_size);
+        if (err < 0) {
+            fprintf(stderr, "%s: cannot format with %u byte blocks\n", d->path, block_size);
+            return -1;
+        }
+        populate(fs);
+    }
+    if (!use_cache) fs->sync = sync_disk;
+    fs->dcache = (fs_dcache *)calloc(1, sizeof(fs_dcache));
+    MUTEX_INIT(&fs->dcache->lock);
+    fs->ccache = (fs_ccache *)calloc(1, sizeof(fs_ccache));
+    MUTEX_INIT(&fs->ccache->lock);
+    fs->ccache->data = (uint8_t *)malloc(FS_CCACHE_SIZE * fs_cluster_size(fs));
+    if (commit_interval >= 0) fs->journal.interval = commit_interval;
+    FS = fs;
+    return SUCCESS;
+}
+
+void close_disk(disk *d) {
+    if (d->raw != NULL) munmap(d->raw, d->size);
+    if (d->fd >= 0) close(d->fd);
+    if (d->bcache != NULL) fs_bcache_free(d->bcache);
+    free(d->bcache);
+    free(FS->dcache);
+    free(FS->ccache->data);
+    free(FS->ccache);
+    free(FS->stats);
+    free(FS);
+    FS = NULL;
+}
+
+#endif
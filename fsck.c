@@ -0,0 +1,870 @@
+#define FUSE_USE_VERSION 29
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "sfs.h"
+
+// exit codes as used by e2fsck
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_ERROR 8
+
+#define FSCK_CHUNK 32           // inode table blocks per work item
+#define FSCK_THREADS_MAX 64
+#define FSCK_KEPT 0x80000000    // owner bit set once the repair pass kept a block
+
+typedef struct fsck_state {
+    fs_fs *fs;
+    bool repair;
+    uint32_t *owner;        // ino that first referenced each data block
+    uint8_t *used;          // inodes in use
+    uint8_t *damaged;       // inodes with bad block pointers or size
+    uint8_t *reached;       // inodes reachable from the root
+    uint8_t *hidden;        // orphans and the refcount table, in use but not linked
+    uint32_t *shared;       // extra references per block in the refcount table
+    uint32_t *claims;       // extra references found for blocks the table shares
+    uint32_t *links;        // dentries pointing at each inode
+    uint32_t next_chunk;    // next inode table block to scan
+    uint32_t inodes;
+    uint64_t errors;
+    uint64_t unfixed;       // errors a repair cannot correct
+} fsck_state;
+
+// one inode's block tree, fix clears bad slots instead of claiming blocks
+typedef struct fsck_walk {
+    fsck_state *st;
+    uint32_t ino;
+    uint64_t end;           // logical blocks covered by the size
+    bool fix;
+    uint32_t bad;
+    uint32_t past_eof;
+} fsck_walk;
+
+// an entry of a directory being scanned
+typedef struct fsck_entry {
+    uint32_t ino;
+    char name[FS_NAME_LEN_MAX];
+} fsck_entry;
+
+typedef struct fsck_queue {
+    uint32_t *items;
+    size_t head;
+    size_t tail;
+    size_t size;
+} fsck_queue;
+
+#define FSCK_ERR(st, ...)                       \
+{                                               \
+    printf(__VA_ARGS__);                        \
+    __atomic_add_fetch(&(st)->errors, 1, __ATOMIC_RELAXED); \
+}
+
+static inline void fsck_bitmap_set(uint8_t *bitmap, uint32_t i) {
+    __atomic_fetch_or(&bitmap[i / 8], 1 << (i % 8), __ATOMIC_RELAXED);
+}
+
+static inline bool fsck_isdir(fs_inode *inode) {
+    return (inode->mode & (S_IFMT >> 3)) == (S_IFDIR >> 3);
+}
+
+void fsck_slot(fsck_walk *w, uint32_t *slot, uint32_t depth, uint64_t lblk, uint64_t span) {
+    fs_fs *fs = w->st->fs;
+    uint32_t blk = *slot;
+    if (blk == BLK_INVALID) return;
+
+    if (blk >= fs->header->blocks_total) {
+        if (w->fix) *slot = BLK_INVALID;
+        else FSCK_ERR(w->st, "ino %u: block %u out of range\n", w->ino, blk);
+        w->bad++;
+        return;
+    }
+
+    uint32_t *owner = &w->st->owner[blk];
+    bool shared = depth == 0 && w->st->shared != NULL && w->st->shared[blk] > 0;
+    if (w->fix) {
+        if (*owner != w->ino && !shared) {
+            *slot = BLK_INVALID;
+            return;
+        }
+        if (*owner == w->ino) *owner |= FSCK_KEPT;
+    }
+    else {
+        uint32_t expected = INO_INVALID;
+        bool claimed = __atomic_compare_exchange_n(owner, &expected, w->ino, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        if (!claimed && shared) __atomic_add_fetch(&w->st->claims[blk], 1, __ATOMIC_RELAXED);
+        else if (!claimed) {
+            FSCK_ERR(w->st, "ino %u: block %u is also used by ino %u\n", w->ino, blk, expected);
+            w->bad++;
+            return;
+        }
+    }
+
+    if (lblk >= w->end) w->past_eof++;
+    if (depth == 0) return;
+
+    uint32_t len = fs->header->blockp_len;
+    uint32_t *pblock = (uint32_t *)fs_get_block(fs, blk);
+    span /= len;
+    for (uint32_t j = 0; j < len; j++) {
+        fsck_slot(w, &pblock[j], depth - 1, lblk + j * span, span);
+    }
+}
+
+void fsck_walk_blocks(fsck_walk *w, fs_inode *inode) {
+    uint32_t len = w->st->fs->header->blockp_len;
+    for (uint32_t i = 0; i < FS_BLOCK_POINTERS; i++) {
+        fsck_slot(w, &inode->block[i], 0, i, 1);
+    }
+
+    uint64_t base = FS_BLOCK_POINTERS;
+    uint64_t span = 1;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS; level++) {
+        span *= len;
+        fsck_slot(w, fs_inode_root(inode, level), level + 1, base, span);
+        base += span;
+    }
+}
+
+void fsck_scan_inode(fsck_state *st, uint32_t ino) {
+    fs_fs *fs = st->fs;
+    fs_inode *inode = fs_inode_ptr(fs, ino);
+    if (inode->ino != ino) return;
+    if ((inode->mode & (S_IFMT >> 3)) == 0) {
+        FSCK_ERR(st, "ino %u: in use without a file type\n", ino);
+        return;
+    }
+    fsck_bitmap_set(st->used, ino);
+    __atomic_add_fetch(&st->inodes, 1, __ATOMIC_RELAXED);
+
+    if (fs_inode_inline(inode)) {
+        if (inode->size <= FS_INLINE_MAX) return;
+        FSCK_ERR(st, "ino %u: inline size %lu too large\n", ino, inode->size);
+        fsck_bitmap_set(st->damaged, ino);
+        return;
+    }
+
+    fsck_walk w = { st, ino, DIV_CEIL(inode->size, fs->header->block_size), false, 0, 0 };
+    fsck_walk_blocks(&w, inode);
+    if (w.past_eof > 0) FSCK_ERR(st, "ino %u: %u blocks past the end of the file\n", ino, w.past_eof);
+    if (w.bad > 0 || w.past_eof > 0) fsck_bitmap_set(st->damaged, ino);
+}
+
+void fsck_load_slot(fsck_state *st, uint32_t blk, uint32_t depth, uint64_t lblk, uint64_t span) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->blocks_total;
+    uint32_t len = fs->header->blockp_len;
+    if (blk == BLK_INVALID || blk >= total) return;
+
+    uint32_t *pblock = (uint32_t *)fs_get_block(fs, blk);
+    if (depth > 0) {
+        span /= len;
+        for (uint32_t j = 0; j < len; j++) {
+            fsck_load_slot(st, pblock[j], depth - 1, lblk + j * span, span);
+        }
+        return;
+    }
+    for (uint32_t j = 0; j < len && lblk * len + j < total; j++) {
+        st->shared[lblk * len + j] = pblock[j];
+    }
+}
+
+// reads the refcount table, see fs_refcount_ptr, before the scan needs it
+void fsck_load_refcounts(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t ino = fs->header->refcount_ino;
+    if (ino == INO_INVALID) return;
+    fs_inode *inode = fs_inode_ptr(fs, ino);
+    if (inode->ino != ino || (inode->mode & (S_IFMT >> 3)) != (S_IFREG >> 3)) {
+        FSCK_ERR(st, "refcount table ino %u is not a file\n", ino);
+        if (st->repair) fs->header->refcount_ino = INO_INVALID;
+        return;
+    }
+
+    fs_bitmap_set(st->hidden, ino);
+    uint32_t total = fs->header->blocks_total;
+    st->shared = (uint32_t *)calloc(total, sizeof(uint32_t));
+    st->claims = (uint32_t *)calloc(total, sizeof(uint32_t));
+    if (fs_inode_inline(inode)) return;
+
+    uint32_t len = fs->header->blockp_len;
+    for (uint32_t i = 0; i < FS_BLOCK_POINTERS; i++) {
+        fsck_load_slot(st, inode->block[i], 0, i, 1);
+    }
+    uint64_t base = FS_BLOCK_POINTERS;
+    uint64_t span = 1;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS; level++) {
+        span *= len;
+        fsck_load_slot(st, *fs_inode_root(inode, level), level + 1, base, span);
+        base += span;
+    }
+}
+
+// compares the table with the extra references the scan found
+void fsck_check_refcounts(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t shared = 0;
+    uint32_t wrong = 0;
+    for (uint32_t blk = 1; st->shared != NULL && blk < fs->header->blocks_total; blk++) {
+        uint32_t found = st->owner[blk] != INO_INVALID ? st->claims[blk] : 0;
+        shared += found > 0;
+        if (st->shared[blk] == found) continue;
+        wrong++;
+        uint32_t *count = st->repair ? fs_refcount_ptr(fs, blk, false) : NULL;
+        if (count != NULL) *count = found;
+    }
+
+    if (wrong > 0) {
+        FSCK_ERR(st, "%u blocks with wrong reference counts\n", wrong);
+    }
+    if (fs->header->blocks_shared != shared) {
+        FSCK_ERR(st, "header counts %u shared blocks, found %u\n", fs->header->blocks_shared, shared);
+        if (st->repair) fs->header->blocks_shared = shared;
+    }
+}
+
+// scans chunks of the inode table in order until none are left
+void *fsck_scan_worker(void *arg) {
+    fsck_state *st = (fsck_state *)arg;
+    fs_header *header = st->fs->header;
+    uint32_t per_block = header->block_size / sizeof(fs_inode);
+
+    while (true) {
+        uint32_t first = __atomic_fetch_add(&st->next_chunk, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= header->blocks_inode) break;
+        uint32_t last = MIN(header->blocks_inode, first + FSCK_CHUNK);
+        for (uint32_t ino = MAX(first * per_block, 1); ino < last * per_block; ino++) {
+            fsck_scan_inode(st, ino);
+        }
+    }
+    return NULL;
+}
+
+// clears the slots found bad by the scan and drops blocks past the end
+void fsck_repair_inodes(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    for (uint32_t ino = 1; ino < fs->header->inodes_total; ino++) {
+        if (!fs_bitmap_get(st->damaged, ino)) continue;
+        fs_inode *inode = fs_inode_ptr(fs, ino);
+        if (fs_inode_inline(inode)) {
+            inode->size = FS_INLINE_MAX;
+            continue;
+        }
+        fsck_walk w = { st, ino, DIV_CEIL(inode->size, fs->header->block_size), true, 0, 0 };
+        fsck_walk_blocks(&w, inode);
+    }
+}
+
+// frees the blocks past the end once the bitmap is right
+void fsck_trim_inodes(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    for (uint32_t ino = 1; ino < fs->header->inodes_total; ino++) {
+        if (!fs_bitmap_get(st->damaged, ino)) continue;
+        fs_inode *inode = fs_inode_ptr(fs, ino);
+        if (fs_inode_inline(inode)) continue;
+        fs_ino_free_blocks(fs, ino, MIN(DIV_CEIL(inode->size, fs->header->block_size), UINT32_MAX));
+    }
+}
+
+// compares the block bitmap with the blocks referenced by inodes
+void fsck_check_bitmap(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->blocks_total;
+    uint32_t bits = fs->header->block_size * 8;
+    uint32_t leaked = 0;
+    uint32_t missing = 0;
+    uint32_t blocks = 0;
+
+    // each bitmap block covers one group
+    for (uint32_t base = 0; base < total; base += bits) {
+        uint8_t *bitmap = fs_get_bitmap(fs, base);
+        uint32_t end = MIN(total - base, bits);
+        uint32_t group_blocks = 0;
+        for (uint32_t i = 0; i < end; i++) {
+            uint32_t blk = base + i;
+            bool referenced = blk == BLK_INVALID || st->owner[blk] != INO_INVALID;
+            bool marked = fs_bitmap_get(bitmap, i);
+            group_blocks += referenced && blk != BLK_INVALID;
+            if (referenced == marked) continue;
+            if (marked) leaked++;
+            else missing++;
+            if (!st->repair) continue;
+            if (referenced) fs_bitmap_set(bitmap, i);
+            else fs_bitmap_clear(bitmap, i);
+        }
+
+        fs_group *group = fs_get_group(fs, fs_blk_group(fs, base));
+        if (group->blocks != group_blocks) {
+            FSCK_ERR(st, "group %u: counts %u blocks in use, found %u\n",
+                fs_blk_group(fs, base), group->blocks, group_blocks);
+            if (st->repair) group->blocks = group_blocks;
+        }
+        blocks += group_blocks;
+    }
+
+    if (leaked > 0) {
+        FSCK_ERR(st, "%u blocks marked in use but unreferenced\n", leaked);
+    }
+    if (missing > 0) {
+        FSCK_ERR(st, "%u referenced blocks marked free\n", missing);
+    }
+    if (fs->header->blocks != blocks) {
+        FSCK_ERR(st, "header counts %u blocks in use, found %u\n", fs->header->blocks, blocks);
+        if (st->repair) fs->header->blocks = blocks;
+    }
+    if (fs->header->free_blk >= total) {
+        FSCK_ERR(st, "free block hint %u out of range\n", fs->header->free_blk);
+        if (st->repair) fs->header->free_blk = 1;
+    }
+}
+
+// puts every inode not in use on its group's free list in ascending order
+void fsck_rebuild_free_lists(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->inodes_total;
+    for (uint32_t g = 0; g < fs->header->groups; g++) {
+        uint32_t *link = &fs_get_group(fs, g)->free_ino;
+        uint32_t end = MIN((uint64_t)(g + 1) * fs->header->inodes_group, total);
+        for (uint32_t ino = MAX(g * fs->header->inodes_group, 1); ino < end; ino++) {
+            if (fs_bitmap_get(st->used, ino)) continue;
+            *link = ino;
+            link = &fs_inode_ptr(fs, ino)->ino;
+        }
+        *link = INO_INVALID;
+    }
+    fs_inode_ptr(fs, INO_INVALID)->ino = INO_INVALID;
+}
+
+// Follows the inode free list of every group, which has to hold every
+// inode of the group not in use, and checks the group's counts.
+void fsck_check_free_lists(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->inodes_total;
+    uint8_t *seen = (uint8_t *)calloc(DIV_CEIL(total, 8), 1);
+    bool broken = false;
+
+    for (uint32_t g = 0; g < fs->header->groups; g++) {
+        fs_group *group = fs_get_group(fs, g);
+        uint32_t count = 0;
+        bool cut = false;
+        uint32_t ino = group->free_ino;
+        while (ino != INO_INVALID) {
+            if (ino >= total || fs_ino_group(fs, ino) != g
+                || fs_bitmap_get(seen, ino) || fs_bitmap_get(st->used, ino)) {
+                FSCK_ERR(st, "group %u: inode free list broken at ino %u\n", g, ino);
+                cut = true;
+                break;
+            }
+            fs_bitmap_set(seen, ino);
+            count++;
+            ino = fs_inode_ptr(fs, ino)->ino;
+        }
+
+        // directories are counted like fs_ino_isdir does
+        uint32_t inodes = 0;
+        uint32_t dirs = 0;
+        uint32_t end = MIN((uint64_t)(g + 1) * fs->header->inodes_group, total);
+        for (ino = MAX(g * fs->header->inodes_group, 1); ino < end; ino++) {
+            if (!fs_bitmap_get(st->used, ino)) continue;
+            inodes++;
+            dirs += (fs_inode_ptr(fs, ino)->mode & (S_IFDIR >> 3)) != 0;
+        }
+        uint32_t free_inodes = fs_group_inodes(fs, g) - inodes;
+        if (!cut && count != free_inodes) {
+            FSCK_ERR(st, "group %u: inode free list holds %u inodes, %u are free\n", g, count, free_inodes);
+            cut = true;
+        }
+        broken |= cut;
+        if (group->inodes != inodes || group->dirs != dirs) {
+            FSCK_ERR(st, "group %u: counts %u inodes and %u directories, found %u and %u\n",
+                g, group->inodes, group->dirs, inodes, dirs);
+            if (st->repair) {
+                group->inodes = inodes;
+                group->dirs = dirs;
+            }
+        }
+    }
+    free(seen);
+    if (broken && st->repair) fsck_rebuild_free_lists(st);
+}
+
+// Orphans are unlinked but still in use until the next mount reclaims
+// them. A repair cuts the list before the first bad entry, the inodes
+// after it are then freed as unlinked.
+void fsck_check_orphan_list(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->inodes_total;
+    uint32_t *link = &fs->header->orphan_ino;
+    while (*link != INO_INVALID) {
+        uint32_t ino = *link;
+        fs_inode *inode = ino < total ? fs_inode_ptr(fs, ino) : NULL;
+        if (inode == NULL || !fs_bitmap_get(st->used, ino)
+            || fs_bitmap_get(st->hidden, ino) || inode->refs != 0) {
+            FSCK_ERR(st, "orphan list broken at ino %u\n", ino);
+            if (st->repair) *link = INO_INVALID;
+            break;
+        }
+        fs_bitmap_set(st->hidden, ino);
+        link = &inode->time;
+    }
+}
+
+void fsck_queue_push(fsck_queue *queue, uint32_t ino) {
+    if (queue->tail == queue->size) {
+        queue->size = MAX(queue->size * 2, 64);
+        queue->items = (uint32_t *)realloc(queue->items, queue->size * sizeof(uint32_t));
+    }
+    queue->items[queue->tail++] = ino;
+}
+
+// whether a whole dentry starts at offset in the used bytes of entries
+static inline bool fsck_dentry_valid(const uint8_t *entries, uint32_t used, uint32_t offset) {
+    if (offset + offsetof(fs_dentry, name) > used) return false;
+    fs_dentry *dentry = (fs_dentry *)(entries + offset);
+    if (dentry->len >= FS_NAME_LEN_MAX) return false;
+    if (offset + fs_dentry_size(dentry->len) > used) return false;
+    const char *name = &dentry->name;
+    return name[dentry->len] == '\0' && _strlen(name) == dentry->len;
+}
+
+// replaces a directory that cannot be read with an empty one
+bool fsck_dir_reset(fsck_state *st, uint32_t ino, uint32_t parent) {
+    fs_fs *fs = st->fs;
+    if (fs_ino_truncate(fs, ino, 0) < 0 || fs_dir_init(fs, ino) < 0) return false;
+    if (fs_dir_insert(fs, ino, ino, ".") < 0 || fs_dir_insert(fs, ino, parent, "..") < 0) return false;
+    st->links[ino]++;
+    st->links[parent]++;
+    return true;
+}
+
+// Checks one dentry of directory ino, reached from parent, and queues the
+// directories it reaches first. Sets bit 0 of dots for ".", bit 1 for "..".
+// Returns false if the dentry has to go.
+bool fsck_dentry(fsck_state *st, uint32_t ino, uint32_t parent, fs_dentry *dentry, uint32_t *dots, fsck_queue *queue) {
+    fs_fs *fs = st->fs;
+    const char *name = &dentry->name;
+    bool is_dot = !_strcmp(name, ".");
+    bool is_dotdot = !_strcmp(name, "..");
+    uint32_t child = dentry->ino;
+
+    if (child == INO_INVALID || child >= fs->header->inodes_total || !fs_bitmap_get(st->used, child)) {
+        FSCK_ERR(st, "ino %u: entry '%s' points to free ino %u\n", ino, name, child);
+        return false;
+    }
+    if ((is_dot && child != ino) || (is_dotdot && child != parent)) {
+        FSCK_ERR(st, "ino %u: entry '%s' points to ino %u\n", ino, name, child);
+        if (st->repair) dentry->ino = child = is_dot ? ino : parent;
+    }
+    if (is_dot || is_dotdot) {
+        *dots |= is_dot ? 1 : 2;
+        st->links[child]++;
+        return true;
+    }
+
+    bool isdir = fsck_isdir(fs_inode_ptr(fs, child));
+    if (isdir && fs_bitmap_get(st->reached, child)) {
+        FSCK_ERR(st, "ino %u: entry '%s' links directory %u a second time\n", ino, name, child);
+        return false;
+    }
+    st->links[child]++;
+    if (!fs_bitmap_get(st->reached, child) && isdir) {
+        fsck_queue_push(queue, child);
+        fsck_queue_push(queue, ino);
+    }
+    fs_bitmap_set(st->reached, child);
+    return true;
+}
+
+// legacy linear directories are only checked, a repair converts them first
+bool fsck_dir_scan_linear(fsck_state *st, uint32_t ino, uint32_t parent, fsck_queue *queue) {
+    fs_fs *fs = st->fs;
+    uint32_t size = fs_inode_ptr(fs, ino)->size;
+    uint8_t *entries = (uint8_t *)malloc(size);
+    if (entries == NULL || fs_ino_pread(fs, ino, entries, size, 0) != (int32_t)size) {
+        free(entries);
+        return false;
+    }
+
+    uint32_t dots = 0;
+    uint32_t offset = 0;
+    while (offset < size) {
+        if (!fsck_dentry_valid(entries, size, offset)) {
+            FSCK_ERR(st, "ino %u: corrupt after %u bytes\n", ino, offset);
+            break;
+        }
+        fs_dentry *dentry = (fs_dentry *)(entries + offset);
+        fsck_dentry(st, ino, parent, dentry, &dots, queue);
+        offset += fs_dentry_size(dentry->len);
+    }
+    free(entries);
+    if (dots != 3) FSCK_ERR(st, "ino %u: missing '.' or '..'\n", ino);
+    return true;
+}
+
+// Checks the dentries of directory ino. Entries of free inodes and second
+// links to directories are dropped, entries in the wrong bucket moved.
+// Returns false if the directory is unreadable.
+bool fsck_dir_scan(fsck_state *st, uint32_t ino, uint32_t parent, fsck_queue *queue) {
+    fs_fs *fs = st->fs;
+    fs_inode *inode = fs_inode_ptr(fs, ino);
+    uint32_t block_size = fs->header->block_size;
+    if (inode->size == 0) return false;
+    if (inode->size < block_size) {
+        if (!st->repair) return fsck_dir_scan_linear(st, ino, parent, queue);
+        if (fs_dir_prepare(fs, ino) < 0) return false;
+    }
+
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    if (header == NULL) return false;
+    uint32_t buckets = header->buckets;
+    bool pow2 = buckets > 0 && (buckets & (buckets - 1)) == 0;
+    bool split = header->split == 0 || (header->split < buckets && buckets * 2 <= FS_DIR_BUCKETS_MAX);
+    if (!pow2 || !split || buckets > FS_DIR_BUCKETS_MAX) return false;
+    if (inode->size != (1 + fs_dir_buckets(header)) * (uint64_t)block_size) return false;
+
+    uint32_t capacity = block_size - offsetof(fs_dir_bucket, dentries);
+    uint32_t dots = 0;
+    fsck_entry *moved = NULL;
+    size_t moved_count = 0;
+    uint32_t entries = 0;
+    for (uint32_t b = 0; b < fs_dir_buckets(header); b++) {
+        fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, b);
+        if (bucket == NULL) {
+            free(moved);
+            return false;
+        }
+
+        uint32_t used = MIN(bucket->used, capacity);
+        uint32_t offset = 0;
+        while (offset < used) {
+            if (!fsck_dentry_valid(bucket->dentries, used, offset)) {
+                FSCK_ERR(st, "ino %u: bucket %u is corrupt after %u bytes\n", ino, b, offset);
+                if (st->repair) bucket->used = offset;
+                break;
+            }
+
+            fs_dentry *dentry = (fs_dentry *)(bucket->dentries + offset);
+            const char *name = &dentry->name;
+            bool keep = fsck_dentry(st, ino, parent, dentry, &dots, queue);
+            bool misplaced = keep && fs_dir_bucket_of(header, fs_dir_hash(name)) != b;
+            if (misplaced) {
+                FSCK_ERR(st, "ino %u: entry '%s' in the wrong bucket\n", ino, name);
+                if (st->repair) {
+                    moved = (fsck_entry *)realloc(moved, (moved_count + 1) * sizeof(fsck_entry));
+                    moved[moved_count].ino = dentry->ino;
+                    _memcpy(moved[moved_count++].name, name, dentry->len + 1);
+                }
+            }
+
+            if (st->repair && (!keep || misplaced)) {
+                fs_dir_bucket_remove(bucket, dentry);
+                used -= fs_dentry_size(dentry->len);
+                continue;
+            }
+            entries++;
+            offset += fs_dentry_size(dentry->len);
+        }
+    }
+
+    if (header->entries != entries) {
+        FSCK_ERR(st, "ino %u: header counts %u entries, found %u\n", ino, header->entries, entries);
+        if (st->repair) header->entries = entries;
+    }
+    for (size_t i = 0; i < moved_count; i++) {
+        if (fs_dir_insert(fs, ino, moved[i].ino, moved[i].name) < 0) st->links[moved[i].ino]--;
+    }
+    free(moved);
+
+    if (dots != 3) {
+        FSCK_ERR(st, "ino %u: missing '.' or '..'\n", ino);
+        if (st->repair && !(dots & 1) && fs_dir_insert(fs, ino, ino, ".") == SUCCESS) st->links[ino]++;
+        if (st->repair && !(dots & 2) && fs_dir_insert(fs, ino, parent, "..") == SUCCESS) st->links[parent]++;
+    }
+    return true;
+}
+
+// walks the tree below ino breadth first, counting links as it goes
+void fsck_dir_walk(fsck_state *st, uint32_t ino, uint32_t parent) {
+    fsck_queue queue = { 0 };
+    fs_bitmap_set(st->reached, ino);
+    fsck_queue_push(&queue, ino);
+    fsck_queue_push(&queue, parent);
+
+    while (queue.head < queue.tail) {
+        uint32_t dir = queue.items[queue.head++];
+        uint32_t dir_parent = queue.items[queue.head++];
+        if (fs_bitmap_get(st->damaged, dir) && !st->repair) {
+            printf("ino %u: directory with bad blocks not checked\n", dir);
+            continue;
+        }
+        if (fsck_dir_scan(st, dir, dir_parent, &queue)) continue;
+
+        FSCK_ERR(st, "ino %u: directory is unreadable\n", dir);
+        if (st->repair && !fsck_dir_reset(st, dir, dir_parent)) st->unfixed++;
+    }
+    free(queue.items);
+}
+
+int32_t fsck_lost_found(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t root = fs->header->root_ino;
+    int32_t ino = fs_dir_lookup(fs, root, "lost+found");
+    if (ino != -ENOENT) return ino > 0 && fs_ino_isdir(fs, ino) ? ino : -ENOTDIR;
+
+    ino = fs_ino_mkdir(fs, root, "lost+found", S_IRWXU);
+    if (ino > 0) {
+        fsck_bitmap_set(st->used, ino);
+        fsck_bitmap_set(st->reached, ino);
+        st->inodes++;
+    }
+    return ino;
+}
+
+// in use but neither linked nor waiting to be reclaimed
+static inline bool fsck_unreached(fsck_state *st, uint32_t ino) {
+    return fs_bitmap_get(st->used, ino) && !fs_bitmap_get(st->reached, ino)
+        && !fs_bitmap_get(st->hidden, ino);
+}
+
+// marks the inodes named in the buckets of an unreached directory
+void fsck_dir_children(fsck_state *st, uint32_t ino, uint8_t *children) {
+    fs_fs *fs = st->fs;
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    if (header == NULL) return;
+
+    uint32_t capacity = fs->header->block_size - offsetof(fs_dir_bucket, dentries);
+    for (uint32_t b = 0; b < MIN(fs_dir_buckets(header), FS_DIR_BUCKETS_MAX); b++) {
+        fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, b);
+        if (bucket == NULL) return;
+        uint32_t used = MIN(bucket->used, capacity);
+        uint32_t offset = 0;
+        while (fsck_dentry_valid(bucket->dentries, used, offset)) {
+            fs_dentry *dentry = (fs_dentry *)(bucket->dentries + offset);
+            bool dots = !_strcmp(&dentry->name, ".") || !_strcmp(&dentry->name, "..");
+            if (!dots && dentry->ino < fs->header->inodes_total) fs_bitmap_set(children, dentry->ino);
+            offset += fs_dentry_size(dentry->len);
+        }
+    }
+}
+
+// Links inodes in use that no directory reaches into lost+found. Files
+// that were never linked are freed. Orphans inside orphaned directories
+// are reached through their directory and stay where they are.
+void fsck_reconnect(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->inodes_total;
+    int32_t lost = INO_INVALID;
+
+    uint8_t *inner = (uint8_t *)calloc(DIV_CEIL(total, 8), 1);
+    for (uint32_t ino = 1; ino < total; ino++) {
+        if (!fsck_unreached(st, ino)) continue;
+        if (fsck_isdir(fs_inode_ptr(fs, ino))) fsck_dir_children(st, ino, inner);
+    }
+
+    // cycles of orphaned directories are broken up on the second round
+    for (uint32_t round = 0; round < 2 && lost >= 0; round++) {
+        for (uint32_t ino = 1; ino < total; ino++) {
+            if (!fsck_unreached(st, ino)) continue;
+            if (round == 0 && fs_bitmap_get(inner, ino)) continue;
+
+            fs_inode *inode = fs_inode_ptr(fs, ino);
+            if (!fsck_isdir(inode) && inode->refs == 0) {
+                printf("ino %u: freeing unlinked inode\n", ino);
+                fs_free_inode(fs, ino);
+                fs_bitmap_clear(st->used, ino);
+                st->inodes--;
+                continue;
+            }
+
+            if (lost == INO_INVALID) lost = fsck_lost_found(st);
+            if (lost < 0) break;
+            char name[FS_NAME_LEN_MAX];
+            snprintf(name, sizeof(name), "#%u", ino);
+            if (fs_dir_add(fs, lost, ino, name) < 0) continue;
+            printf("ino %u: reconnected to /lost+found/%s\n", ino, name);
+            fs_bitmap_set(st->reached, ino);
+            if (fsck_isdir(inode)) fsck_dir_walk(st, ino, lost);
+        }
+    }
+    free(inner);
+}
+
+// counts the dentries of every inode and compares them with refs
+void fsck_check_tree(fsck_state *st) {
+    fs_fs *fs = st->fs;
+    uint32_t total = fs->header->inodes_total;
+    uint32_t root = fs->header->root_ino;
+    if (!fs_bitmap_get(st->used, root) || !fsck_isdir(fs_inode_ptr(fs, root))) {
+        FSCK_ERR(st, "root ino %u is not a directory\n", root);
+        st->unfixed++;
+        return;
+    }
+
+    // the second pass recounts the links with the orphans reconnected
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        _memset(st->reached, 0, DIV_CEIL(total, 8));
+        _memset(st->links, 0, total * sizeof(uint32_t));
+        fsck_dir_walk(st, root, root);
+
+        uint32_t orphans = 0;
+        for (uint32_t ino = 1; ino < total; ino++) {
+            orphans += fsck_unreached(st, ino);
+        }
+        if (orphans == 0) break;
+        if (pass > 0) {
+            FSCK_ERR(st, "%u inodes could not be reconnected\n", orphans);
+            st->unfixed++;
+            break;
+        }
+        FSCK_ERR(st, "%u inodes in use are not reachable\n", orphans);
+        if (!st->repair) break;
+        fsck_reconnect(st);
+    }
+
+    for (uint32_t ino = 1; ino < total; ino++) {
+        if (!fs_bitmap_get(st->used, ino) || !fs_bitmap_get(st->reached, ino)) continue;
+        fs_inode *inode = fs_inode_ptr(fs, ino);
+        if (inode->refs == st->links[ino]) continue;
+        FSCK_ERR(st, "ino %u: refs %u, found %u links\n", ino, inode->refs, st->links[ino]);
+        if (st->repair) inode->refs = st->links[ino];
+    }
+
+    if (fs->header->inodes != st->inodes) {
+        FSCK_ERR(st, "header counts %u inodes in use, found %u\n", fs->header->inodes, st->inodes);
+        if (st->repair) fs->header->inodes = st->inodes;
+    }
+}
+
+// the regions described by the header have to add up
+bool fsck_check_header(fs_header *header) {
+    uint32_t per_block = header->block_size / sizeof(fs_inode);
+    uint64_t meta = (uint64_t)header->blocks_header + header->blocks_bitmap
+        + header->blocks_journal + header->blocks_inode;
+    return meta + header->blocks_total == header->blocks_all
+        && (uint64_t)header->blocks_bitmap * header->block_size * 8 >= header->blocks_all
+        && header->blockp_len == header->block_size / sizeof(uint32_t)
+        && header->inodes_total == (uint64_t)header->blocks_inode * per_block
+        && header->max_ino == header->inodes_total - 1
+        && header->groups == DIV_CEIL(header->blocks_total, header->block_size * 8)
+        && header->blocks_header > DIV_CEIL(header->groups, header->block_size / sizeof(fs_group))
+        && header->root_ino != INO_INVALID && header->root_ino < header->inodes_total;
+}
+
+int32_t fsck(fs_fs *fs, bool repair, uint32_t threads) {
+    fs_header *header = fs->header;
+    fsck_state st = { 0 };
+    st.fs = fs;
+    st.repair = repair;
+    st.owner = (uint32_t *)calloc(header->blocks_total, sizeof(uint32_t));
+    st.used = (uint8_t *)calloc(DIV_CEIL(header->inodes_total, 8), 1);
+    st.damaged = (uint8_t *)calloc(DIV_CEIL(header->inodes_total, 8), 1);
+    st.reached = (uint8_t *)calloc(DIV_CEIL(header->inodes_total, 8), 1);
+    st.hidden = (uint8_t *)calloc(DIV_CEIL(header->inodes_total, 8), 1);
+    st.links = (uint32_t *)calloc(header->inodes_total, sizeof(uint32_t));
+    if (!st.owner || !st.used || !st.damaged || !st.reached || !st.hidden || !st.links) return -ENOMEM;
+    fsck_load_refcounts(&st);
+
+    // the inode table is read front to back, one chunk per worker at a time
+    size_t start = (size_t)fs->inode_start * header->block_size;
+    size_t skew = start % SYS_PAGE_SIZE;
+    madvise(fs->raw + start - skew, (size_t)header->blocks_inode * header->block_size + skew, MADV_WILLNEED);
+    pthread_t tids[FSCK_THREADS_MAX];
+    uint32_t started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, fsck_scan_worker, &st) == 0) started++;
+    if (started == 0) fsck_scan_worker(&st);
+    for (uint32_t i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    fsck_check_refcounts(&st);
+    if (repair) fsck_repair_inodes(&st);
+    fsck_check_bitmap(&st);
+    fsck_check_free_lists(&st);
+    if (repair) fsck_trim_inodes(&st);
+    fsck_check_orphan_list(&st);
+    fsck_check_tree(&st);
+
+    free(st.owner);
+    free(st.used);
+    free(st.damaged);
+    free(st.reached);
+    free(st.hidden);
+    free(st.shared);
+    free(st.claims);
+    free(st.links);
+    if (st.errors == 0) return FSCK_OK;
+    return repair && st.unfixed == 0 ? FSCK_FIXED : FSCK_UNFIXED;
+}
+
+// crash.c builds the checker in without this
+#ifndef FSCK_NO_MAIN
+int main(int argc, char **argv) {
+    // -y repairs the image, without it the image is mapped privately so
+    // that not even a journal replay reaches the disk
+    bool repair = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t opt;
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        if (opt == 'y') repair = true;
+        else if (opt == 'n') repair = false;
+        else if (opt == 'j') threads = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n|-y] [-j threads] image\n", argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n|-y] [-j threads] image\n", argv[0]);
+        return FSCK_ERROR;
+    }
+    threads = MIN(MAX(threads, 1), FSCK_THREADS_MAX);
+    char *path = argv[optind];
+
+    int32_t fd = open(path, repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return FSCK_ERROR;
+    }
+    size_t size = st.st_size;
+    void *raw = mmap(NULL, size, PROT_READ | PROT_WRITE, repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (raw == MAP_FAILED) {
+        perror(path);
+        return FSCK_ERROR;
+    }
+
+    fs_header *header = (fs_header *)raw;
+    if (size >= FS_BLOCK_SIZE_MIN && header->magic == FS_MAGIC && !fs_version_supported(header->version)) {
+        fprintf(stderr, "%s: sfs version %u is not supported, only %u to %u\n",
+            path, header->version, FS_VERSION_MIN, FS_VERSION);
+        return FSCK_ERROR;
+    }
+
+    fs_fs *fs = (fs_fs *)malloc(sizeof(fs_fs));
+    if (size < FS_BLOCK_SIZE_MIN || fs_open_raw(fs, raw, size) < 0 || !fsck_check_header(fs->header)) {
+        fprintf(stderr, "%s: no valid sfs header\n", path);
+        return FSCK_ERROR;
+    }
+
+    int32_t ret = fsck(fs, repair, threads);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+        return FSCK_ERROR;
+    }
+    printf("%s: %u/%u inodes, %u/%u blocks%s\n", path,
+        fs->header->inodes, fs->header->inodes_total,
+        fs->header->blocks, fs->header->blocks_total,
+        ret == FSCK_OK ? "" : ret == FSCK_FIXED ? ", repaired" : ", errors left");
+
+    if (repair && msync(raw, size, MS_SYNC) < 0) ret = FSCK_ERROR;
+    munmap(raw, size);
+    free(fs);
+    return ret;
+}
+#endif
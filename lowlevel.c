@@ -0,0 +1,609 @@
+#define FUSE_USE_VERSION 29
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fuse_lowlevel.h>
+
+#include "sfs.h"
+#include "disk.h"
+#include "debug.h"
+
+// FUSE frontend on the low-level API. Requests name inodes instead of
+// paths, so the kernel caches lookups and attributes for SFS_LL_TIMEOUT
+// and nothing is resolved by path. The root inode of every image is 1,
+// which is FUSE_ROOT_ID, so inode numbers are passed on unchanged.
+
+#define SFS_LL_TIMEOUT 60.0     // s, every change goes through the kernel
+#define SFS_LL_VIRTUAL UINT32_MAX   // minus the kind, past every inode
+
+// Files that are open through the frontend. When the last link of an
+// open file is removed it stays on the orphan list, where the reclaimer
+// passes it over, and it is freed on its last release.
+typedef struct sfs_ll_inode {
+    uint32_t ino;
+    uint32_t count;
+    bool orphan;        // lost its last link while open
+    struct sfs_ll_inode *next;
+} sfs_ll_inode;
+
+sfs_ll_inode *sfs_ll_opens;
+sys_mutex sfs_ll_open_lock = MUTEX_INITIALIZER;
+
+// a snapshot of a directory, in the format readdir replies with
+typedef struct sfs_ll_dir {
+    fuse_req_t req;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+} sfs_ll_dir;
+
+static inline uint32_t sfs_ll_virtual(fuse_ino_t ino) {
+    if (ino > SFS_LL_VIRTUAL || ino < SFS_LL_VIRTUAL - SFS_VIRTUAL_TRACE) return SFS_VIRTUAL_NONE;
+    return SFS_LL_VIRTUAL - ino;
+}
+
+static inline void sfs_ll_reply(fuse_req_t req, int32_t err) {
+    fuse_reply_err(req, err < 0 ? -err : 0);
+}
+
+void sfs_ll_opened(uint32_t ino) {
+    MUTEX_LOCK(&sfs_ll_open_lock);
+    sfs_ll_inode *open = sfs_ll_opens;
+    while (open != NULL && open->ino != ino) open = open->next;
+    if (open == NULL && (open = (sfs_ll_inode *)malloc(sizeof(sfs_ll_inode))) != NULL) {
+        *open = (sfs_ll_inode){ ino, 0, false, sfs_ll_opens };
+        sfs_ll_opens = open;
+    }
+    if (open != NULL) open->count++;
+    MUTEX_UNLOCK(&sfs_ll_open_lock);
+}
+
+// true once the last handle of an orphan is closed
+bool sfs_ll_closed(uint32_t ino) {
+    MUTEX_LOCK(&sfs_ll_open_lock);
+    sfs_ll_inode **link = &sfs_ll_opens;
+    while (*link != NULL && (*link)->ino != ino) link = &(*link)->next;
+    bool orphan = false;
+    sfs_ll_inode *open = *link;
+    if (open != NULL && --open->count == 0) {
+        orphan = open->orphan;
+        *link = open->next;
+        free(open);
+    }
+    MUTEX_UNLOCK(&sfs_ll_open_lock);
+    return orphan;
+}
+
+// fs->busy, only ever asked about inodes without links
+bool sfs_ll_busy(fs_fs *fs, uint32_t ino) {
+    UNUSED(fs);
+    MUTEX_LOCK(&sfs_ll_open_lock);
+    sfs_ll_inode *open = sfs_ll_opens;
+    while (open != NULL && open->ino != ino) open = open->next;
+    if (open != NULL) open->orphan = true;
+    MUTEX_UNLOCK(&sfs_ll_open_lock);
+    return open != NULL;
+}
+
+int32_t sfs_ll_stat(uint32_t ino, struct stat *st) {
+    _memset(st, 0, sizeof(struct stat));
+    ERR(sfs_stat(ino, st));
+    st->st_ino = ino;
+    return SUCCESS;
+}
+
+int32_t sfs_ll_virtual_stat(uint32_t kind, struct stat *st) {
+    _memset(st, 0, sizeof(struct stat));
+    ERR(sfs_virtual_stat(kind, st));
+    st->st_ino = SFS_LL_VIRTUAL - kind;
+    return SUCCESS;
+}
+
+// the entry of ino, or a negative one that the kernel caches as well
+int32_t sfs_ll_entry(int32_t ino, struct fuse_entry_param *e) {
+    _memset(e, 0, sizeof(*e));
+    e->entry_timeout = SFS_LL_TIMEOUT;
+    if (ino == INO_INVALID || ino == -ENOENT) return SUCCESS;
+    CHECK_INO(ino);
+    e->ino = ino;
+    e->attr_timeout = SFS_LL_TIMEOUT;
+    return sfs_ll_stat(ino, &e->attr);
+}
+
+void sfs_ll_reply_entry(fuse_req_t req, int32_t err, struct fuse_entry_param *e) {
+    if (err < 0) sfs_ll_reply(req, err);
+    else if (e->ino == 0) sfs_ll_reply(req, -ENOENT);
+    else fuse_reply_entry(req, e);
+}
+
+void sfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    UNUSED(userdata);
+    FS->busy = sfs_ll_busy;
+    sfs_init(conn);
+}
+
+void sfs_ll_destroy(void *userdata) {
+    sfs_destroy(userdata);
+}
+
+int32_t sfs_ll_do_lookup(fuse_ino_t parent, const char *name, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_LOOKUP);
+    uint32_t kind = sfs_virtual_at(parent, name);
+    if (kind != SFS_VIRTUAL_NONE) {
+        _memset(e, 0, sizeof(*e));
+        e->ino = SFS_LL_VIRTUAL - kind;
+        return sfs_ll_virtual_stat(kind, &e->attr);
+    }
+    SFS_READ();
+    int32_t ino = fs_name_to_ino(FS, parent, name);
+    if (ino <= 0) return sfs_ll_entry(ino, e);
+    SFS_INODE(ino, false);
+    return sfs_ll_entry(ino, e);
+}
+
+void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    int32_t err = sfs_ll_do_lookup(parent, name, &e);
+    // negative entries are cached too
+    if (err == SUCCESS && e.ino == 0) fuse_reply_entry(req, &e);
+    else sfs_ll_reply_entry(req, err, &e);
+}
+
+// no inode is kept in memory for the kernel's references
+void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    UNUSED(ino);
+    UNUSED(nlookup);
+    fuse_reply_none(req);
+}
+
+int32_t sfs_ll_do_getattr(fuse_ino_t ino, struct stat *st) {
+    FS_STAT(FS, SFS_OP_GETATTR);
+    uint32_t kind = sfs_ll_virtual(ino);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_ll_virtual_stat(kind, st);
+    SFS_READ();
+    SFS_INODE(ino, false);
+    return sfs_ll_stat(ino, st);
+}
+
+void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    UNUSED(fi);
+    struct stat st;
+    int32_t err = sfs_ll_do_getattr(ino, &st);
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_attr(req, &st, sfs_ll_virtual(ino) ? 0 : SFS_LL_TIMEOUT);
+}
+
+int32_t sfs_ll_do_setattr(fuse_ino_t ino, struct stat *attr, int to_set, struct stat *st) {
+    FS_STAT(FS, SFS_OP_SETATTR);
+    uint32_t kind = sfs_ll_virtual(ino);
+    if (kind != SFS_VIRTUAL_NONE) {
+        if (to_set & FUSE_SET_ATTR_SIZE) ERR(sfs_virtual_truncate(kind));
+        return sfs_ll_virtual_stat(kind, st);
+    }
+
+    SFS_WRITE();
+    SFS_INODE(ino, true);
+    ERR(sfs_ll_stat(ino, st));
+    if (to_set & FUSE_SET_ATTR_MODE) ERR(sfs_ino_chmod(ino, attr->st_mode));
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : st->st_uid;
+        gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : st->st_gid;
+        ERR(sfs_ino_chown(ino, uid, gid));
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) ERR(sfs_ino_truncate(ino, attr->st_size));
+    if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+        time_t mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? time(NULL) : attr->st_mtime;
+        ERR(sfs_ino_utime(ino, mtime));
+    }
+    return sfs_ll_stat(ino, st);
+}
+
+void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    UNUSED(fi);
+    struct stat st;
+    int32_t err = sfs_ll_do_setattr(ino, attr, to_set, &st);
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_attr(req, &st, sfs_ll_virtual(ino) ? 0 : SFS_LL_TIMEOUT);
+}
+
+int32_t sfs_ll_do_readlink(fuse_ino_t ino, char *buffer, size_t size) {
+    FS_STAT(FS, SFS_OP_READLINK);
+    SFS_READ();
+    SFS_INODE(ino, false);
+    return sfs_ino_readlink(ino, buffer, size);
+}
+
+void sfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char buffer[PATH_MAX];
+    int32_t err = sfs_ll_do_readlink(ino, buffer, sizeof(buffer));
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_readlink(req, buffer);
+}
+
+int32_t sfs_ll_do_mknod(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_MKNOD);
+    SFS_NAMESPACE();
+    int32_t ino = sfs_make_file_at(parent, name, mode);
+    CHECK_INO(ino);
+    return sfs_ll_entry(ino, e);
+}
+
+void sfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    UNUSED(rdev);
+    struct fuse_entry_param e;
+    sfs_ll_reply_entry(req, sfs_ll_do_mknod(parent, name, mode, &e), &e);
+}
+
+int32_t sfs_ll_do_mkdir(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_MKDIR);
+    if (sfs_virtual_at(parent, name) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
+    int32_t file_mode = fs_mode_to_sfs(mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+    int32_t ino = fs_ino_mkdir(FS, parent, name, file_mode);
+    CHECK_INO(ino);
+    return sfs_ll_entry(ino, e);
+}
+
+void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param e;
+    sfs_ll_reply_entry(req, sfs_ll_do_mkdir(parent, name, mode, &e), &e);
+}
+
+int32_t sfs_ll_do_unlink(fuse_ino_t parent, const char *name) {
+    FS_STAT(FS, SFS_OP_UNLINK);
+    SFS_NAMESPACE();
+    int32_t ino = fs_name_to_ino(FS, parent, name);
+    if (ino == INO_INVALID) return -ENOENT;
+    CHECK_INO(ino);
+    if (fs_ino_isdir(FS, ino)) return -EISDIR;
+    sfs_wbuf_flush_ino(ino);
+    return fs_ino_unlink(FS, parent, name);
+}
+
+void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    sfs_ll_reply(req, sfs_ll_do_unlink(parent, name));
+}
+
+int32_t sfs_ll_do_rmdir(fuse_ino_t parent, const char *name) {
+    FS_STAT(FS, SFS_OP_RMDIR);
+    SFS_NAMESPACE();
+    return fs_ino_rmdir(FS, parent, name);
+}
+
+void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    sfs_ll_reply(req, sfs_ll_do_rmdir(parent, name));
+}
+
+int32_t sfs_ll_do_symlink(const char *target, fuse_ino_t parent, const char *name, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_SYMLINK);
+    if (sfs_virtual_at(parent, name) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
+    int32_t ino = fs_ino_symlink(FS, parent, name, target);
+    CHECK_INO(ino);
+    return sfs_ll_entry(ino, e);
+}
+
+void sfs_ll_symlink(fuse_req_t req, const char *target, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    sfs_ll_reply_entry(req, sfs_ll_do_symlink(target, parent, name, &e), &e);
+}
+
+int32_t sfs_ll_do_rename(fuse_ino_t parent, const char *name, fuse_ino_t new_parent, const char *new_name) {
+    FS_STAT(FS, SFS_OP_RENAME);
+    if (sfs_virtual_at(new_parent, new_name) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
+    int32_t ino = fs_name_to_ino(FS, parent, name);
+    if (ino == INO_INVALID) return -ENOENT;
+    CHECK_INO(ino);
+    ERR(fs_ino_link(FS, new_parent, ino, new_name));
+    return fs_ino_unlink(FS, parent, name);
+}
+
+void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t new_parent, const char *new_name) {
+    sfs_ll_reply(req, sfs_ll_do_rename(parent, name, new_parent, new_name));
+}
+
+int32_t sfs_ll_do_link(fuse_ino_t ino, fuse_ino_t new_parent, const char *new_name, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_LINK);
+    if (sfs_virtual_at(new_parent, new_name) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
+    ERR(fs_ino_link(FS, new_parent, ino, new_name));
+    return sfs_ll_entry(ino, e);
+}
+
+void sfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent, const char *new_name) {
+    struct fuse_entry_param e;
+    sfs_ll_reply_entry(req, sfs_ll_do_link(ino, new_parent, new_name, &e), &e);
+}
+
+int32_t sfs_ll_do_open(fuse_ino_t ino, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_OPEN);
+    uint32_t kind = sfs_ll_virtual(ino);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_open_virtual(kind, fi);
+    SFS_READ();
+    if (fs_ino_isdir(FS, ino)) return -EISDIR;
+    ERR(sfs_open_ino(ino, fi));
+    sfs_ll_opened(ino);
+    return SUCCESS;
+}
+
+void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int32_t err = sfs_ll_do_open(ino, fi);
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_open(req, fi);
+}
+
+int32_t sfs_ll_do_create(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi, struct fuse_entry_param *e) {
+    FS_STAT(FS, SFS_OP_CREATE);
+    SFS_NAMESPACE();
+    int32_t ino = sfs_make_file_at(parent, name, mode);
+    CHECK_INO(ino);
+    ERR(sfs_ll_entry(ino, e));
+    ERR(sfs_open_ino(ino, fi));
+    sfs_ll_opened(ino);
+    return SUCCESS;
+}
+
+void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    int32_t err = sfs_ll_do_create(parent, name, mode, fi, &e);
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_create(req, &e, fi);
+}
+
+int32_t sfs_ll_do_read(fuse_ino_t ino, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_READ);
+    sfs_file *file = sfs_get_file(fi);
+    if (file->kind != SFS_VIRTUAL_NONE) {
+        size_t pos = offset;
+        size_t n = pos < file->text_size ? MIN(size, file->text_size - pos) : 0;
+        if (n > 0) _memcpy(buffer, file->text + pos, n);
+        return n;
+    }
+    sfs_wbuf_sync(ino);
+
+    SFS_READ();
+    SFS_INODE(ino, false);
+    int32_t read = sfs_file_pread(file, ino, buffer, size, offset);
+    if (read > 0) op_stat.bytes = read;
+    return read;
+}
+
+void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    char *buffer = (char *)malloc(size);
+    if (buffer == NULL) {
+        sfs_ll_reply(req, -ENOMEM);
+        return;
+    }
+    int32_t read = sfs_ll_do_read(ino, buffer, size, offset, fi);
+    if (read < 0) sfs_ll_reply(req, read);
+    else fuse_reply_buf(req, buffer, read);
+    free(buffer);
+}
+
+int32_t sfs_ll_do_write(fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_WRITE);
+    if (sfs_virtual_file(fi) != SFS_VIRTUAL_NONE) return -EACCES;
+
+    SFS_WRITE();
+    SFS_INODE(ino, true);
+    int32_t written = sfs_file_pwrite(sfs_get_file(fi), ino, buffer, size, offset);
+    if (written > 0) op_stat.bytes = written;
+    return written;
+}
+
+void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    int32_t written = sfs_ll_do_write(ino, buffer, size, offset, fi);
+    if (written < 0) sfs_ll_reply(req, written);
+    else fuse_reply_write(req, written);
+}
+
+void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    UNUSED(ino);
+    sfs_ll_reply(req, sfs_flush(NULL, fi));
+}
+
+int32_t sfs_ll_do_release(fuse_ino_t ino, struct fuse_file_info *fi) {
+    bool virtual = sfs_virtual_file(fi) != SFS_VIRTUAL_NONE;
+    int32_t err = sfs_release(NULL, fi);
+    if (virtual) return err;
+
+    if (!sfs_ll_closed(ino)) return err;
+    SFS_NAMESPACE();
+    int32_t freed = fs_release_orphan(FS, ino);
+    return err < 0 ? err : freed;
+}
+
+void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    sfs_ll_reply(req, sfs_ll_do_release(ino, fi));
+}
+
+void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    UNUSED(ino);
+    sfs_ll_reply(req, sfs_fsync(NULL, datasync, fi));
+}
+
+int32_t sfs_ll_fill(void *ctx, const fs_dentry *dentry) {
+    sfs_ll_dir *dir = (sfs_ll_dir *)ctx;
+    struct stat st = { 0 };
+    st.st_ino = dentry->ino;
+    size_t size = fuse_add_direntry(dir->req, NULL, 0, &dentry->name, NULL, 0);
+    if (dir->size + size > dir->capacity) {
+        size_t capacity = MAX(dir->capacity * 2, dir->size + size);
+        char *buffer = (char *)realloc(dir->buffer, capacity);
+        if (buffer == NULL) return -ENOMEM;
+        dir->buffer = buffer;
+        dir->capacity = capacity;
+    }
+    fuse_add_direntry(dir->req, dir->buffer + dir->size, size, &dentry->name, &st, dir->size + size);
+    dir->size += size;
+    return SUCCESS;
+}
+
+// the listing is taken at opendir and handed out in pieces
+int32_t sfs_ll_do_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_READDIR);
+    sfs_ll_dir *dir = (sfs_ll_dir *)calloc(1, sizeof(sfs_ll_dir));
+    if (dir == NULL) return -ENOMEM;
+    dir->req = req;
+
+    SFS_READ();
+    int32_t err = sfs_ino_readdir(ino, sfs_ll_fill, dir);
+    if (err < 0) {
+        free(dir->buffer);
+        free(dir);
+        return err;
+    }
+    fi->fh = (uintptr_t)dir;
+    return SUCCESS;
+}
+
+void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int32_t err = sfs_ll_do_opendir(req, ino, fi);
+    if (err < 0) sfs_ll_reply(req, err);
+    else fuse_reply_open(req, fi);
+}
+
+// a cut off last entry is read again at its offset
+void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    UNUSED(ino);
+    sfs_ll_dir *dir = (sfs_ll_dir *)(uintptr_t)fi->fh;
+    size_t pos = offset;
+    if (pos < dir->size) fuse_reply_buf(req, dir->buffer + pos, MIN(size, dir->size - pos));
+    else fuse_reply_buf(req, NULL, 0);
+}
+
+void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    UNUSED(ino);
+    sfs_ll_dir *dir = (sfs_ll_dir *)(uintptr_t)fi->fh;
+    free(dir->buffer);
+    free(dir);
+    fuse_reply_err(req, 0);
+}
+
+void sfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    UNUSED(ino);
+    struct statvfs stfs = { 0 };
+    sfs_statfs(NULL, &stfs);
+    fuse_reply_statfs(req, &stfs);
+}
+
+// the flags are an int, whatever size the request number says
+int32_t sfs_ll_do_flags(fuse_ino_t ino, unsigned int request, const void *in, size_t in_size, uint32_t *out) {
+    bool set = request == FS_IOC_SETFLAGS;
+    if (set && in_size < sizeof(uint32_t)) return -EINVAL;
+    SFS_LOCK(op_lock, &FS->ns_lock, false, set);
+    SFS_INODE(ino, set);
+    if (set) return sfs_ino_setflags(ino, *(const uint32_t *)in);
+
+    int32_t flags = sfs_ino_getflags(ino);
+    if (flags < 0) return flags;
+    *out = flags;
+    return SUCCESS;
+}
+
+int32_t sfs_ll_do_ioctl(fuse_ino_t ino, int cmd, struct fuse_file_info *fi, unsigned flags, const void *in, size_t in_size, uint32_t *out) {
+    FS_STAT(FS, SFS_OP_IOCTL);
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+    unsigned int request = cmd;
+    bool attr = request == FS_IOC_GETFLAGS || request == FS_IOC_SETFLAGS;
+    if (request != SFS_IOC_CLONE && !attr) return -ENOTTY;
+    // directory handles hold a listing
+    if (!(flags & FUSE_IOCTL_DIR) && sfs_virtual_file(fi) != SFS_VIRTUAL_NONE) return -EACCES;
+    if (attr) return sfs_ll_do_flags(ino, request, in, in_size, out);
+    if (in_size < sizeof(sfs_clone_arg)) return -EINVAL;
+
+    sfs_clone_arg clone;
+    _memcpy(&clone, in, sizeof(clone));
+    clone.src[SFS_CLONE_PATH_MAX - 1] = '\0';
+    SFS_NAMESPACE();
+    int32_t src_ino = fs_path_to_ino(FS, clone.src);
+    CHECK_INO(src_ino);
+    sfs_wbuf_flush_ino(src_ino);
+    sfs_wbuf_flush_ino(ino);
+    return fs_ino_clone(FS, src_ino, ino);
+}
+
+void sfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+    unsigned flags, const void *in, size_t in_size, size_t out_size) {
+    UNUSED(arg);
+    uint32_t out = 0;
+    int32_t err = sfs_ll_do_ioctl(ino, cmd, fi, flags, in, in_size, &out);
+    if (err < 0) sfs_ll_reply(req, err);
+    else if ((unsigned int)cmd == FS_IOC_GETFLAGS) fuse_reply_ioctl(req, 0, &out, MIN(out_size, sizeof(out)));
+    else fuse_reply_ioctl(req, 0, NULL, 0);
+}
+
+static struct fuse_lowlevel_ops sfs_ll_ops = {
+    .init = sfs_ll_init,
+    .destroy = sfs_ll_destroy,
+    .lookup = sfs_ll_lookup,
+    .forget = sfs_ll_forget,
+    .getattr = sfs_ll_getattr,
+    .setattr = sfs_ll_setattr,
+    .readlink = sfs_ll_readlink,
+    .mknod = sfs_ll_mknod,
+    .mkdir = sfs_ll_mkdir,
+    .unlink = sfs_ll_unlink,
+    .rmdir = sfs_ll_rmdir,
+    .symlink = sfs_ll_symlink,
+    .rename = sfs_ll_rename,
+    .link = sfs_ll_link,
+    .open = sfs_ll_open,
+    .read = sfs_ll_read,
+    .write = sfs_ll_write,
+    .flush = sfs_ll_flush,
+    .release = sfs_ll_release,
+    .fsync = sfs_ll_fsync,
+    .opendir = sfs_ll_opendir,
+    .readdir = sfs_ll_readdir,
+    .releasedir = sfs_ll_releasedir,
+    .statfs = sfs_ll_statfs,
+    .create = sfs_ll_create,
+    .ioctl = sfs_ll_ioctl,
+};
+
+int main(int argc, char **argv) {
+    disk d;
+    if (open_disk(&d, &argc, argv) < 0) return 1;
+    print_header(FS->header);
+    print_debug(FS);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    char max_read[32];
+    snprintf(max_read, sizeof(max_read), "-omax_read=%u", SFS_MAX_REQUEST);
+    if (fuse_opt_add_arg(&args, max_read) < 0
+        || fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0) {
+        return 1;
+    }
+
+    int32_t ret = 1;
+    struct fuse_chan *chan = fuse_mount(mountpoint, &args);
+    if (chan != NULL) {
+        struct fuse_session *session = fuse_lowlevel_new(&args, &sfs_ll_ops, sizeof(sfs_ll_ops), NULL);
+        if (session != NULL) {
+            if (fuse_set_signal_handlers(session) == 0) {
+                fuse_session_add_chan(session, chan);
+                fuse_daemonize(foreground);
+                ret = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+    fuse_opt_free_args(&args);
+    free(mountpoint);
+
+    print_dcache(FS);
+    print_ccache(FS);
+    print_bcache(FS);
+    print_journal(FS);
+    close_disk(&d);
+    return ret != 0;
+}
@@ -0,0 +1,122 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sys.h"
+
+// Byte-oriented LZ77 in the manner of LZ4, used for compressed files. A
+// block is a list of sequences. Each starts with a token byte holding the
+// literal count in the high and the match length minus LZ_MATCH_MIN in the
+// low nibble, where 15 is continued by bytes that are added up until one
+// is below 255. The literals follow, then a 16 bit little-endian distance
+// back into the output and the rest of the match length. The last
+// sequence ends after its literals.
+#define LZ_MATCH_MIN 4
+#define LZ_DIST_MAX 65535
+#define LZ_HASH_BITS 12     // the table lives on the stack, 16 KiB
+
+typedef uint32_t lz_word __attribute__((may_alias, aligned(1)));
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    return (*(const lz_word *)p * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline void lz_put_length(uint8_t *dst, size_t *out, size_t length) {
+    while (length >= 255) {
+        dst[(*out)++] = 255;
+        length -= 255;
+    }
+    dst[(*out)++] = length;
+}
+
+static inline bool lz_get_length(const uint8_t *src, size_t n, size_t *in, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= n) return false;
+        byte = src[(*in)++];
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// appends a sequence, a match length of 0 ends the block
+static bool lz_emit(uint8_t *dst, size_t cap, size_t *out, const uint8_t *literals, size_t count, size_t dist, size_t length) {
+    size_t rest = length > 0 ? length - LZ_MATCH_MIN : 0;
+    if (*out + 1 + count / 255 + 1 + count + 2 + rest / 255 + 1 > cap) return false;
+
+    dst[(*out)++] = (count < 15 ? count : 15) << 4 | (rest < 15 ? rest : 15);
+    if (count >= 15) lz_put_length(dst, out, count - 15);
+    _memcpy(dst + *out, literals, count);
+    *out += count;
+    if (length == 0) return true;
+
+    dst[(*out)++] = dist & 0xFF;
+    dst[(*out)++] = dist >> 8;
+    if (rest >= 15) lz_put_length(dst, out, rest - 15);
+    return true;
+}
+
+// Greedy compression with one candidate per hash. Returns the compressed
+// size, or 0 if it does not fit into cap bytes.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    _memset(table, 0, sizeof(table));
+
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MATCH_MIN <= n) {
+        uint32_t h = lz_hash(src + i);
+        size_t match = table[h];
+        table[h] = i;
+        if (match >= i || i - match > LZ_DIST_MAX
+            || *(const lz_word *)(src + match) != *(const lz_word *)(src + i)) {
+            i++;
+            continue;
+        }
+
+        size_t length = LZ_MATCH_MIN;
+        while (i + length < n && src[match + length] == src[i + length]) length++;
+        if (!lz_emit(dst, cap, &out, src + anchor, i - anchor, i - match, length)) return 0;
+        i += length;
+        anchor = i;
+    }
+    if (!lz_emit(dst, cap, &out, src + anchor, n - anchor, 0, 0)) return 0;
+    return out;
+}
+
+// Returns the decompressed size, or -1 if src is no valid block or its
+// contents do not fit into cap bytes.
+int64_t lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t in = 0;
+    size_t out = 0;
+    while (in < n) {
+        uint8_t token = src[in++];
+        size_t count = token >> 4;
+        if (count == 15 && !lz_get_length(src, n, &in, &count)) return -1;
+        if (count > n - in || count > cap - out) return -1;
+        _memcpy(dst + out, src + in, count);
+        in += count;
+        out += count;
+        if (in == n) break;
+
+        if (n - in < 2) return -1;
+        size_t dist = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lz_get_length(src, n, &in, &length)) return -1;
+        length += LZ_MATCH_MIN;
+        if (dist == 0 || dist > out || length > cap - out) return -1;
+
+        // overlapping matches repeat the last dist bytes
+        if (dist >= length) _memcpy(dst + out, dst + out - dist, length);
+        else for (size_t k = 0; k < length; k++) dst[out + k] = dst[out - dist + k];
+        out += length;
+    }
+    return out;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#define FUSE_USE_VERSION 29
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "sfs.h"
+
+// Clones SRC to DST on the same mount with SFS_IOC_CLONE, so that both
+// share their data blocks until one of them is written.
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SRC DST\n", argv[0]);
+        return 1;
+    }
+
+    char src[PATH_MAX];
+    struct stat st;
+    if (realpath(argv[1], src) == NULL || stat(src, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // the mount root is the topmost directory above src on the same device
+    char dir[PATH_MAX];
+    strcpy(dir, src);
+    size_t root = strlen(src);
+    char *slash;
+    while ((slash = strrchr(dir, '/')) != NULL) {
+        *slash = '\0';
+        struct stat dir_st;
+        if (stat(*dir ? dir : "/", &dir_st) < 0 || dir_st.st_dev != st.st_dev) break;
+        root = slash - dir;
+    }
+
+    sfs_clone_arg arg = { 0 };
+    if (strlen(src + root) >= sizeof(arg.src)) {
+        fprintf(stderr, "%s: path too long\n", argv[1]);
+        return 1;
+    }
+    strcpy(arg.src, *(src + root) ? src + root : "/");
+
+    int fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+    struct stat dst_st;
+    if (fd < 0 || fstat(fd, &dst_st) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (dst_st.st_dev != st.st_dev) {
+        fprintf(stderr, "%s: not on the same file system as %s\n", argv[2], argv[1]);
+        return 1;
+    }
+    if (ioctl(fd, SFS_IOC_CLONE, &arg) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -3,28 +3,95 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fuse.h>
 
 #include "sys.h"
+#include "trace.h"
+#include "lz.h"
 
 #include <math.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define UNUSED(x) (void)(x)
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define DIV_CEIL(x, y) (((x) + (y) - 1) / (y))
 
 #define SUCCESS 0
 
-#define FS_BLOCK_SIZE 512
+#define FS_MAGIC 0x31534653     // "SFS1"
+#define FS_VERSION 7            // 2 adds the journal, 3 inline data, 4 32 bit addressing, 5 groups, 6 compression, 7 split buckets
+#define FS_VERSION_MIN 5        // older images have one inode free list
+
+// block size is chosen at format time, a power of two between the limits
+#define FS_BLOCK_SIZE 512       // default
+#define FS_BLOCK_SIZE_MIN 512
+#ifndef FS_BLOCK_SIZE_MAX
+#define FS_BLOCK_SIZE_MAX 65536
+#endif
+#define FS_INODE_RATIO 1024     // bytes of image per inode
 #define FS_DIR_MAX 1024
 #define FS_PATH_LEN_MAX 256
 #define FS_NAME_LEN_MAX 64
-#define FS_BLOCK_POINTERS 6
+#define FS_BLOCK_POINTERS 7
+#define FS_BLOCK_LEVELS 3       // block_p, block_pp and block_ppp
+#define FS_DIR_MAGIC 0x5D1E
+#define FS_DIR_BUCKETS_MAX 32768 // the most fs_dir_header.buckets holds
+#define FS_DCACHE_SIZE 256
+#define FS_STATS_BUCKETS 32     // bucket i counts latencies of [2^i, 2^(i+1)) ns
+#define FS_STATS_TEXT_MAX 16384
+#define FS_STATS_PATH "/.sfs_stats"
+
+// mode bits above the file type are flags
+#define FS_MODE_FLAGS 0xE000
+#define FS_MODE_INLINE 0x8000   // contents are stored in the block pointers
+#define FS_INLINE_MAX (sizeof(uint32_t) * (FS_BLOCK_POINTERS + FS_BLOCK_LEVELS))
+#define FS_MODE_COMPRESS 0x4000 // contents are stored in compressed clusters
+#define FS_CLUSTER_SIZE 16384   // bytes, but at least FS_CLUSTER_BLOCKS_MIN blocks
+#define FS_CLUSTER_BLOCKS_MIN 4
+#define FS_CLUSTER_BLOCKS_MAX (FS_CLUSTER_SIZE / FS_BLOCK_SIZE_MIN)
+#define FS_CLUSTER_MAGIC 0x5A43 // "CZ"
+#define FS_CCACHE_SIZE 8
+
+#ifndef FS_BCACHE_SIZE
+#define FS_BCACHE_SIZE 256
+#endif
+#define FS_BCACHE_HASH (FS_BCACHE_SIZE * 2)
+
+#define FS_LOCK_STRIPES 64
+
+#define FS_JOURNAL_BLOCKS 256
+#define FS_JOURNAL_INTERVAL 5000    // ms between commits
+#define FS_JOURNAL_CREDITS 32       // blocks one operation may log
+#define FS_JOURNAL_STEP 16          // blocks one step of a long operation logs at most
+
+// logged blocks stay cached until their commit, half the cache is left
+// for the blocks pinned meanwhile
+#if FS_BCACHE_SIZE / 2 < FS_JOURNAL_CREDITS
+#error "FS_BCACHE_SIZE cannot hold the blocks of one operation"
+#endif
+#define FS_JOURNAL_DESC 0x4A534653      // "SFSJ"
+#define FS_JOURNAL_COMMIT 0x43534653    // "SFSC"
+
+#define FS_RECLAIM_BATCH 4096       // logical blocks freed per reclaim step
+#define FS_FREE_CHUNK 4             // blocks freed between journal room checks
+#define FS_RECLAIM_IDLE 50          // ms the reclaimer sleeps without orphans
+
+#define SFS_MAX_REQUEST (128 * 1024)    // bytes per FUSE read and write
+#define SFS_READAHEAD (1024 * 1024)     // kernel readahead, it may lower it
+#define SFS_PREFETCH_MIN 4              // blocks, the first sequential window
+#define SFS_PREFETCH_MAX (256 * 1024)   // bytes, the largest window
+#define SFS_PREFETCH_SHARE 8            // the window takes at most this fraction of the cache
+#define SFS_WBUF_SIZE (64 * 1024)       // pending bytes per handle
 
 #define CHECK_INO(ino)                  \
 if (ino < 0) return ino;                \
@@ -43,69 +110,336 @@ ERR(fs_ino_readdir(fs, ino, &dir, FS_DIR_MAX));
 
 #define CALL(term) if (!(term)) return;
 
+#define PIN(ptr) if ((ptr) == NULL) return -EIO;
+
+// block 0 and inode 0 are never handed out
+#define BLK_INVALID 0
+#define INO_INVALID 0
+
 const size_t MB = 1048576;
 const size_t DISK_SIZE = 1 * MB;
 
-const uint16_t BLK_INVALID =  0;
-const uint16_t INO_INVALID = 0;
 
 const bool USE_CURRENT_USER = true;
 
 typedef struct fs_inode {
-    uint16_t ino;
+    uint32_t ino;
     uint8_t uid;
     uint8_t gid;
     uint16_t mode;
-    uint16_t refs;
-    uint32_t size;
+    uint32_t refs;
     uint32_t time;
-    uint16_t block[FS_BLOCK_POINTERS];
-    uint16_t block_p;
-    uint16_t block_pp;
+    uint64_t size;
+    uint32_t block[FS_BLOCK_POINTERS];
+    uint32_t block_p;
+    uint32_t block_pp;
+    uint32_t block_ppp;
 } fs_inode;
 
+// Only used through pointers, blocks are header->block_size bytes long.
 typedef struct fs_block {
-    union {
-        uint8_t bytes[FS_BLOCK_SIZE];
-        struct {
-            uint16_t next;
-        } free;
-    };
+    uint8_t bytes[FS_BLOCK_SIZE_MAX];
 } fs_block;
 
 typedef struct fs_header {
-    uint16_t blocks_all;
-    uint16_t blocks_header;
-    uint16_t blocks_inode;
-    uint16_t blocks;
-    uint16_t blocks_total;
+    uint32_t magic;
+    uint16_t version;
 
-    uint16_t inodes;
-    uint16_t inodes_total;
+    uint32_t blocks_all;
+    uint32_t blocks_header;
+    uint32_t blocks_bitmap;
+    uint32_t blocks_inode;
+    uint32_t blocks;
+    uint32_t blocks_total;
+
+    uint32_t inodes;
+    uint32_t inodes_total;
 
     uint16_t header_size;
     uint16_t inode_size;
-    uint16_t block_size;
+    uint32_t block_size;
 
-    uint16_t blockp_len;
+    uint32_t blockp_len;
 
     uint32_t name_max;
 
-    uint16_t max_ino;
-    uint16_t root_ino;
-    uint16_t free_ino;
-    uint16_t free_blk;
+    uint32_t max_ino;
+    uint32_t root_ino;
+    uint32_t free_ino;      // unused since version 5, see fs_group
+    uint32_t free_blk;      // where the next block search starts
+
+    uint32_t blocks_journal;
+    uint32_t journal_seq;   // last committed transaction
+
+    uint32_t orphan_ino;    // unlinked inodes whose blocks are not yet freed
+
+    uint32_t refcount_ino;  // table of extra references to shared blocks
+    uint32_t blocks_shared; // blocks with extra references
+
+    uint32_t groups;
+    uint32_t inodes_group;  // inodes per group, the last may have fewer
 } fs_header;
 
-typedef struct fs_fs {
+// Allocation groups split the data blocks into the ranges covered by one
+// bitmap block each, and the inode table into as many ranges. Inodes go
+// to the group of their directory, new directories to a group with few
+// of them and their blocks near the inode, so that a directory tree is
+// read mostly in order. The descriptors follow the header block.
+typedef struct fs_group {
+    uint32_t free_ino;      // head of the group's inode free list
+    uint32_t inodes;        // in use
+    uint32_t blocks;        // in use
+    uint32_t dirs;
+} fs_group;
+
+// Files with FS_MODE_COMPRESS are written in clusters of fs_cluster_blocks.
+// A cluster wholly below EOF whose first slot is mapped and last is empty
+// holds this header and the compressed contents in the blocks of its
+// first slots. All others are stored as is, and whole ones are written
+// without holes so that they cannot be taken for compressed ones.
+typedef struct fs_cluster {
+    uint16_t magic;
+    uint16_t unused;
+    uint32_t size;          // of the compressed data that follows
+} fs_cluster;
+
+// Direct-mapped (parent_ino, name) -> ino cache, ino is INO_INVALID
+// for negative entries and parent_ino is INO_INVALID for empty slots.
+typedef struct fs_dcache_entry {
+    uint32_t parent_ino;
+    uint32_t ino;
+    uint32_t hash;
+    char name[FS_NAME_LEN_MAX];
+} fs_dcache_entry;
+
+typedef struct fs_dcache {
+    sys_mutex lock;
+    fs_dcache_entry entries[FS_DCACHE_SIZE];
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+} fs_dcache;
+
+// Recently used clusters of compressed files, decompressed. ino is
+// INO_INVALID for empty slots, the contents of slot i are at data +
+// i * fs_cluster_size.
+typedef struct fs_ccache_entry {
+    uint32_t ino;
+    uint32_t cluster;
+    uint64_t used;
+} fs_ccache_entry;
+
+typedef struct fs_ccache {
+    sys_mutex lock;
+    fs_ccache_entry entries[FS_CCACHE_SIZE];
+    uint8_t *data;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} fs_ccache;
+
+enum {
+    FS_OP_PATH,
+    FS_OP_PREAD,
+    FS_OP_PWRITE,
+    FS_OP_TRUNCATE,
+    FS_OP_MK,
+    FS_OP_LINK,
+    FS_OP_UNLINK,
+    FS_OP_CLONE,
+    SFS_OP_GETATTR,
+    SFS_OP_READLINK,
+    SFS_OP_SYMLINK,
+    SFS_OP_MKNOD,
+    SFS_OP_MKDIR,
+    SFS_OP_UNLINK,
+    SFS_OP_RMDIR,
+    SFS_OP_RENAME,
+    SFS_OP_CHMOD,
+    SFS_OP_CHOWN,
+    SFS_OP_TRUNCATE,
+    SFS_OP_OPEN,
+    SFS_OP_CREATE,
+    SFS_OP_FSYNC,
+    SFS_OP_LINK,
+    SFS_OP_READ,
+    SFS_OP_WRITE,
+    SFS_OP_STATFS,
+    SFS_OP_READDIR,
+    SFS_OP_UTIMENS,
+    SFS_OP_IOCTL,
+    SFS_OP_LOOKUP,
+    SFS_OP_SETATTR,
+    FS_OPS
+};
+
+static const char *fs_op_names[FS_OPS] = {
+    [FS_OP_PATH] = "fs.path",
+    [FS_OP_PREAD] = "fs.pread",
+    [FS_OP_PWRITE] = "fs.pwrite",
+    [FS_OP_TRUNCATE] = "fs.truncate",
+    [FS_OP_MK] = "fs.mk",
+    [FS_OP_LINK] = "fs.link",
+    [FS_OP_UNLINK] = "fs.unlink",
+    [FS_OP_CLONE] = "fs.clone",
+    [SFS_OP_GETATTR] = "sfs.getattr",
+    [SFS_OP_READLINK] = "sfs.readlink",
+    [SFS_OP_SYMLINK] = "sfs.symlink",
+    [SFS_OP_MKNOD] = "sfs.mknod",
+    [SFS_OP_MKDIR] = "sfs.mkdir",
+    [SFS_OP_UNLINK] = "sfs.unlink",
+    [SFS_OP_RMDIR] = "sfs.rmdir",
+    [SFS_OP_RENAME] = "sfs.rename",
+    [SFS_OP_CHMOD] = "sfs.chmod",
+    [SFS_OP_CHOWN] = "sfs.chown",
+    [SFS_OP_TRUNCATE] = "sfs.truncate",
+    [SFS_OP_OPEN] = "sfs.open",
+    [SFS_OP_CREATE] = "sfs.create",
+    [SFS_OP_FSYNC] = "sfs.fsync",
+    [SFS_OP_LINK] = "sfs.link",
+    [SFS_OP_READ] = "sfs.read",
+    [SFS_OP_WRITE] = "sfs.write",
+    [SFS_OP_STATFS] = "sfs.statfs",
+    [SFS_OP_READDIR] = "sfs.readdir",
+    [SFS_OP_UTIMENS] = "sfs.utimens",
+    [SFS_OP_IOCTL] = "sfs.ioctl",
+    [SFS_OP_LOOKUP] = "sfs.lookup",
+    [SFS_OP_SETATTR] = "sfs.setattr",
+};
+
+typedef struct fs_op_stats {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t hist[FS_STATS_BUCKETS];
+} fs_op_stats;
+
+// Counters of the core calls and FUSE handlers, only kept once
+// fs_stats_enable attached them. Updates are relaxed atomic adds, so
+// readers get a slightly torn snapshot.
+typedef struct fs_stats {
+    uint64_t since;     // ms, of the last reset
+    uint64_t blocks_alloc;
+    uint64_t blocks_freed;
+    uint64_t inodes_alloc;
+    uint64_t inodes_freed;
+    fs_op_stats ops[FS_OPS];
+} fs_stats;
+
+// Block device, blk counts blocks of size bytes from the start of the image.
+typedef struct fs_dev {
+    void *ctx;
+    int32_t (*read_block)(void *ctx, uint32_t blk, void *buffer, uint32_t size);
+    int32_t (*write_block)(void *ctx, uint32_t blk, const void *buffer, uint32_t size);
+    int32_t (*flush)(void *ctx);    // optional
+    // optional, reads count consecutive blocks with one request
+    int32_t (*read_blocks)(void *ctx, uint32_t blk, uint32_t count, void *buffer, uint32_t size);
+} fs_dev;
+
+typedef struct fs_buf {
+    uint32_t blk;
+    uint16_t refs;
+    bool valid;
+    bool dirty;
+    bool meta;      // goes through the journal
+    struct fs_buf *prev;
+    struct fs_buf *next;
+    struct fs_buf *hash_next;
+} fs_buf;
+
+// Write-back buffer cache. Buffers are kept in LRU order, most recently
+// used first, and only unpinned ones are evicted. The slots are allocated
+// for the block size of the attached image, a zeroed cache has none yet.
+typedef struct fs_bcache {
+    sys_mutex lock;     // everything but the block contents
+    fs_buf bufs[FS_BCACHE_SIZE];
+    fs_buf *hash[FS_BCACHE_HASH];
+    fs_buf lru;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    uint32_t block_size;    // of the slots
+    uint8_t *data;          // FS_BCACHE_SIZE slots, then the scratch block
+    uint8_t *scratch;       // journal descriptor and commit record
+} fs_bcache;
+
+// First journal block of a transaction, followed by copies of the listed
+// blocks and an fs_journal_record. Replayed at mount if the commit record
+// matches, so a transaction reaches its home blocks entirely or not at all.
+typedef struct fs_journal_desc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t blk[];     // up to the end of the block
+} fs_journal_desc;
+
+typedef struct fs_journal_record {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t checksum;      // over the descriptor and the copies
+} fs_journal_record;
+
+// Metadata journal, only used through a block device. Dirty metadata is
+// held in the buffer cache until it is committed, data blocks are written
+// back before the commit that references them. Every commit is a single
+// transaction taken between operations: an operation reserves credits
+// for the blocks it may log before it starts, see fs_journal_begin, and
+// waits for a commit if the transaction has no room left for them.
+// A bitmap block as the allocator sees it until the transaction that freed
+// blocks in it commits, see fs_alloc_view
+typedef struct fs_frozen {
+    uint32_t index;     // of the bitmap block
+    uint8_t *bits;
+} fs_frozen;
+
+typedef struct fs_journal {
+    uint32_t start;
+    uint32_t capacity;      // blocks per transaction, 0 if disabled
+    uint32_t limit;         // logged blocks a transaction takes, the header aside
+    uint32_t pending;       // logged blocks in the cache
+    uint32_t reserved;      // credits held by running operations
+    uint32_t interval;      // ms
+    uint64_t last;
+    uint64_t commits;
+    uint64_t logged;
+    uint64_t overruns;      // blocks logged past the credits of their operation
+    uint64_t frozen_blocks; // freed since the last commit
+    uint32_t frozen_count;
+    fs_frozen frozen[FS_BCACHE_SIZE];   // bitmap blocks freed in since then
+} fs_journal;
+
+typedef struct fs_fs fs_fs;
+
+// Either raw points at a memory image, or blocks go through dev and bcache.
+// Operations that change the namespace hold ns_lock exclusively, all others
+// hold it shared and lock the inode they work on. The allocator and the
+// refcount table have their own locks, lock order is ns_lock, inode,
+// ref_lock, alloc_lock, then the caches. Journal commits hold ns_lock
+// exclusively, so that no operation is running when blocks are logged.
+struct fs_fs {
+    sys_rwlock ns_lock;
+    sys_rwlock ino_locks[FS_LOCK_STRIPES];
+    sys_mutex alloc_lock;
+    sys_mutex ref_lock;
+    fs_dcache *dcache;
+    fs_ccache *ccache;
+    fs_stats *stats;
     fs_header *header;
-    fs_inode *inodes;
-    fs_block *blocks;
-    fs_block *raw;
-} fs_fs;
+    uint8_t *raw;
+    fs_dev *dev;
+    fs_bcache *bcache;
+    fs_journal journal;
+    uint32_t bitmap_start;
+    uint32_t inode_start;
+    uint32_t data_start;
+    uint32_t block_size;    // of the attached image, before the header is read
+    int32_t (*sync)(fs_fs *fs);     // persists the image, optional
+    bool (*busy)(fs_fs *fs, uint32_t ino);  // an orphan is still open, optional
+};
 
 typedef struct fs_dentry {
-    uint16_t ino;
+    uint32_t ino;
     uint16_t len;
     char name;
 } fs_dentry;
@@ -115,514 +449,3700 @@ typedef struct fs_dir {
     uint8_t *buffer;
 } fs_dir;
 
+// Block 0 of an indexed directory. Linear directories start with the
+// dentry of ".", whose ino is never INO_INVALID.
+typedef struct fs_dir_header {
+    uint32_t ino;
+    uint16_t magic;
+    uint16_t buckets;
+    uint32_t entries;
+    uint32_t split;     // buckets below it are split already, 0 in older images
+} fs_dir_header;
+
+// Blocks 1 to buckets + split hold dentries packed back to back.
+typedef struct fs_dir_bucket {
+    uint16_t used;
+    uint8_t dentries[];
+} fs_dir_bucket;
+
+typedef struct fs_dir_iter {
+    fs_fs *fs;
+    uint32_t ino;
+    uint16_t bucket;
+    uint16_t offset;
+    union {     // copy of the current dentry
+        fs_dentry dentry;
+        uint8_t bytes[sizeof(fs_dentry) + FS_NAME_LEN_MAX];
+    };
+} fs_dir_iter;
+
 typedef struct fs_index {
     uint32_t pre : 1;
     uint32_t post : 1;
     uint32_t index : 30;
 } fs_index;
 
-typedef struct fs_ino_rw_cb_args {
-    fs_fs *fs;
-    void *buffer;
-    int32_t size;
-    int32_t output;
-} fs_ino_rw_cb_args;
+// per-open state of the FUSE driver, stored in fuse_file_info.fh
+typedef struct sfs_file {
+    uint32_t ino;
+    int32_t flags;
+    uint32_t kind;      // SFS_VIRTUAL_*
+    char *text;         // snapshot of a virtual file
+    uint32_t text_size;
+    uint64_t next;      // offset a sequential read continues at
+    uint32_t ahead;     // prefetch window in blocks, 0 after random reads
+    uint32_t fetched;   // blocks below it are prefetched
+    uint8_t *wbuf;      // writes not yet passed on, wlen bytes at woff
+    uint64_t woff;
+    uint32_t wlen;
+    int32_t werr;       // a failed pass of the pending data, until reported
+    struct sfs_file *wnext;     // in sfs_wbuf_list while wlen > 0
+} sfs_file;
+
+enum {
+    SFS_VIRTUAL_NONE,
+    SFS_VIRTUAL_STATS,
+    SFS_VIRTUAL_TRACE,
+};
+
+#define SFS_CLONE_PATH_MAX 1024
+
+// Argument of SFS_IOC_CLONE, which is issued on the open destination file.
+// The kernel does not pass FICLONE or copy_file_range on to FUSE 2.x.
+typedef struct sfs_clone_arg {
+    char src[SFS_CLONE_PATH_MAX];   // below the mount root
+} sfs_clone_arg;
+
+#define SFS_IOC_CLONE _IOW('S', 1, sfs_clone_arg)
+
+fs_fs *FS;
+
+// empties the cache and sizes its slots for block_size byte blocks
+int32_t fs_bcache_init(fs_bcache *bcache, uint32_t block_size) {
+    if (bcache->data == NULL || bcache->block_size != block_size) {
+        free(bcache->data);
+        bcache->data = (uint8_t *)malloc((size_t)(FS_BCACHE_SIZE + 1) * block_size);
+        if (bcache->data == NULL) return -ENOMEM;
+        bcache->block_size = block_size;
+        bcache->scratch = bcache->data + (size_t)FS_BCACHE_SIZE * block_size;
+    }
+    _memset(bcache, 0, offsetof(fs_bcache, block_size));
+    MUTEX_INIT(&bcache->lock);
+    bcache->lru.prev = &bcache->lru;
+    bcache->lru.next = &bcache->lru;
+    for (size_t i = 0; i < FS_BCACHE_SIZE; i++) {
+        fs_buf *buf = &bcache->bufs[i];
+        buf->next = bcache->lru.next;
+        buf->prev = &bcache->lru;
+        bcache->lru.next->prev = buf;
+        bcache->lru.next = buf;
+    }
+    return SUCCESS;
+}
+
+// frees the slots, the cache can be initialised again afterwards
+void fs_bcache_free(fs_bcache *bcache) {
+    free(bcache->data);
+    bcache->data = NULL;
+    bcache->scratch = NULL;
+}
+
+static inline fs_block *fs_buf_data(fs_bcache *bcache, fs_buf *buf) {
+    return (fs_block *)(bcache->data + (size_t)(buf - bcache->bufs) * bcache->block_size);
+}
+
+// the buffer holding any address inside a cached block
+static inline fs_buf *fs_buf_of(fs_bcache *bcache, const void *ptr) {
+    size_t i = ((const uint8_t *)ptr - bcache->data) / bcache->block_size;
+    assert(i < FS_BCACHE_SIZE);
+    return &bcache->bufs[i];
+}
+
+void fs_bcache_touch(fs_bcache *bcache, fs_buf *buf) {
+    buf->prev->next = buf->next;
+    buf->next->prev = buf->prev;
+    buf->next = bcache->lru.next;
+    buf->prev = &bcache->lru;
+    bcache->lru.next->prev = buf;
+    bcache->lru.next = buf;
+}
 
-typedef struct fs_ino_trunc_cb_args {
+fs_buf *fs_bcache_find(fs_bcache *bcache, uint32_t blk) {
+    fs_buf *buf = bcache->hash[blk % FS_BCACHE_HASH];
+    while (buf != NULL && buf->blk != blk) buf = buf->hash_next;
+    return buf;
+}
+
+void fs_bcache_unhash(fs_bcache *bcache, fs_buf *buf) {
+    fs_buf **link = &bcache->hash[buf->blk % FS_BCACHE_HASH];
+    while (*link != buf) link = &(*link)->hash_next;
+    *link = buf->hash_next;
+    buf->valid = false;
+}
+
+static inline fs_block *fs_raw_block(fs_fs *fs, uint32_t blk) {
+    return (fs_block *)(fs->raw + (size_t)blk * fs->block_size);
+}
+
+static inline int32_t fs_dev_read(fs_fs *fs, uint32_t blk, void *buffer) {
+    if (fs->raw == NULL) return fs->dev->read_block(fs->dev->ctx, blk, buffer, fs->block_size);
+    _memcpy(buffer, fs_raw_block(fs, blk), fs->block_size);
+    return SUCCESS;
+}
+
+static inline int32_t fs_dev_write(fs_fs *fs, uint32_t blk, const void *buffer) {
+    if (fs->raw == NULL) return fs->dev->write_block(fs->dev->ctx, blk, buffer, fs->block_size);
+    _memcpy(fs_raw_block(fs, blk), buffer, fs->block_size);
+    return SUCCESS;
+}
+
+static inline int32_t fs_dev_flush(fs_fs *fs) {
+    if (fs->raw != NULL || fs->dev->flush == NULL) return SUCCESS;
+    return fs->dev->flush(fs->dev->ctx);
+}
+
+static inline uint64_t fs_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t fs_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Times the rest of the scope it is declared in as one call of op. bytes
+// can be set before returning. Without stats only the pointer is loaded.
+typedef struct fs_stat_timer {
     fs_fs *fs;
-    int32_t old_size;
-    int32_t new_size;
-    int32_t output;
-} fs_ino_trunc_cb_args;
+    uint32_t op;
+    uint64_t start;
+    uint64_t bytes;
+} fs_stat_timer;
 
-fs_fs *FS;
+static inline fs_stat_timer fs_stat_begin(fs_fs *fs, uint32_t op) {
+    return (fs_stat_timer){ fs, op, ATOMIC_ACQUIRE(&fs->stats) != NULL ? fs_now_ns() : 0, 0 };
+}
 
-static inline fs_inode *fs_get_inode(fs_fs *fs, uint16_t ino) {
-    assert(ino != INO_INVALID);
-    assert(ino <= fs->header->max_ino);
-    return &fs->inodes[ino];
+static inline void fs_stat_end(fs_stat_timer *timer) {
+    // calls that started before stats were enabled are not counted
+    if (timer->start == 0) return;
+    fs_stats *stats = timer->fs->stats;
+    uint64_t ns = fs_now_ns() - timer->start;
+    uint32_t bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    fs_op_stats *op = &stats->ops[timer->op];
+    ATOMIC_ADD(&op->calls, 1);
+    ATOMIC_ADD(&op->bytes, timer->bytes);
+    ATOMIC_ADD(&op->ns, ns);
+    ATOMIC_ADD(&op->hist[MIN(bucket, FS_STATS_BUCKETS - 1)], 1);
 }
 
-static inline bool fs_ino_isdir(fs_fs *fs, uint16_t ino) {
-    return fs_get_inode(fs, ino)->mode & (S_IFDIR >> 3);
+#define FS_STAT(fs, op) \
+fs_stat_timer op_stat __attribute__((cleanup(fs_stat_end))) = fs_stat_begin(fs, op)
+
+#define FS_COUNT(fs, counter, n) \
+if (ATOMIC_ACQUIRE(&(fs)->stats) != NULL) ATOMIC_ADD(&(fs)->stats->counter, (n));
+
+void fs_stats_reset(fs_fs *fs) {
+    if (ATOMIC_ACQUIRE(&fs->stats) == NULL) return;
+    _memset(fs->stats, 0, sizeof(fs_stats));
+    fs->stats->since = fs_now_ms();
 }
 
-void fs_ino_enumerate_blocks(
-    fs_fs *fs,
-    uint16_t ino,
-    bool(*callback)(uint16_t *, fs_index, void *),
-    void *args
-) {
-    // TODO error handling
-    fs_inode *inode = fs_get_inode(fs, ino);
-    
-    uint32_t i = 0;
-    while (i < FS_BLOCK_POINTERS) {
-        CALL(callback(&inode->block[i], (fs_index){ 0, 0, i }, args));
-        i++;
+// Starts keeping stats, which until then cost each call one load. Returns
+// -ENOMEM if there is no memory for them.
+int32_t fs_stats_enable(fs_fs *fs) {
+    static sys_mutex lock = MUTEX_INITIALIZER;
+    MUTEX_LOCK(&lock);
+    if (fs->stats == NULL) {
+        fs_stats *stats = (fs_stats *)calloc(1, sizeof(fs_stats));
+        if (stats != NULL) stats->since = fs_now_ms();
+        ATOMIC_RELEASE(&fs->stats, stats);
     }
+    MUTEX_UNLOCK(&lock);
+    return fs->stats != NULL ? SUCCESS : -ENOMEM;
+}
 
-    CALL(callback(&inode->block_p, (fs_index){ 1, 0, i }, args));
-    uint16_t *pblock = (uint16_t *)&fs->blocks[inode->block_p];
-    
-    for (size_t j = 0; j < fs->header->blockp_len; j++) {
-        CALL(callback(&pblock[j], (fs_index){ 0, 0, i }, args));
-        i++;
+static size_t fs_stats_append(char *buffer, size_t size, size_t len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(len < size ? buffer + len : NULL, len < size ? size - len : 0, format, args);
+    va_end(args);
+    return len + MAX(n, 0);
+}
+
+// Renders the stats as text, one line per op with the non-empty latency
+// buckets as log2(ns):count. Returns the full length, like snprintf.
+size_t fs_stats_print(fs_fs *fs, char *buffer, size_t size) {
+    fs_stats *stats = fs->stats;
+    size_t len = fs_stats_append(buffer, size, 0,
+        "since_ms=%lu blocks_alloc=%lu blocks_freed=%lu inodes_alloc=%lu inodes_freed=%lu\n",
+        fs_now_ms() - stats->since,
+        ATOMIC_LOAD(&stats->blocks_alloc), ATOMIC_LOAD(&stats->blocks_freed),
+        ATOMIC_LOAD(&stats->inodes_alloc), ATOMIC_LOAD(&stats->inodes_freed));
+
+    for (uint32_t i = 0; i < FS_OPS; i++) {
+        fs_op_stats *op = &stats->ops[i];
+        len = fs_stats_append(buffer, size, len, "%s calls=%lu bytes=%lu ns=%lu hist=",
+            fs_op_names[i], ATOMIC_LOAD(&op->calls), ATOMIC_LOAD(&op->bytes), ATOMIC_LOAD(&op->ns));
+        const char *sep = "";
+        for (uint32_t j = 0; j < FS_STATS_BUCKETS; j++) {
+            uint64_t count = ATOMIC_LOAD(&op->hist[j]);
+            if (count == 0) continue;
+            len = fs_stats_append(buffer, size, len, "%s%u:%lu", sep, j, count);
+            sep = ",";
+        }
+        len = fs_stats_append(buffer, size, len, "\n");
     }
+    if (size > 0) buffer[MIN(len, size - 1)] = '\0';
+    return len;
+}
 
-    CALL(callback(&inode->block_p, (fs_index){ 0, 1, i }, args));
+// FNV-1a over a buffer, continuing from hash
+uint32_t fs_checksum(uint32_t hash, const void *buffer, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)buffer;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    CALL(callback(&inode->block_pp, (fs_index){ 1, 0, i }, args));
-    uint16_t *ppblock = (uint16_t *)&fs->blocks[inode->block_pp];
+// dirty metadata that may only be written home by a commit
+static inline bool fs_buf_logged(fs_fs *fs, fs_buf *buf) {
+    return fs->journal.capacity > 0 && buf->valid && buf->dirty && buf->meta;
+}
 
-    for (size_t j = 0; j < fs->header->blockp_len; j++) {
-        CALL(callback(&ppblock[j], (fs_index){ 1, 0, i }, args));
-        uint16_t *pblock = (uint16_t *)&fs->blocks[ppblock[j]];
+// credits left to the operation running on this thread and how deeply
+// fs_journal_begin is nested in it
+static __thread uint32_t fs_journal_credits;
+static __thread uint32_t fs_journal_depth;
+
+// Keeps journal->pending up to date after the state of buf changed,
+// logged is whether it was logged before. A block that starts being
+// logged takes a credit of the running operation. Needs the cache lock.
+static inline void fs_journal_account(fs_fs *fs, fs_buf *buf, bool logged) {
+    fs_journal *journal = &fs->journal;
+    bool now = fs_buf_logged(fs, buf);
+    if (now == logged) return;
+    if (!now) {
+        journal->pending--;
+        return;
+    }
+    journal->pending++;
+    if (fs_journal_credits > 0) {
+        fs_journal_credits--;
+        journal->reserved--;
+    }
+    else if (fs_journal_depth > 0) journal->overruns++;
+}
 
-        for (size_t k = 0; k < fs->header->blockp_len; k++) {
-            CALL(callback(&pblock[j], (fs_index){ 0, 0, i }, args));
-            i++;
-        }
+int32_t fs_bcache_writeback(fs_fs *fs, fs_buf *buf) {
+    if (!buf->dirty) return SUCCESS;
+    bool logged = fs_buf_logged(fs, buf);
+    fs_block *data = fs_buf_data(fs->bcache, buf);
+    ERR(fs->dev->write_block(fs->dev->ctx, buf->blk, data, fs->block_size));
+    buf->dirty = false;
+    fs_journal_account(fs, buf, logged);
+    fs->bcache->writebacks++;
+    return SUCCESS;
+}
 
-        CALL(callback(&ppblock[j], (fs_index){ 0, 1, i }, args));
+// Once freeing blocks is committed, they can be handed out again. The
+// allocator is idle while ns_lock is held exclusively for the commit.
+void fs_journal_thaw(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    for (uint32_t i = 0; i < journal->frozen_count; i++) {
+        free(journal->frozen[i].bits);
     }
+    journal->frozen_count = 0;
+    ATOMIC_STORE(&journal->frozen_blocks, 0);
+}
 
-    CALL(callback(&inode->block_pp, (fs_index){ 0, 1, i }, args));
+// whether at least half of the free blocks wait for a commit to be reused
+static inline bool fs_journal_starved(fs_fs *fs) {
+    uint64_t frozen = ATOMIC_LOAD(&fs->journal.frozen_blocks);
+    uint64_t free = fs->header->blocks_total - ATOMIC_LOAD(&fs->header->blocks);
+    return frozen > 0 && 2 * frozen >= free;
 }
 
-uint16_t fs_alloc_block(fs_fs *fs) {
-    uint16_t blk = fs->header->free_blk;
-    fs->header->free_blk = fs->blocks[blk].free.next;       // blocks[BLK_INVALID] should always point at itself
-    fs->header->blocks++;
-    return blk;
+// Logs one transaction of up to capacity dirty metadata blocks, always
+// starting with the header, then writes them home and clears the journal.
+int32_t fs_journal_write(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    fs_bcache *bcache = fs->bcache;
+    fs_buf *head = fs_buf_of(bcache, fs->header);
+
+    fs->header->journal_seq++;
+    if (!fs_buf_logged(fs, head)) journal->pending++;
+    head->dirty = true;
+    head->meta = true;
+
+    fs_buf *bufs[FS_BCACHE_SIZE];
+    fs_journal_desc *desc = (fs_journal_desc *)bcache->scratch;
+    _memset(desc, 0, fs->block_size);
+    bufs[0] = head;
+    desc->blk[0] = head->blk;
+    desc->count = 1;
+    for (size_t i = 0; i < FS_BCACHE_SIZE && desc->count < journal->capacity; i++) {
+        fs_buf *buf = &bcache->bufs[i];
+        if (buf == head || !fs_buf_logged(fs, buf)) continue;
+        bufs[desc->count] = buf;
+        desc->blk[desc->count++] = buf->blk;
+    }
+    desc->magic = FS_JOURNAL_DESC;
+    desc->seq = fs->header->journal_seq;
+
+    uint32_t seq = desc->seq;
+    uint32_t count = desc->count;
+    uint32_t checksum = fs_checksum(2166136261u, desc, fs->block_size);
+    ERR(fs_dev_write(fs, journal->start, desc));
+    for (uint32_t i = 0; i < count; i++) {
+        fs_block *data = fs_buf_data(bcache, bufs[i]);
+        checksum = fs_checksum(checksum, data, fs->block_size);
+        ERR(fs_dev_write(fs, journal->start + 1 + i, data));
+    }
+
+    // the descriptor is done with, the same block holds the record
+    fs_journal_record *record = (fs_journal_record *)bcache->scratch;
+    _memset(record, 0, fs->block_size);
+    record->magic = FS_JOURNAL_COMMIT;
+    record->seq = seq;
+    record->count = count;
+    record->checksum = checksum;
+    ERR(fs_dev_write(fs, journal->start + 1 + count, record));
+    ERR(fs_dev_flush(fs));
+
+    // checkpoint
+    for (uint32_t i = 0; i < count; i++) {
+        ERR(fs_bcache_writeback(fs, bufs[i]));
+    }
+    ERR(fs_dev_flush(fs));
+    _memset(record, 0, fs->block_size);
+    ERR(fs_dev_write(fs, journal->start, record));
+    ERR(fs_dev_flush(fs));
+
+    journal->commits++;
+    journal->logged += count;
+    return count;
 }
 
-uint16_t fs_alloc_inode(fs_fs *fs) {
-    uint16_t ino = fs->header->free_ino;
-    fs->header->free_ino = fs_get_inode(fs, ino)->ino;      // inodes[INO_INVALID] should always point to itself
-    fs->header->inodes++;
-    return ino;
+// Commits all dirty metadata after writing back the data blocks it may
+// point to. Called between operations, whose credits keep what they log
+// within one transaction. Only after an operation overran its credits
+// does the rest go into a second one, which a crash can separate from
+// the first. Needs the cache lock, and ns_lock held exclusively: blocks
+// pinned by other threads may be halfway through a change, and only the
+// committing thread may pin any. The cache itself never commits.
+int32_t fs_journal_commit_locked(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    if (journal->capacity == 0) return SUCCESS;
+    journal->last = fs_now_ms();
+    if (journal->pending == 0) {
+        fs_journal_thaw(fs);
+        return SUCCESS;
+    }
+
+    for (size_t i = 0; i < FS_BCACHE_SIZE; i++) {
+        fs_buf *buf = &fs->bcache->bufs[i];
+        if (buf->valid && !buf->meta) ERR(fs_bcache_writeback(fs, buf));
+    }
+    ERR(fs_dev_flush(fs));
+
+    do {
+        ERR(fs_journal_write(fs));
+    } while (journal->pending > 0);
+    fs_journal_thaw(fs);
+    return SUCCESS;
 }
 
-void fs_free_block(fs_fs *fs, uint16_t blk) {
-    assert(blk != BLK_INVALID);
-    assert(blk < fs->header->blocks_total);
-    fs_block *block = &fs->blocks[blk];
-    block->free.next = fs->header->free_blk;
-    fs->header->free_blk = blk;
-    fs->header->blocks--;
+int32_t fs_journal_commit(fs_fs *fs) {
+    if (fs->journal.capacity == 0) return SUCCESS;
+    MUTEX_LOCK(&fs->bcache->lock);
+    int32_t err = fs_journal_commit_locked(fs);
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    return err;
 }
 
-// TODO improve
-bool fs_ino_truncate_cb(uint16_t *block, fs_index i, void *vargs) {
-    printf("cb-trunc %d %d\n", *block, i.index);
-    fs_ino_trunc_cb_args *args = (fs_ino_trunc_cb_args *)vargs;
-
-    int32_t offset = i.index * args->fs->header->block_size;
-    int32_t old_left = args->old_size - offset;
-    int32_t new_left = args->new_size - offset;
-
-    if (old_left > 0) {
-        if (new_left > 0) {
-            if (i.pre | i.post) return true;
-            // TODO investigate
-            // int32_t size = args->fs->header->block_size - old_left;
-            // if (size > 0)
-            //     _memset(&args->fs->blocks[*block].bytes + old_left + 1, 0, size - 1);   // why off by one?
+// Reserves FS_JOURNAL_CREDITS for the operation about to start on this
+// thread, after a commit if the transaction has no room for them or the
+// blocks it freed are needed. The commit waits for running operations,
+// so the caller must not hold ns_lock. Calls nest, only the outermost
+// one reserves. Direct callers of the fs_ino functions bracket each
+// operation with this and fs_journal_end, or else call fs_journal_tick
+// between operations.
+int32_t fs_journal_begin(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    if (journal->capacity == 0 || fs_journal_depth++ > 0) return SUCCESS;
+
+    int32_t err = SUCCESS;
+    while (true) {
+        // after a failed commit the operation runs anyway and fails itself
+        MUTEX_LOCK(&fs->bcache->lock);
+        bool room = journal->pending + journal->reserved + FS_JOURNAL_CREDITS <= journal->limit
+            && !fs_journal_starved(fs);
+        if (room || err < 0) {
+            journal->reserved += FS_JOURNAL_CREDITS;
+            fs_journal_credits = FS_JOURNAL_CREDITS;
         }
-        else {
-            // free
-            if (i.pre) return true;
-            assert(*block != BLK_INVALID);
-            fs_free_block(args->fs, *block);
-            *block = BLK_INVALID;
+        MUTEX_UNLOCK(&fs->bcache->lock);
+        if (room || err < 0) return err;
+
+        RWLOCK_WRITE(&fs->ns_lock);
+        err = fs_journal_commit(fs);
+        RWLOCK_UNLOCK(&fs->ns_lock);
+    }
+}
+
+// gives back the credits the operation did not use
+void fs_journal_end(fs_fs *fs) {
+    if (fs->journal.capacity == 0 || --fs_journal_depth > 0) return;
+    MUTEX_LOCK(&fs->bcache->lock);
+    fs->journal.reserved -= fs_journal_credits;
+    fs_journal_credits = 0;
+    MUTEX_UNLOCK(&fs->bcache->lock);
+}
+
+// Whether the running operation can log n more blocks. Outside of
+// fs_journal_begin, whether the transaction can take them.
+bool fs_journal_room(fs_fs *fs, uint32_t n) {
+    fs_journal *journal = &fs->journal;
+    if (journal->capacity == 0) return true;
+    if (fs_journal_depth > 0) return fs_journal_credits >= n;
+    MUTEX_LOCK(&fs->bcache->lock);
+    bool room = journal->pending + journal->reserved + n <= journal->limit;
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    return room;
+}
+
+// Lets a long operation go on in steps of up to FS_JOURNAL_STEP logged
+// blocks: commits what it did so far once its credits run low, and
+// renews them. Only at points where the image is consistent, and only
+// with ns_lock held exclusively or by the only thread using the fs.
+int32_t fs_journal_step(fs_fs *fs) {
+    if (fs_journal_room(fs, FS_JOURNAL_STEP)) return SUCCESS;
+    int32_t err = fs_journal_commit(fs);
+    if (fs_journal_depth > 0) {
+        MUTEX_LOCK(&fs->bcache->lock);
+        fs->journal.reserved += FS_JOURNAL_CREDITS - fs_journal_credits;
+        fs_journal_credits = FS_JOURNAL_CREDITS;
+        MUTEX_UNLOCK(&fs->bcache->lock);
+    }
+    return err;
+}
+
+// ms until the logged blocks are due for a commit, a whole interval if
+// there are none
+uint64_t fs_journal_due(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    MUTEX_LOCK(&fs->bcache->lock);
+    uint64_t waited = fs_now_ms() - journal->last;
+    uint64_t ms = journal->interval;
+    if (journal->pending > 0) ms = waited < journal->interval ? journal->interval - waited : 0;
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    return MAX(ms, 1);
+}
+
+// Called between operations, groups them into one commit until the
+// transaction could not take another operation, the blocks it freed are
+// needed or the commit interval has passed. The commit waits for running operations, so the caller must
+// not hold ns_lock.
+int32_t fs_journal_tick(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    if (journal->capacity == 0) return SUCCESS;
+
+    MUTEX_LOCK(&fs->bcache->lock);
+    uint32_t pending = journal->pending;
+    bool full = pending + journal->reserved + FS_JOURNAL_CREDITS > journal->limit
+        || fs_journal_starved(fs);
+    bool due = fs_now_ms() - journal->last >= journal->interval;
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    if (pending == 0 || (!full && !due)) return SUCCESS;
+
+    RWLOCK_WRITE(&fs->ns_lock);
+    int32_t err = fs_journal_commit(fs);
+    RWLOCK_UNLOCK(&fs->ns_lock);
+    return err;
+}
+
+// blocks a transaction in the journal of the image can hold
+uint32_t fs_journal_capacity(fs_fs *fs) {
+    uint32_t blocks = fs->header->blocks_journal;
+    uint32_t max = (fs->block_size - sizeof(fs_journal_desc)) / sizeof(uint32_t);
+    return blocks > 2 ? MIN(blocks - 2, max) : 0;
+}
+
+// Writes a committed transaction left in the journal to its home blocks,
+// also where the journal is too small to be used any more. Returns the
+// number of blocks replayed.
+int32_t fs_journal_replay(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    uint32_t capacity = fs_journal_capacity(fs);
+    if (capacity == 0) return 0;
+
+    // the descriptor, the commit record and then the copies
+    uint32_t block_size = fs->block_size;
+    uint8_t *buffer = (uint8_t *)malloc((capacity + 2) * block_size);
+    if (buffer == NULL) return -ENOMEM;
+    fs_journal_desc *desc = (fs_journal_desc *)buffer;
+    fs_journal_record *record = (fs_journal_record *)(buffer + block_size);
+    uint8_t *copies = buffer + 2 * block_size;
+
+    int32_t err = fs_dev_read(fs, journal->start, desc);
+    if (err < 0 || desc->magic != FS_JOURNAL_DESC) {
+        free(buffer);
+        return err;
+    }
+
+    bool valid = desc->count > 0 && desc->count <= capacity;
+    if (valid) err = fs_dev_read(fs, journal->start + 1 + desc->count, record);
+    valid = valid && err == SUCCESS
+        && record->magic == FS_JOURNAL_COMMIT
+        && record->seq == desc->seq
+        && record->count == desc->count;
+
+    uint32_t checksum = fs_checksum(2166136261u, desc, block_size);
+    for (uint32_t i = 0; valid && i < desc->count && err == SUCCESS; i++) {
+        err = fs_dev_read(fs, journal->start + 1 + i, copies + i * block_size);
+        checksum = fs_checksum(checksum, copies + i * block_size, block_size);
+        valid = desc->blk[i] < fs->header->blocks_all;
+    }
+    valid = valid && checksum == record->checksum;
+
+    for (uint32_t i = 0; valid && i < desc->count && err == SUCCESS; i++) {
+        err = fs_dev_write(fs, desc->blk[i], copies + i * block_size);
+    }
+    int32_t count = valid ? (int32_t)desc->count : 0;
+    if (err == SUCCESS) err = fs_dev_flush(fs);
+
+    // a torn transaction is dropped as well
+    _memset(buffer, 0, block_size);
+    if (err == SUCCESS) err = fs_dev_write(fs, journal->start, buffer);
+    if (err == SUCCESS) err = fs_dev_flush(fs);
+    free(buffer);
+    ERR(err);
+    return count;
+}
+
+// least recently used buffer that can be reused without a commit
+fs_buf *fs_bcache_victim(fs_fs *fs) {
+    fs_buf *buf = fs->bcache->lru.prev;
+    while (buf != &fs->bcache->lru) {
+        if (buf->refs == 0 && !fs_buf_logged(fs, buf)) return buf;
+        buf = buf->prev;
+    }
+    return NULL;
+}
+
+fs_block *fs_bcache_get(fs_fs *fs, uint32_t blk, bool fill, bool meta) {
+    fs_bcache *bcache = fs->bcache;
+    fs_buf *buf = fs_bcache_find(bcache, blk);
+    if (buf != NULL) {
+        bool logged = fs_buf_logged(fs, buf);
+        bcache->hits++;
+        fs_bcache_touch(bcache, buf);
+        buf->refs++;
+        if (!fill) {
+            _memset(fs_buf_data(bcache, buf), 0, fs->block_size);
+            buf->dirty = true;
         }
-        return true;
+        // dirty metadata stays journaled when it is read as data
+        if (meta || !buf->dirty || !fill) buf->meta = meta;
+        fs_journal_account(fs, buf, logged);
+        return fs_buf_data(bcache, buf);
+    }
+    bcache->misses++;
+
+    // logged blocks wait for the commit between operations, which the
+    // journal limit keeps to half the cache
+    buf = fs_bcache_victim(fs);
+    if (buf == NULL) return NULL;
+
+    if (buf->valid) {
+        if (fs_bcache_writeback(fs, buf) < 0) return NULL;
+        fs_bcache_unhash(bcache, buf);
+    }
+
+    fs_block *data = fs_buf_data(bcache, buf);
+    if (fill) {
+        if (fs->dev->read_block(fs->dev->ctx, blk, data, fs->block_size) < 0) return NULL;
     }
     else {
-        if (new_left > 0) {
-            // alloc
-            if (i.post) return true;
-            assert(*block == BLK_INVALID);
-            *block = fs_alloc_block(args->fs);
-            if (*block == INO_INVALID) {
-                args->output = -ENOSPC;
-                return false;
-            };
+        _memset(data, 0, fs->block_size);
+    }
+
+    buf->blk = blk;
+    buf->valid = true;
+    buf->dirty = !fill;
+    buf->meta = meta;
+    buf->refs = 1;
+    buf->hash_next = bcache->hash[blk % FS_BCACHE_HASH];
+    bcache->hash[blk % FS_BCACHE_HASH] = buf;
+    fs_bcache_touch(bcache, buf);
+    fs_journal_account(fs, buf, false);
+    return data;
+}
+
+// Pins device block blk, reading it unless fill is false, in which case
+// the buffer is zeroed. meta marks blocks whose changes are journaled.
+// Returns NULL on I/O errors or when every buffer is pinned.
+fs_block *fs_bget_fill(fs_fs *fs, uint32_t blk, bool fill, bool meta) {
+    if (fs->raw != NULL) return fs_raw_block(fs, blk);
+
+    MUTEX_LOCK(&fs->bcache->lock);
+    fs_block *data = fs_bcache_get(fs, blk, fill, meta);
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    return data;
+}
+
+fs_block *fs_bget(fs_fs *fs, uint32_t blk) {
+    return fs_bget_fill(fs, blk, true, true);
+}
+
+// marks the block holding ptr as modified
+void fs_bdirty(fs_fs *fs, const void *ptr) {
+    if (fs->raw != NULL) return;
+    fs_buf *buf = fs_buf_of(fs->bcache, ptr);
+    MUTEX_LOCK(&fs->bcache->lock);
+    bool logged = fs_buf_logged(fs, buf);
+    buf->dirty = true;
+    fs_journal_account(fs, buf, logged);
+    MUTEX_UNLOCK(&fs->bcache->lock);
+}
+
+// unpins the block holding ptr
+void fs_bput(fs_fs *fs, const void *ptr, bool dirty) {
+    if (fs->raw != NULL) return;
+    fs_buf *buf = fs_buf_of(fs->bcache, ptr);
+    MUTEX_LOCK(&fs->bcache->lock);
+    assert(buf->refs > 0);
+    bool logged = fs_buf_logged(fs, buf);
+    buf->dirty |= dirty;
+    buf->refs--;
+    fs_journal_account(fs, buf, logged);
+    MUTEX_UNLOCK(&fs->bcache->lock);
+}
+
+// number of the count blocks from blk on, up to the first cached one,
+// that are not in the cache and so are current on the device
+uint32_t fs_bcache_uncached(fs_fs *fs, uint32_t blk, uint32_t count) {
+    MUTEX_LOCK(&fs->bcache->lock);
+    uint32_t n = 0;
+    while (n < count && fs_bcache_find(fs->bcache, blk + n) == NULL) n++;
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    return n;
+}
 
-            _memset(&args->fs->blocks[*block], 0, args->fs->header->block_size);
-            return true;
+// Puts count blocks read from blk on into the cache as clean buffers,
+// skipping those cached meanwhile. Returns how many it found room for.
+uint32_t fs_bcache_fill(fs_fs *fs, uint32_t blk, uint32_t count, const uint8_t *data) {
+    fs_bcache *bcache = fs->bcache;
+    MUTEX_LOCK(&bcache->lock);
+    uint32_t i = 0;
+    for (; i < count; i++) {
+        if (fs_bcache_find(bcache, blk + i) != NULL) continue;
+        fs_buf *buf = fs_bcache_victim(fs);
+        if (buf == NULL) break;
+        if (buf->valid) {
+            if (fs_bcache_writeback(fs, buf) < 0) break;
+            fs_bcache_unhash(bcache, buf);
         }
-        return false;
+
+        _memcpy(fs_buf_data(bcache, buf), data + (size_t)i * fs->block_size, fs->block_size);
+        buf->blk = blk + i;
+        buf->valid = true;
+        buf->dirty = false;
+        buf->meta = false;
+        buf->refs = 0;
+        buf->hash_next = bcache->hash[(blk + i) % FS_BCACHE_HASH];
+        bcache->hash[(blk + i) % FS_BCACHE_HASH] = buf;
+        fs_bcache_touch(bcache, buf);
     }
+    MUTEX_UNLOCK(&bcache->lock);
+    return i;
 }
 
-int32_t fs_ino_truncate(fs_fs *fs, uint16_t ino, size_t size) {
-    fs_inode *inode = fs_get_inode(fs, ino);
-    fs_ino_trunc_cb_args args = {
-        fs,
-        (int32_t)inode->size,
-        (int32_t)size,
-        SUCCESS
-    };
-    fs_ino_enumerate_blocks(fs, ino, fs_ino_truncate_cb, &args);
+// commits and writes back everything, with ns_lock held exclusively
+int32_t fs_bflush(fs_fs *fs) {
+    if (fs->raw != NULL) return SUCCESS;
+    MUTEX_LOCK(&fs->bcache->lock);
+    int32_t err = fs_journal_commit_locked(fs);
+    for (size_t i = 0; i < FS_BCACHE_SIZE && err == SUCCESS; i++) {
+        fs_buf *buf = &fs->bcache->bufs[i];
+        if (buf->valid) err = fs_bcache_writeback(fs, buf);
+    }
+    MUTEX_UNLOCK(&fs->bcache->lock);
+    ERR(err);
+    return fs_dev_flush(fs);
+}
 
-    // TODO handle errors better
-    inode->size = size;
-    return args.output;
+// directory and indirect blocks
+static inline fs_block *fs_get_block(fs_fs *fs, uint32_t blk) {
+    return fs_bget(fs, fs->data_start + blk);
 }
 
-void fs_free_inode(fs_fs *fs, uint16_t ino) {
-    fs_ino_truncate(fs, ino, 0);
+// file contents, which are written back before the metadata is committed
+static inline fs_block *fs_get_data_block(fs_fs *fs, uint32_t blk) {
+    return fs_bget_fill(fs, fs->data_start + blk, true, false);
+}
 
-    fs_inode *inode = fs_get_inode(fs, ino);
-    inode->ino = fs->header->free_ino;
-    fs->header->free_ino = ino;
-    fs->header->inodes--;
+// pins a freshly allocated block without reading it, zeroed
+static inline fs_block *fs_get_new_block(fs_fs *fs, uint32_t blk, bool meta) {
+    return fs_bget_fill(fs, fs->data_start + blk, false, meta);
 }
 
-// TODO error handling
-bool fs_ino_read_cb(uint16_t *block, fs_index i, void *vargs) {
-    printf("cb-read %d %d\n", *block, i.index);
-    if (i.pre || i.post) return true;
+static inline void fs_put_block(fs_fs *fs, const void *block, bool dirty) {
+    fs_bput(fs, block, dirty);
+}
 
-    fs_ino_rw_cb_args *args = (fs_ino_rw_cb_args *)vargs;
-    int32_t offset = i.index * args->fs->header->block_size;
-    int32_t left = args->size - offset;
-    if (left <= 0) return false;
+fs_inode *fs_inode_ptr(fs_fs *fs, uint32_t ino) {
+    uint32_t per_block = fs->header->block_size / sizeof(fs_inode);
+    fs_block *block = fs_bget(fs, fs->inode_start + ino / per_block);
+    if (block == NULL) return NULL;
+    return (fs_inode *)block + ino % per_block;
+}
 
-    assert(*block != BLK_INVALID);
-    size_t min = MIN(left, args->fs->header->block_size);
-    _memcpy((uint8_t *)args->buffer + offset, &args->fs->blocks[*block], min);
-    return true;
+static inline fs_inode *fs_get_inode(fs_fs *fs, uint32_t ino) {
+    assert(ino != INO_INVALID);
+    assert(ino <= fs->header->max_ino);
+    return fs_inode_ptr(fs, ino);
+}
+
+static inline void fs_put_inode(fs_fs *fs, fs_inode *inode, bool dirty) {
+    fs_bput(fs, inode, dirty);
 }
 
-int32_t fs_ino_read(fs_fs *fs, uint16_t ino, void *buffer, size_t size) {
-    int32_t min = MIN(size, fs_get_inode(fs, ino)->size);
-    fs_ino_rw_cb_args args = { fs, buffer, min, 0 };
-    fs_ino_enumerate_blocks(fs, ino, fs_ino_read_cb, &args);
-    // TODO return
-    return min;
+// root of the indirect tree with level + 1 levels
+static inline uint32_t *fs_inode_root(fs_inode *inode, uint32_t level) {
+    uint32_t *roots[FS_BLOCK_LEVELS] = { &inode->block_p, &inode->block_pp, &inode->block_ppp };
+    return roots[level];
 }
 
-// TODO error handling
-bool fs_ino_write_cb(uint16_t *block, fs_index i, void *vargs) {
-    printf("cb-write %d %d\n", *block, i.index);
-    if (i.pre || i.post) return true;
+static inline bool fs_inode_inline(fs_inode *inode) {
+    return inode->mode & FS_MODE_INLINE;
+}
 
-    fs_ino_rw_cb_args *args = (fs_ino_rw_cb_args *)vargs;
-    int32_t offset = i.index * args->fs->header->block_size;
-    int32_t left = args->size - offset;
-    if (left <= 0) return false;
+// directories only pass the flag on to the files created in them
+static inline bool fs_inode_compressed(fs_inode *inode) {
+    return (inode->mode & FS_MODE_COMPRESS) && (inode->mode & (S_IFMT >> 3)) == (S_IFREG >> 3);
+}
 
-    assert(*block != BLK_INVALID);
-    size_t min = MIN(left, args->fs->header->block_size);
-    _memcpy(&args->fs->blocks[*block], (uint8_t *)args->buffer + offset, min);
-    args->output += min;
-    return true;
+static inline uint8_t *fs_inline_data(fs_inode *inode) {
+    return (uint8_t *)inode->block;
 }
 
-int32_t fs_ino_write(fs_fs *fs, uint16_t ino, const void *buffer, size_t size) {
-    fs_ino_truncate(fs, ino, size);
+static inline bool fs_mode_islnk(uint16_t mode) {
+    return (mode & (S_IFMT >> 3)) == (S_IFLNK >> 3);
+}
 
-    fs_ino_rw_cb_args args = { fs, (void *)buffer, (int32_t)size, 0 };
-    fs_ino_enumerate_blocks(fs, ino, fs_ino_write_cb, &args);
-    return args.output;
+// regular files and symlinks are kept inline while they are small enough
+static inline bool fs_inode_inlinable(fs_fs *fs, fs_inode *inode) {
+    UNUSED(fs);
+    uint16_t type = inode->mode & (S_IFMT >> 3);
+    return type == (S_IFREG >> 3) || type == (S_IFLNK >> 3);
 }
 
-int32_t fs_ino_write_cstr(fs_fs *fs, uint16_t ino, const char *string) {
-    size_t size = _strlen(string);
-    return fs_ino_write(fs, ino, (uint8_t *)string, size);
+static inline bool fs_ino_isdir(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode == NULL) return false;
+    bool isdir = inode->mode & (S_IFDIR >> 3);
+    fs_put_inode(fs, inode, false);
+    return isdir;
 }
 
-// TODO improve directory handling
-fs_dentry *fs_dir_entry(fs_dir *dir) {
-    if (dir->size <= 0) return NULL;
-    return (fs_dentry *)dir->buffer;
+static inline bool fs_ino_isreg(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode == NULL) return false;
+    bool isreg = (inode->mode & (S_IFMT >> 3)) == (S_IFREG >> 3);
+    fs_put_inode(fs, inode, false);
+    return isreg;
 }
 
-// TODO improve
-fs_dentry *fs_dir_next(fs_dir *dir) {
-    fs_dentry *dentry = fs_dir_entry(dir);
-    if (dentry == NULL) return NULL;
-    dir->size -= 5 + dentry->len;
-    dir->buffer += 5 + dentry->len;
-    return fs_dir_entry(dir);
+// whether FS_MODE_COMPRESS is set, on a file or a directory
+static inline bool fs_ino_compressed(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode == NULL) return false;
+    bool compressed = inode->mode & FS_MODE_COMPRESS;
+    fs_put_inode(fs, inode, false);
+    return compressed;
 }
 
-fs_dentry *fs_dir_search(fs_dir *dir, const char *name) {
-    fs_dentry *dentry = fs_dir_entry(dir);
-    while (dentry != NULL) {
-        if (!_strcmp(&dentry->name, name)) return dentry;
-        dentry = fs_dir_next(dir);
+static inline uint32_t fs_cluster_blocks(fs_fs *fs) {
+    return MAX(FS_CLUSTER_BLOCKS_MIN, FS_CLUSTER_SIZE / fs->header->block_size);
+}
+
+static inline size_t fs_cluster_size(fs_fs *fs) {
+    return (size_t)fs_cluster_blocks(fs) * fs->header->block_size;
+}
+
+// FNV-1a
+uint32_t fs_dir_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
     }
-    return NULL;
+    return hash;
 }
 
-int32_t fs_ino_readdir(fs_fs *fs, uint16_t ino, fs_dir *dir, size_t size) {
-    if (!fs_ino_isdir(fs, ino)) return -ENOTDIR;
-    dir->size = fs_get_inode(fs, ino)->size;
-    int32_t read = fs_ino_read(fs, ino, dir->buffer, size);
-    if (read < 0) return read;
-    if (read != dir->size) return -EFBIG;
-    return SUCCESS;
+fs_dcache_entry *fs_dcache_slot(fs_fs *fs, uint32_t parent_ino, uint32_t hash) {
+    uint32_t i = (hash ^ (parent_ino * 2654435761u)) & (FS_DCACHE_SIZE - 1);
+    return &fs->dcache->entries[i];
 }
 
-void fs_ino_refs_inc(fs_fs *fs, uint16_t ino) {
-    fs_inode *inode = fs_get_inode(fs, ino);
-    inode->refs++;
+// returns true on a hit and stores the ino or -ENOENT in *ino
+bool fs_dcache_lookup(fs_fs *fs, uint32_t parent_ino, const char *name, int32_t *ino) {
+    if (fs->dcache == NULL) return false;
+
+    uint32_t hash = fs_dir_hash(name);
+    MUTEX_LOCK(&fs->dcache->lock);
+    fs_dcache_entry *entry = fs_dcache_slot(fs, parent_ino, hash);
+    bool hit = entry->parent_ino == parent_ino && entry->hash == hash && !_strcmp(entry->name, name);
+
+    if (!hit) fs->dcache->misses++;
+    else if (entry->ino == INO_INVALID) fs->dcache->negative_hits++;
+    else fs->dcache->hits++;
+    if (hit) *ino = entry->ino == INO_INVALID ? -ENOENT : (int32_t)entry->ino;
+
+    MUTEX_UNLOCK(&fs->dcache->lock);
+    return hit;
 }
 
-void fs_ino_refs_dec(fs_fs *fs, uint16_t ino) {
-    fs_inode *inode = fs_get_inode(fs, ino);
-    inode->refs--;
-    if (inode->refs == 0) fs_free_inode(fs, ino);
+// caches ino, or a negative entry for INO_INVALID
+void fs_dcache_insert(fs_fs *fs, uint32_t parent_ino, const char *name, uint32_t ino) {
+    if (fs->dcache == NULL) return;
+
+    size_t len = _strlen(name);
+    if (len >= FS_NAME_LEN_MAX) return;
+
+    uint32_t hash = fs_dir_hash(name);
+    MUTEX_LOCK(&fs->dcache->lock);
+    fs_dcache_entry *entry = fs_dcache_slot(fs, parent_ino, hash);
+    entry->parent_ino = parent_ino;
+    entry->ino = ino;
+    entry->hash = hash;
+    _memcpy(entry->name, name, len + 1);
+    MUTEX_UNLOCK(&fs->dcache->lock);
 }
 
-int32_t fs_ino_link(fs_fs *fs, uint16_t parent_ino, uint16_t ino, const char *name) {
-    READDIR(fs, parent_ino);
+// drops every entry below a directory whose inode is being reused
+void fs_dcache_invalidate_dir(fs_fs *fs, uint32_t parent_ino) {
+    if (fs->dcache == NULL) return;
 
-    fs_dir tmp = { dir.size, dir.buffer };
-    fs_dentry *res = fs_dir_search(&tmp, name);
-    if (res != NULL) return -EEXIST;
+    MUTEX_LOCK(&fs->dcache->lock);
+    for (size_t i = 0; i < FS_DCACHE_SIZE; i++) {
+        fs_dcache_entry *entry = &fs->dcache->entries[i];
+        if (entry->parent_ino == parent_ino) entry->parent_ino = INO_INVALID;
+    }
+    MUTEX_UNLOCK(&fs->dcache->lock);
+}
+
+static inline fs_ccache_entry *fs_ccache_find(fs_ccache *ccache, uint32_t ino, uint32_t cluster) {
+    for (size_t i = 0; i < FS_CCACHE_SIZE; i++) {
+        fs_ccache_entry *entry = &ccache->entries[i];
+        if (entry->ino == ino && entry->cluster == cluster) return entry;
+    }
+    return NULL;
+}
 
-    int32_t size = dir.size;
-    fs_dentry *new_dentry = (fs_dentry *)(dir.buffer + size);
+static inline uint8_t *fs_ccache_data(fs_fs *fs, fs_ccache_entry *entry) {
+    return fs->ccache->data + (entry - fs->ccache->entries) * fs_cluster_size(fs);
+}
 
-    int32_t len = _strlen(name);
-    new_dentry->ino = ino;
-    new_dentry->len = len;
-    _memcpy(&new_dentry->name, name, len + 1);
+// copies a cached cluster to data, returns true on a hit
+bool fs_ccache_lookup(fs_fs *fs, uint32_t ino, uint32_t cluster, uint8_t *data) {
+    if (fs->ccache == NULL) return false;
 
-    int32_t written = fs_ino_write(fs, parent_ino, buffer, size + 5 + len);
-    if (written != size + 5 + len) return -EIO;
-    fs_ino_refs_inc(fs, ino);
-    return SUCCESS;
+    MUTEX_LOCK(&fs->ccache->lock);
+    fs_ccache_entry *entry = fs_ccache_find(fs->ccache, ino, cluster);
+    if (entry != NULL) {
+        _memcpy(data, fs_ccache_data(fs, entry), fs_cluster_size(fs));
+        entry->used = ++fs->ccache->clock;
+        fs->ccache->hits++;
+    }
+    else fs->ccache->misses++;
+    MUTEX_UNLOCK(&fs->ccache->lock);
+    return entry != NULL;
 }
 
-int32_t fs_ino_unlink(fs_fs *fs, uint16_t parent_ino, const char *name) {
-    READDIR(fs, parent_ino);
-   
-    size_t size = fs_get_inode(fs, parent_ino)->size;
-    
-    fs_dentry *dentry = fs_dir_search(&dir, name);
-    if (dentry == NULL) return -ENOENT;
+// caches a cluster in an empty slot or the least recently used one
+void fs_ccache_insert(fs_fs *fs, uint32_t ino, uint32_t cluster, const uint8_t *data) {
+    if (fs->ccache == NULL) return;
 
-    uint8_t *buf = dir.buffer;
-    uint16_t len = dentry->len;
+    MUTEX_LOCK(&fs->ccache->lock);
+    fs_ccache_entry *entry = fs_ccache_find(fs->ccache, ino, cluster);
+    if (entry == NULL) {
+        entry = &fs->ccache->entries[0];
+        for (size_t i = 1; i < FS_CCACHE_SIZE; i++) {
+            if (fs->ccache->entries[i].used < entry->used) entry = &fs->ccache->entries[i];
+        }
+    }
+    entry->ino = ino;
+    entry->cluster = cluster;
+    entry->used = ++fs->ccache->clock;
+    _memcpy(fs_ccache_data(fs, entry), data, fs_cluster_size(fs));
+    MUTEX_UNLOCK(&fs->ccache->lock);
+}
 
-    fs_dir_next(&dir);
-    // TODO UB
-    _memcpy(buf, dir.buffer, dir.size);
+// drops the cached clusters [from, to) of ino
+void fs_ccache_invalidate(fs_fs *fs, uint32_t ino, uint32_t from, uint32_t to) {
+    if (fs->ccache == NULL) return;
 
-    ERR(fs_ino_write(fs, parent_ino, buffer, size - (5 + len)));
+    MUTEX_LOCK(&fs->ccache->lock);
+    for (size_t i = 0; i < FS_CCACHE_SIZE; i++) {
+        fs_ccache_entry *entry = &fs->ccache->entries[i];
+        if (entry->ino == ino && entry->cluster >= from && entry->cluster < to) *entry = (fs_ccache_entry){ INO_INVALID, 0, 0 };
+    }
+    MUTEX_UNLOCK(&fs->ccache->lock);
+}
 
-    fs_ino_refs_dec(fs, dentry->ino);
-    return SUCCESS;
+bool fs_enumerate_tree(
+    fs_fs *fs,
+    uint32_t *slot,
+    uint32_t depth,
+    uint32_t *i,
+    bool(*callback)(uint32_t *, fs_index, void *),
+    void *args
+) {
+    if (depth == 0) return callback(slot, (fs_index){ 0, 0, (*i)++ }, args);
+
+    if (!callback(slot, (fs_index){ 1, 0, *i }, args)) return false;
+    uint32_t *pblock = (uint32_t *)fs_get_block(fs, *slot);
+    if (pblock == NULL) return false;
+
+    bool more = true;
+    for (size_t j = 0; j < fs->header->blockp_len && more; j++) {
+        more = fs_enumerate_tree(fs, &pblock[j], depth - 1, i, callback, args);
+    }
+    fs_put_block(fs, pblock, true);
+    return more && callback(slot, (fs_index){ 0, 1, *i }, args);
 }
 
-void fs_init_inode(fs_fs *fs, uint16_t ino, uint16_t mode) {
+void fs_ino_enumerate_blocks(
+    fs_fs *fs,
+    uint32_t ino,
+    bool(*callback)(uint32_t *, fs_index, void *),
+    void *args
+) {
+    // TODO error handling
     fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode == NULL) return;
 
-    inode->ino = ino;
-    inode->uid = 0;
-    inode->gid = 0;
-    inode->mode = mode;
-    inode->refs = 0;
-    inode->time = time(NULL);
-    for (size_t i = 0; i < FS_BLOCK_POINTERS; i++) {
-        inode->block[i] = BLK_INVALID;
+    uint32_t i = 0;
+    bool more = true;
+    while (i < FS_BLOCK_POINTERS && more) {
+        more = callback(&inode->block[i], (fs_index){ 0, 0, i }, args);
+        i++;
     }
-    inode->block_p = BLK_INVALID;
-    inode->block_pp = BLK_INVALID;
+
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS && more; level++) {
+        more = fs_enumerate_tree(fs, fs_inode_root(inode, level), level + 1, &i, callback, args);
+    }
+    fs_put_inode(fs, inode, true);
 }
 
-int32_t fs_ino_mk(fs_fs *fs, uint16_t parent_ino, const char *name, uint16_t mode) {
-    if (!fs_ino_isdir(fs, parent_ino)) return -ENOTDIR;
+static inline bool fs_bitmap_get(uint8_t *bitmap, uint32_t i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
 
-    int32_t ino = fs_alloc_inode(fs);
-    CHECK_INO(ino);
+static inline void fs_bitmap_set(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] |= 1 << (i % 8);
+}
 
-    fs_init_inode(fs, ino, mode);
-    ERR(fs_ino_link(fs, parent_ino, ino, name));
-    return ino;
+static inline void fs_bitmap_clear(uint8_t *bitmap, uint32_t i) {
+    bitmap[i / 8] &= ~(1 << (i % 8));
 }
 
-int32_t fs_ino_mkdir(fs_fs *fs, uint16_t parent_ino, const char *name, uint16_t mode) {
-    int16_t ino = fs_ino_mk(fs, parent_ino, name, mode | (S_IFDIR >> 3));
-    CHECK_INO(ino);
+// first clear bit in [from, to), to if there is none
+uint32_t fs_bitmap_find(uint8_t *bitmap, uint32_t from, uint32_t to) {
+    uint32_t i = from;
+    while (i < to) {
+        if (i % 8 == 0 && bitmap[i / 8] == 0xFF) {
+            i += 8;
+            continue;
+        }
+        if (!fs_bitmap_get(bitmap, i)) return i;
+        i++;
+    }
+    return to;
+}
 
-    ERR(fs_ino_link(fs, ino, ino, "."));
-    ERR(fs_ino_link(fs, ino, parent_ino, ".."));
-    return ino;
+// first run of count clear bits in [from, to), to if there is none
+uint32_t fs_bitmap_find_run(uint8_t *bitmap, uint32_t from, uint32_t to, uint32_t count) {
+    uint32_t i = fs_bitmap_find(bitmap, from, to);
+    while (i < to) {
+        uint32_t n = 1;
+        while (n < count && i + n < to && !fs_bitmap_get(bitmap, i + n)) n++;
+        if (n == count) return i;
+        i = fs_bitmap_find(bitmap, i + n, to);
+    }
+    return to;
 }
 
-int32_t fs_ino_mknod(fs_fs *fs, uint16_t parent_ino, const char *name, uint16_t mode) {
-    return fs_ino_mk(fs, parent_ino, name, mode);
+// pins the bitmap block covering data block blk
+static inline uint8_t *fs_get_bitmap(fs_fs *fs, uint32_t blk) {
+    uint32_t bits = fs->header->block_size * 8;
+    return (uint8_t *)fs_bget(fs, fs->bitmap_start + blk / bits);
 }
 
-int32_t fs_name_to_ino(fs_fs *fs, uint16_t ino, const char *name) {
-    if (*name == '\0') return ino;
-    
+// pins the descriptor of group g
+static inline fs_group *fs_get_group(fs_fs *fs, uint32_t g) {
+    uint32_t per_block = fs->header->block_size / sizeof(fs_group);
+    fs_block *block = fs_bget(fs, 1 + g / per_block);
+    if (block == NULL) return NULL;
+    return (fs_group *)block + g % per_block;
+}
+
+static inline void fs_put_group(fs_fs *fs, fs_group *group, bool dirty) {
+    fs_bput(fs, group, dirty);
+}
+
+static inline uint32_t fs_blk_group(fs_fs *fs, uint32_t blk) {
+    return blk / (fs->header->block_size * 8);
+}
+
+static inline uint32_t fs_ino_group(fs_fs *fs, uint32_t ino) {
+    return ino / fs->header->inodes_group;
+}
+
+// inodes in group g that can be handed out
+static inline uint32_t fs_group_inodes(fs_fs *fs, uint32_t g) {
+    uint32_t total = fs->header->inodes_total;
+    uint32_t from = MIN((uint64_t)g * fs->header->inodes_group, total);
+    uint32_t to = MIN((uint64_t)(g + 1) * fs->header->inodes_group, total);
+    return to - from - (g == 0);
+}
+
+// blocks in group g that can be handed out
+static inline uint32_t fs_group_blocks(fs_fs *fs, uint32_t g) {
+    uint32_t bits = fs->header->block_size * 8;
+    uint32_t total = fs->header->blocks_total;
+    return MIN((uint64_t)(g + 1) * bits, total) - (uint64_t)g * bits - (g == 0);
+}
+
+// where the blocks of ino are looked for first
+static inline uint32_t fs_ino_home(fs_fs *fs, uint32_t ino) {
+    return MAX(fs_ino_group(fs, ino) * fs->header->block_size * 8, 1);
+}
+
+// adds count to the blocks in use in the group of blk
+static inline void fs_group_count_blocks(fs_fs *fs, uint32_t blk, int32_t count) {
+    fs_group *group = fs_get_group(fs, fs_blk_group(fs, blk));
+    if (group == NULL) return;
+    group->blocks += count;
+    fs_put_group(fs, group, true);
+}
+
+// Blocks freed in the running transaction are not handed out before it
+// commits: the committed tree may still point at them, and their new
+// contents could reach the disk first. The first free in a bitmap block
+// copies it, allocations search the copy and mark both, and the commit
+// drops the copies. Needs alloc_lock.
+static inline uint8_t *fs_alloc_view(fs_fs *fs, uint32_t blk, uint8_t *bitmap) {
+    fs_journal *journal = &fs->journal;
+    uint32_t index = fs_blk_group(fs, blk);
+    for (uint32_t i = 0; i < journal->frozen_count; i++) {
+        if (journal->frozen[i].index == index) return journal->frozen[i].bits;
+    }
+    return bitmap;
+}
+
+// copies the bitmap block covering blk before the first free in it
+int32_t fs_freeze_bitmap(fs_fs *fs, uint32_t blk, uint8_t *bitmap) {
+    fs_journal *journal = &fs->journal;
+    if (journal->capacity == 0 || fs_alloc_view(fs, blk, bitmap) != bitmap) return SUCCESS;
+    if (journal->frozen_count == FS_BCACHE_SIZE) return -ENOMEM;
+    uint8_t *bits = (uint8_t *)malloc(fs->header->block_size);
+    if (bits == NULL) return -ENOMEM;
+    _memcpy(bits, bitmap, fs->header->block_size);
+    journal->frozen[journal->frozen_count++] = (fs_frozen){ fs_blk_group(fs, blk), bits };
+    return SUCCESS;
+}
+
+// first free block in [from, to), scanning one bitmap block at a time
+uint32_t fs_bitmap_search(fs_fs *fs, uint32_t from, uint32_t to) {
+    uint32_t bits = fs->header->block_size * 8;
+    while (from < to) {
+        uint32_t base = from - from % bits;
+        uint32_t end = MIN(to, base + bits);
+        uint8_t *bitmap = fs_get_bitmap(fs, from);
+        if (bitmap == NULL) return to;
+        uint32_t i = fs_bitmap_find(fs_alloc_view(fs, from, bitmap), from - base, end - base);
+        fs_bput(fs, bitmap, false);
+        if (i < end - base) return base + i;
+        from = end;
+    }
+    return to;
+}
+
+uint32_t fs_alloc_blocks_locked(fs_fs *fs, uint32_t goal, uint32_t count, uint32_t *got) {
+    uint32_t total = fs->header->blocks_total;
+    if (goal == BLK_INVALID) goal = fs->header->free_blk;
+    if (goal == BLK_INVALID || goal >= total) goal = 1;
+
+    uint32_t blk = fs_bitmap_search(fs, goal, total);
+    if (blk >= total) {
+        blk = fs_bitmap_search(fs, 1, goal);
+        if (blk >= goal) return BLK_INVALID;
+    }
+
+    // runs stop at the end of the bitmap block, which is also the group
+    uint32_t bits = fs->header->block_size * 8;
+    uint32_t end = MIN(total, blk - blk % bits + bits);
+    uint8_t *bitmap = fs_get_bitmap(fs, blk);
+    if (bitmap == NULL) return BLK_INVALID;
+    uint8_t *view = fs_alloc_view(fs, blk, bitmap);
+
+    // rather than filling a small gap, look for room for the whole run
+    // further on in the goal's group
+    if (blk != goal && count > 1 && fs_blk_group(fs, blk) == fs_blk_group(fs, goal)) {
+        uint32_t base = blk - blk % bits;
+        uint32_t run = fs_bitmap_find_run(view, blk - base, end - base, count);
+        if (run < end - base) blk = base + run;
+    }
+
+    uint32_t n = 0;
+    while (n < count && blk + n < end && !fs_bitmap_get(view, (blk + n) % bits)) {
+        fs_bitmap_set(bitmap, (blk + n) % bits);
+        fs_bitmap_set(view, (blk + n) % bits);
+        n++;
+    }
+    fs_bput(fs, bitmap, true);
+    fs_group_count_blocks(fs, blk, n);
+
+    ATOMIC_ADD(&fs->header->blocks, n);
+    FS_COUNT(fs, blocks_alloc, n);
+    TRACE_BLOCK(TRACE_ALLOC, INO_INVALID, blk, n);
+    fs->header->free_blk = blk + n;
+    *got = n;
+    return blk;
+}
+
+// Allocates a run of up to count contiguous blocks, searching forward from
+// goal, or the last allocation without one, and wrapping around once.
+// Returns BLK_INVALID if the disk is full.
+uint32_t fs_alloc_blocks(fs_fs *fs, uint32_t goal, uint32_t count, uint32_t *got) {
+    MUTEX_LOCK(&fs->alloc_lock);
+    uint32_t blk = fs_alloc_blocks_locked(fs, goal, count, got);
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return blk;
+}
+
+uint32_t fs_alloc_block_near(fs_fs *fs, uint32_t goal) {
+    uint32_t got;
+    return fs_alloc_blocks(fs, goal, 1, &got);
+}
+
+uint32_t fs_alloc_block(fs_fs *fs) {
+    return fs_alloc_block_near(fs, BLK_INVALID);
+}
+
+// Group for a new directory: of the groups with at least the average
+// number of free inodes and blocks, the one with the fewest directories.
+// The search starts at the parent's group, which wins ties.
+uint32_t fs_dir_group(fs_fs *fs, uint32_t parent_group) {
+    uint32_t groups = fs->header->groups;
+    uint64_t free_inodes = fs->header->inodes_total - 1 - fs->header->inodes;
+    uint64_t free_blocks = fs->header->blocks_total - 1 - fs->header->blocks;
+    uint32_t best = parent_group;
+    uint32_t best_dirs = UINT32_MAX;
+    for (uint32_t i = 0; i < groups; i++) {
+        uint32_t g = (parent_group + i) % groups;
+        fs_group *group = fs_get_group(fs, g);
+        if (group == NULL) break;
+        uint32_t inodes = fs_group_inodes(fs, g) - group->inodes;
+        uint32_t blocks = fs_group_blocks(fs, g) - group->blocks;
+        bool roomy = (uint64_t)inodes * groups >= free_inodes && (uint64_t)blocks * groups >= free_blocks;
+        if (roomy && inodes > 0 && group->dirs < best_dirs) {
+            best = g;
+            best_dirs = group->dirs;
+        }
+        fs_put_group(fs, group, false);
+    }
+    return best;
+}
+
+// Takes a free inode for a file of the given mode created in parent_ino,
+// from the group picked by the policy above or the next one with a free
+// inode. Returns INO_INVALID if there is none.
+uint32_t fs_alloc_inode(fs_fs *fs, uint32_t parent_ino, uint16_t mode) {
+    MUTEX_LOCK(&fs->alloc_lock);
+    bool dir = mode & (S_IFDIR >> 3);
+    uint32_t groups = fs->header->groups;
+    uint32_t start = fs_ino_group(fs, parent_ino);
+    if (dir) start = fs_dir_group(fs, start);
+
+    uint32_t ino = INO_INVALID;
+    for (uint32_t i = 0; i < groups && ino == INO_INVALID; i++) {
+        fs_group *group = fs_get_group(fs, (start + i) % groups);
+        if (group == NULL) break;
+        fs_inode *inode = group->free_ino != INO_INVALID ? fs_get_inode(fs, group->free_ino) : NULL;
+        if (inode != NULL) {
+            ino = group->free_ino;
+            group->free_ino = inode->ino;
+            group->inodes++;
+            group->dirs += dir;
+            fs_put_inode(fs, inode, false);
+        }
+        fs_put_group(fs, group, inode != NULL);
+    }
+    if (ino != INO_INVALID) {
+        ATOMIC_ADD(&fs->header->inodes, 1);
+        FS_COUNT(fs, inodes_alloc, 1);
+    }
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return ino;
+}
+
+int32_t fs_free_block(fs_fs *fs, uint32_t blk) {
+    assert(blk != BLK_INVALID);
+    assert(blk < fs->header->blocks_total);
+
+    uint32_t bits = fs->header->block_size * 8;
+    MUTEX_LOCK(&fs->alloc_lock);
+    uint8_t *bitmap = fs_get_bitmap(fs, blk);
+    int32_t err = bitmap != NULL ? fs_freeze_bitmap(fs, blk, bitmap) : -EIO;
+    if (err == SUCCESS) {
+        assert(fs_bitmap_get(bitmap, blk % bits));
+        fs_bitmap_clear(bitmap, blk % bits);
+        if (fs->journal.capacity > 0) ATOMIC_ADD(&fs->journal.frozen_blocks, 1);
+        fs_group_count_blocks(fs, blk, -1);
+        ATOMIC_ADD(&fs->header->blocks, -1);
+        FS_COUNT(fs, blocks_freed, 1);
+        TRACE_BLOCK(TRACE_FREE, INO_INVALID, blk, 0);
+    }
+    if (bitmap != NULL) fs_bput(fs, bitmap, err == SUCCESS);
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return err;
+}
+
+// zeroes count data blocks starting at blk without reading them
+int32_t fs_zero_blocks(fs_fs *fs, uint32_t blk, uint32_t count, bool meta) {
+    if (fs->raw != NULL) {
+        _memset(fs_raw_block(fs, fs->data_start + blk), 0, (size_t)count * fs->block_size);
+        return SUCCESS;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        fs_block *block = fs_get_new_block(fs, blk + i, meta);
+        PIN(block);
+        fs_put_block(fs, block, true);
+    }
+    return SUCCESS;
+}
+
+// allocates and zeroes a block near goal for an empty slot if requested
+int32_t fs_bmap_step(fs_fs *fs, uint32_t *slot, bool alloc, uint32_t goal) {
+    if (*slot != BLK_INVALID) return *slot;
+    if (!alloc) return BLK_INVALID;
+
+    uint32_t blk = fs_alloc_block_near(fs, goal);
+    if (blk == BLK_INVALID) return -ENOSPC;
+    ERR(fs_zero_blocks(fs, blk, 1, true));
+    *slot = blk;
+    fs_bdirty(fs, slot);
+    return blk;
+}
+
+// fills up to count empty slots with one contiguous run near goal
+int32_t fs_bmap_fill(fs_fs *fs, uint32_t *slots, uint32_t count, uint32_t goal) {
+    uint32_t got;
+    uint32_t blk = fs_alloc_blocks(fs, goal, count, &got);
+    if (blk == BLK_INVALID) return -ENOSPC;
+
+    ERR(fs_zero_blocks(fs, blk, got, false));
+    for (uint32_t i = 0; i < got; i++) {
+        slots[i] = blk + i;
+    }
+    fs_bdirty(fs, slots);
+    return got;
+}
+
+// Finds the slot holding the pointer to logical block lblk in O(1).
+// Returns how many consecutive slots follow in the same pointer array,
+// or the length of the unmapped range with *slot = NULL if an indirect
+// block on the way is missing and alloc is not set. The block holding
+// the slot stays pinned until the caller releases it with fs_bput.
+int32_t fs_ino_bmap_slot(fs_fs *fs, uint32_t ino, uint32_t lblk, bool alloc, uint32_t **slot) {
+    *slot = NULL;
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    if (fs_inode_inline(inode)) {
+        fs_put_inode(fs, inode, false);
+        return -EINVAL;
+    }
+
+    if (lblk < FS_BLOCK_POINTERS) {
+        *slot = &inode->block[lblk];
+        return FS_BLOCK_POINTERS - lblk;
+    }
+
+    // the first tree that reaches lblk
+    uint32_t len = fs->header->blockp_len;
+    uint64_t rest = lblk - FS_BLOCK_POINTERS;
+    uint64_t cover = 1;
+    uint32_t *parent = NULL;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS && parent == NULL; level++) {
+        cover *= len;
+        if (rest < cover) parent = fs_inode_root(inode, level);
+        else rest -= cover;
+    }
+    if (parent == NULL) {
+        fs_put_inode(fs, inode, false);
+        return -EFBIG;
+    }
+
+    // descend one level of indirection per step
+    uint32_t index = 0;
+    while (cover > 1) {
+        int32_t blk = fs_bmap_step(fs, parent, alloc, fs_ino_home(fs, ino));
+        fs_bput(fs, parent, false);
+        if (blk < 0) return blk;
+        if (blk == BLK_INVALID) return MIN(cover - rest, INT32_MAX);
+
+        uint32_t *pblock = (uint32_t *)fs_get_block(fs, blk);
+        PIN(pblock);
+        cover /= len;
+        index = rest / cover;
+        parent = &pblock[index];
+        rest %= cover;
+    }
+
+    *slot = parent;
+    return len - index;
+}
+
+// logical to physical block, BLK_INVALID if unmapped
+int32_t fs_ino_bmap(fs_fs *fs, uint32_t ino, uint32_t lblk, bool alloc) {
+    uint32_t *slot;
+    int32_t avail = fs_ino_bmap_slot(fs, ino, lblk, alloc, &slot);
+    if (avail < 0) return avail;
+    if (slot == NULL) return BLK_INVALID;
+    int32_t blk = fs_bmap_step(fs, slot, alloc, fs_ino_home(fs, ino));
+    fs_bput(fs, slot, false);
+    return blk;
+}
+
+// where to look for a new block for lblk so that the file stays contiguous,
+// right after the previous block or else in the group of the inode
+uint32_t fs_ino_goal(fs_fs *fs, uint32_t ino, uint32_t lblk) {
+    if (lblk > 0) {
+        int32_t prev = fs_ino_bmap(fs, ino, lblk - 1, false);
+        if (prev > 0) return prev + 1;
+    }
+    return fs_ino_home(fs, ino);
+}
+
+// Maps up to max logical blocks starting at lblk to one physically
+// contiguous run. Returns the first physical block and stores the run
+// length in *count, or BLK_INVALID with the length of the unmapped range.
+// With alloc set, missing blocks are allocated as runs following the
+// previous block.
+int32_t fs_ino_bmap_run(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t max, bool alloc, uint32_t *count) {
+    uint32_t *slot;
+    int32_t avail = fs_ino_bmap_slot(fs, ino, lblk, alloc, &slot);
+    if (avail < 0) return avail;
+    max = MIN(max, (uint32_t)avail);
+
+    if (slot == NULL || (*slot == BLK_INVALID && !alloc)) {
+        uint32_t n = 1;
+        while (slot != NULL && n < max && slot[n] == BLK_INVALID) n++;
+        *count = slot == NULL ? max : n;
+        if (slot != NULL) fs_bput(fs, slot, false);
+        return BLK_INVALID;
+    }
+
+    uint32_t n = 0;
+    while (n < max) {
+        if (slot[n] == BLK_INVALID) {
+            if (!alloc) break;
+            uint32_t goal = n > 0 ? slot[n - 1] + 1u : fs_ino_goal(fs, ino, lblk);
+            uint32_t k = 1;
+            while (n + k < max && slot[n + k] == BLK_INVALID) k++;
+
+            int32_t err = fs_bmap_fill(fs, &slot[n], k, goal);
+            if (err < 0) {
+                if (n > 0) break;
+                fs_bput(fs, slot, false);
+                return err;
+            }
+        }
+        if (n > 0 && slot[n] != slot[0] + n) break;
+        n++;
+    }
+    *count = n;
+    int32_t first = slot[0];
+    fs_bput(fs, slot, false);
+    TRACE_BLOCK(TRACE_BMAP, ino, lblk, (uint64_t)first << 32 | n);
+    return first;
+}
+
+// Extra references to data blocks shared by clones, one uint32_t per
+// block in a sparse table file created by the first clone. Blocks that
+// were never shared fall into holes of the table and count 0. Pins the
+// count of blk, NULL if it is a hole and alloc is not set.
+uint32_t *fs_refcount_ptr(fs_fs *fs, uint32_t blk, bool alloc) {
+    uint32_t ino = fs->header->refcount_ino;
+    if (ino == INO_INVALID) return NULL;
+    uint32_t per_block = fs->header->blockp_len;
+    int32_t tblk = fs_ino_bmap(fs, ino, blk / per_block, alloc);
+    if (tblk <= 0) return NULL;
+    uint32_t *counts = (uint32_t *)fs_get_block(fs, tblk);
+    if (counts == NULL) return NULL;
+    return counts + blk % per_block;
+}
+
+uint32_t fs_refcount_get(fs_fs *fs, uint32_t blk) {
+    if (ATOMIC_LOAD(&fs->header->blocks_shared) == 0) return 0;
+    MUTEX_LOCK(&fs->ref_lock);
+    uint32_t *count = fs_refcount_ptr(fs, blk, false);
+    uint32_t refs = count != NULL ? *count : 0;
+    if (count != NULL) fs_put_block(fs, count, false);
+    MUTEX_UNLOCK(&fs->ref_lock);
+    return refs;
+}
+
+// adds a reference to blk, the table has to exist
+int32_t fs_refcount_inc(fs_fs *fs, uint32_t blk) {
+    MUTEX_LOCK(&fs->ref_lock);
+    uint32_t *count = fs_refcount_ptr(fs, blk, true);
+    if (count != NULL) {
+        if ((*count)++ == 0) ATOMIC_ADD(&fs->header->blocks_shared, 1);
+        fs_put_block(fs, count, true);
+    }
+    MUTEX_UNLOCK(&fs->ref_lock);
+    return count != NULL ? SUCCESS : -ENOSPC;
+}
+
+// drops a reference to data block blk, which is freed with the last one
+int32_t fs_unref_block(fs_fs *fs, uint32_t blk) {
+    if (ATOMIC_LOAD(&fs->header->blocks_shared) > 0) {
+        MUTEX_LOCK(&fs->ref_lock);
+        uint32_t *count = fs_refcount_ptr(fs, blk, false);
+        bool shared = count != NULL && *count > 0;
+        if (shared && --(*count) == 0) ATOMIC_ADD(&fs->header->blocks_shared, -1);
+        if (count != NULL) fs_put_block(fs, count, shared);
+        MUTEX_UNLOCK(&fs->ref_lock);
+        if (shared) return SUCCESS;
+    }
+    return fs_free_block(fs, blk);
+}
+
+// frees every block below *slot whose relative logical index is >= from
+int32_t fs_free_tree(fs_fs *fs, uint32_t *slot, uint32_t from, uint32_t depth) {
+    if (*slot == BLK_INVALID) return SUCCESS;
+
+    if (depth > 0) {
+        uint32_t len = fs->header->blockp_len;
+        uint32_t span = 1;
+        for (uint32_t d = 1; d < depth; d++) span *= len;
+
+        uint32_t *pblock = (uint32_t *)fs_get_block(fs, *slot);
+        PIN(pblock);
+        for (uint32_t j = from / span; j < len; j++) {
+            uint32_t sub = (j == from / span) ? from % span : 0;
+            int32_t err = fs_free_tree(fs, &pblock[j], sub, depth - 1);
+            if (err < 0) {
+                fs_put_block(fs, pblock, true);
+                return err;
+            }
+        }
+        fs_put_block(fs, pblock, from != 0);
+    }
+
+    if (from == 0) {
+        ERR(depth > 0 ? fs_free_block(fs, *slot) : fs_unref_block(fs, *slot));
+        *slot = BLK_INVALID;
+    }
+    return SUCCESS;
+}
+
+// frees all data and indirect blocks from logical block lblk onwards
+int32_t fs_ino_free_blocks(fs_fs *fs, uint32_t ino, uint32_t lblk) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    if (fs_inode_inline(inode)) {
+        fs_put_inode(fs, inode, false);
+        return SUCCESS;
+    }
+    uint32_t len = fs->header->blockp_len;
+    int32_t err = SUCCESS;
+
+    for (uint32_t i = lblk; i < FS_BLOCK_POINTERS && err == SUCCESS; i++) {
+        err = fs_free_tree(fs, &inode->block[i], 0, 0);
+    }
+
+    uint64_t base = FS_BLOCK_POINTERS;
+    uint64_t span = 1;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS && err == SUCCESS; level++) {
+        span *= len;
+        uint32_t *root = fs_inode_root(inode, level);
+        if (lblk < base + span) err = fs_free_tree(fs, root, lblk > base ? lblk - base : 0, level + 1);
+        base += span;
+    }
+
+    fs_put_inode(fs, inode, true);
+    return err;
+}
+
+// copies n bytes from or to the run of data blocks at blk, skip bytes in
+int32_t fs_copy_blocks(fs_fs *fs, uint32_t blk, uint32_t skip, void *buffer, size_t n, bool write) {
+    TRACE_BLOCK(TRACE_COPY, INO_INVALID, blk, (uint64_t)n << 1 | write);
+    if (fs->raw != NULL) {
+        uint8_t *data = fs_raw_block(fs, fs->data_start + blk)->bytes + skip;
+        if (write) _memcpy(data, buffer, n);
+        else _memcpy(buffer, data, n);
+        return SUCCESS;
+    }
+
+    uint32_t block_size = fs->header->block_size;
+    while (n > 0) {
+        // Whole blocks that are not cached are read straight into the
+        // buffer, one request for the run. The caller holds the inode,
+        // so nothing loads or writes them meanwhile.
+        uint32_t run = 0;
+        if (!write && skip == 0 && n >= block_size && fs->dev->read_blocks != NULL) {
+            run = fs_bcache_uncached(fs, fs->data_start + blk, n / block_size);
+        }
+        if (run > 0) {
+            ERR(fs->dev->read_blocks(fs->dev->ctx, fs->data_start + blk, run, buffer, block_size));
+            buffer = (uint8_t *)buffer + (size_t)run * block_size;
+            n -= (size_t)run * block_size;
+            blk += run;
+            continue;
+        }
+
+        size_t chunk = MIN(n, block_size - skip);
+        fs_block *block = fs_get_data_block(fs, blk);
+        PIN(block);
+        if (write) _memcpy(block->bytes + skip, buffer, chunk);
+        else _memcpy(buffer, block->bytes + skip, chunk);
+        fs_put_block(fs, block, write);
+
+        buffer = (uint8_t *)buffer + chunk;
+        n -= chunk;
+        skip = 0;
+        blk++;
+    }
+    return SUCCESS;
+}
+
+int32_t fs_ino_pread(fs_fs *fs, uint32_t ino, void *buffer, size_t size, size_t offset);
+
+// moves inline contents out to a data block
+int32_t fs_ino_uninline(fs_fs *fs, uint32_t ino) {
+    // an empty file is left without blocks
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    if (inode->size == 0) {
+        inode->mode &= ~FS_MODE_INLINE;
+        fs_put_inode(fs, inode, true);
+        return SUCCESS;
+    }
+    fs_put_inode(fs, inode, false);
+
+    uint32_t blk = fs_alloc_block_near(fs, fs_ino_home(fs, ino));
+    if (blk == BLK_INVALID) return -ENOSPC;
+    fs_block *block = fs_get_new_block(fs, blk, false);
+    if (block == NULL) {
+        fs_free_block(fs, blk);
+        return -EIO;
+    }
+
+    inode = fs_get_inode(fs, ino);
+    if (inode == NULL) {
+        fs_put_block(fs, block, false);
+        fs_free_block(fs, blk);
+        return -EIO;
+    }
+    _memset(block->bytes, 0, fs->header->block_size);
+    _memcpy(block->bytes, fs_inline_data(inode), FS_INLINE_MAX);
+    fs_put_block(fs, block, true);
+
+    _memset(fs_inline_data(inode), 0, FS_INLINE_MAX);
+    inode->block[0] = blk;
+    inode->mode &= ~FS_MODE_INLINE;
+    fs_put_inode(fs, inode, true);
+    return SUCCESS;
+}
+
+// frees the blocks of a file that shrinks to fit inline
+int32_t fs_ino_inline(fs_fs *fs, uint32_t ino, size_t size) {
+    uint8_t data[FS_INLINE_MAX] = { 0 };
+    int32_t n = fs_ino_pread(fs, ino, data, size, 0);
+    if (n < 0) return n;
+    ERR(fs_ino_free_blocks(fs, ino, 0));
+    fs_ccache_invalidate(fs, ino, 0, UINT32_MAX);
+
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    _memcpy(fs_inline_data(inode), data, FS_INLINE_MAX);
+    inode->mode |= FS_MODE_INLINE;
+    inode->size = size;
+    fs_put_inode(fs, inode, true);
+    return SUCCESS;
+}
+
+// replaces the shared data block in *slot by a private copy
+int32_t fs_unshare_block(fs_fs *fs, uint32_t *slot) {
+    uint32_t blk = *slot;
+    uint32_t copy = fs_alloc_block_near(fs, blk);
+    if (copy == BLK_INVALID) return -ENOSPC;
+    fs_block *from = fs_get_data_block(fs, blk);
+    fs_block *to = from != NULL ? fs_get_new_block(fs, copy, false) : NULL;
+    if (to == NULL) {
+        if (from != NULL) fs_put_block(fs, from, false);
+        fs_free_block(fs, copy);
+        return -EIO;
+    }
+    _memcpy(to, from, fs->header->block_size);
+    fs_put_block(fs, to, true);
+    fs_put_block(fs, from, false);
+
+    *slot = copy;
+    fs_bdirty(fs, slot);
+    return fs_unref_block(fs, blk);
+}
+
+// gives logical blocks [lblk, end) of a file private copies of the blocks
+// it shares with clones before they are written
+int32_t fs_ino_unshare(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t end) {
+    while (lblk < end && ATOMIC_LOAD(&fs->header->blocks_shared) > 0) {
+        uint32_t *slot;
+        int32_t avail = fs_ino_bmap_slot(fs, ino, lblk, false, &slot);
+        if (avail < 0) return avail;
+        uint32_t n = MIN((uint32_t)avail, end - lblk);
+
+        int32_t err = SUCCESS;
+        for (uint32_t i = 0; slot != NULL && i < n && err == SUCCESS; i++) {
+            if (slot[i] != BLK_INVALID && fs_refcount_get(fs, slot[i]) > 0) err = fs_unshare_block(fs, &slot[i]);
+        }
+        if (slot != NULL) fs_bput(fs, slot, false);
+        ERR(err);
+        lblk += n;
+    }
+    return SUCCESS;
+}
+
+// copies count blocks listed in blks from or to buffer, holes read as zeros
+int32_t fs_copy_list(fs_fs *fs, const uint32_t *blks, uint32_t count, uint8_t *buffer, bool write) {
+    uint32_t block_size = fs->header->block_size;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && blks[i] != BLK_INVALID && blks[i + run] == blks[i] + run) run++;
+        size_t n = (size_t)run * block_size;
+        if (blks[i] != BLK_INVALID) {
+            ERR(fs_copy_blocks(fs, blks[i], 0, buffer, n, write));
+        }
+        else if (!write) _memset(buffer, 0, n);
+        buffer += n;
+        i += run;
+    }
+    return SUCCESS;
+}
+
+// reads bytes of a file block by block, the caller clamps them to EOF
+int32_t fs_ino_read_blocks(fs_fs *fs, uint32_t ino, uint8_t *buffer, size_t size, size_t offset) {
+    uint32_t block_size = fs->header->block_size;
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t skip = pos % block_size;
+        uint32_t want = DIV_CEIL(skip + size - done, block_size);
+
+        uint32_t count;
+        int32_t blk = fs_ino_bmap_run(fs, ino, pos / block_size, want, false, &count);
+        if (blk < 0) return blk;
+
+        size_t n = MIN(count * block_size - skip, size - done);
+        if (blk == BLK_INVALID) _memset(buffer + done, 0, n);
+        else ERR(fs_copy_blocks(fs, blk, skip, buffer + done, n, false));
+        done += n;
+    }
+    return done;
+}
+
+// Writes bytes below EOF block by block, copying shared blocks first. A
+// long write stops short once the journal runs out of room.
+int32_t fs_ino_write_blocks(fs_fs *fs, uint32_t ino, const uint8_t *buffer, size_t size, size_t offset) {
+    uint32_t block_size = fs->header->block_size;
+    size_t done = 0;
+    while (done < size) {
+        if (done > 0 && !fs_journal_room(fs, FS_JOURNAL_STEP)) break;
+        size_t pos = offset + done;
+        uint32_t skip = pos % block_size;
+        uint32_t want = DIV_CEIL(skip + size - done, block_size);
+        if (ATOMIC_LOAD(&fs->header->blocks_shared) > 0) {
+            want = MIN(want, FS_FREE_CHUNK);
+            int32_t err = fs_ino_unshare(fs, ino, pos / block_size, pos / block_size + want);
+            if (err < 0) return done > 0 ? (int32_t)done : err;
+        }
+
+        uint32_t count;
+        int32_t blk = fs_ino_bmap_run(fs, ino, pos / block_size, want, true, &count);
+        if (blk < 0) return done > 0 ? (int32_t)done : blk;
+
+        size_t n = MIN(count * block_size - skip, size - done);
+        ERR(fs_copy_blocks(fs, blk, skip, (uint8_t *)buffer + done, n, true));
+        done += n;
+    }
+    return done;
+}
+
+// Looks up the blocks of cluster c in blks. Returns 1 if they hold it
+// compressed, see fs_cluster.
+int32_t fs_cluster_map(fs_fs *fs, uint32_t ino, uint32_t c, uint32_t *blks) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    uint64_t file_size = inode->size;
+    fs_put_inode(fs, inode, false);
+
+    uint32_t n = fs_cluster_blocks(fs);
+    uint32_t lblk = c * n;
+    for (uint32_t i = 0; i < n;) {
+        uint32_t *slot;
+        int32_t avail = fs_ino_bmap_slot(fs, ino, lblk + i, false, &slot);
+        if (avail < 0) return avail;
+        uint32_t k = MIN((uint32_t)avail, n - i);
+        for (uint32_t j = 0; j < k; j++) {
+            blks[i + j] = slot != NULL ? slot[j] : BLK_INVALID;
+        }
+        if (slot != NULL) fs_bput(fs, slot, false);
+        i += k;
+    }
+    bool whole = (uint64_t)(c + 1) * fs_cluster_size(fs) <= file_size;
+    return whole && blks[0] != BLK_INVALID && blks[n - 1] == BLK_INVALID;
+}
+
+// decompresses the cluster c held by blks into data
+int32_t fs_cluster_unpack(fs_fs *fs, uint32_t ino, uint32_t c, const uint32_t *blks, uint8_t *data) {
+    if (fs_ccache_lookup(fs, ino, c, data)) return SUCCESS;
+
+    uint32_t block_size = fs->header->block_size;
+    size_t size = fs_cluster_size(fs);
+    uint32_t count = 0;
+    while (blks[count] != BLK_INVALID) count++;
+    uint8_t *packed = (uint8_t *)malloc((size_t)count * block_size);
+    if (packed == NULL) return -ENOMEM;
+
+    int32_t err = fs_copy_list(fs, blks, count, packed, false);
+    fs_cluster *header = (fs_cluster *)packed;
+    if (err == SUCCESS && (header->magic != FS_CLUSTER_MAGIC
+        || header->size > (size_t)count * block_size - sizeof(fs_cluster)
+        || lz_decompress(packed + sizeof(fs_cluster), header->size, data, size) != (int64_t)size)) err = -EIO;
+    free(packed);
+    if (err == SUCCESS) fs_ccache_insert(fs, ino, c, data);
+    return err;
+}
+
+// reads cluster c of a compressed file, fs_cluster_size bytes
+int32_t fs_cluster_load(fs_fs *fs, uint32_t ino, uint32_t c, uint8_t *data) {
+    uint32_t blks[FS_CLUSTER_BLOCKS_MAX];
+    int32_t packed = fs_cluster_map(fs, ino, c, blks);
+    if (packed < 0) return packed;
+    if (packed) return fs_cluster_unpack(fs, ino, c, blks, data);
+    return fs_copy_list(fs, blks, fs_cluster_blocks(fs), data, false);
+}
+
+// Points the slots of cluster c at blks and releases the blocks they held.
+int32_t fs_cluster_replace(fs_fs *fs, uint32_t ino, uint32_t c, const uint32_t *blks) {
+    uint32_t n = fs_cluster_blocks(fs);
+    uint32_t old[FS_CLUSTER_BLOCKS_MAX] = { 0 };
+    for (uint32_t i = 0; i < n;) {
+        uint32_t *slot;
+        int32_t avail = fs_ino_bmap_slot(fs, ino, c * n + i, blks[i] != BLK_INVALID, &slot);
+        if (avail < 0) return avail;
+        uint32_t k = MIN((uint32_t)avail, n - i);
+        for (uint32_t j = 0; slot != NULL && j < k; j++) {
+            old[i + j] = slot[j];
+            slot[j] = blks[i + j];
+        }
+        if (slot != NULL) fs_bput(fs, slot, true);
+        i += k;
+    }
+
+    int32_t err = SUCCESS;
+    for (uint32_t i = 0; i < n; i++) {
+        if (old[i] != BLK_INVALID && fs_unref_block(fs, old[i]) < 0) err = -EIO;
+    }
+    return err;
+}
+
+// Writes the first len bytes of cluster c from data, which is zero past
+// them. A whole cluster is compressed if that saves a block, and left a
+// hole if it is all zeros. The blocks are new and the old ones released
+// after, so that a crash keeps one of both and clones keep theirs.
+int32_t fs_cluster_store(fs_fs *fs, uint32_t ino, uint32_t c, const uint8_t *data, size_t len) {
+    uint32_t block_size = fs->header->block_size;
+    uint32_t n = fs_cluster_blocks(fs);
+    size_t size = fs_cluster_size(fs);
+    fs_ccache_invalidate(fs, ino, c, c + 1);
+
+    size_t used = len;
+    while (used > 0 && data[used - 1] == 0) used--;
+    uint32_t count = DIV_CEIL(used, block_size);
+    uint8_t *packed = NULL;
+    if (len == size && count > 0) {
+        packed = (uint8_t *)calloc(n - 1, block_size);
+        if (packed == NULL) return -ENOMEM;
+        size_t cap = (size_t)(n - 1) * block_size - sizeof(fs_cluster);
+        size_t packed_size = lz_compress(data, size, packed + sizeof(fs_cluster), cap);
+        if (packed_size > 0) {
+            *(fs_cluster *)packed = (fs_cluster){ FS_CLUSTER_MAGIC, 0, packed_size };
+            count = DIV_CEIL(sizeof(fs_cluster) + packed_size, block_size);
+        }
+        else {
+            free(packed);
+            packed = NULL;
+        }
+    }
+    // whole clusters stored as is are written without holes
+    bool compressed = packed != NULL;
+    if (!compressed && len == size && count > 0) count = n;
+
+    uint32_t blks[FS_CLUSTER_BLOCKS_MAX] = { 0 };
+    uint32_t goal = fs_ino_goal(fs, ino, c * n);
+    uint32_t done = 0;
+    int32_t err = SUCCESS;
+    while (done < count && err == SUCCESS) {
+        uint32_t run;
+        uint32_t blk = fs_alloc_blocks(fs, goal, count - done, &run);
+        if (blk == BLK_INVALID) {
+            err = -ENOSPC;
+            break;
+        }
+        for (uint32_t i = 0; i < run; i++) {
+            blks[done + i] = blk + i;
+        }
+        err = fs_zero_blocks(fs, blk, run, false);
+        goal = blk + run;
+        done += run;
+    }
+    if (err == SUCCESS) err = fs_copy_list(fs, blks, count, compressed ? packed : (uint8_t *)data, true);
+    free(packed);
+    if (err < 0) {
+        for (uint32_t i = 0; i < done; i++) {
+            fs_free_block(fs, blks[i]);
+        }
+        return err;
+    }
+
+    ERR(fs_cluster_replace(fs, ino, c, blks));
+    if (compressed) fs_ccache_insert(fs, ino, c, data);
+    return SUCCESS;
+}
+
+// stores the cluster a compressed file is cut in as is, before the cut
+int32_t fs_cluster_cut(fs_fs *fs, uint32_t ino, size_t size) {
+    size_t cluster_size = fs_cluster_size(fs);
+    size_t len = size % cluster_size;
+    if (len == 0) return SUCCESS;
+
+    uint32_t blks[FS_CLUSTER_BLOCKS_MAX];
+    int32_t packed = fs_cluster_map(fs, ino, size / cluster_size, blks);
+    if (packed <= 0) return packed;
+    uint8_t *data = (uint8_t *)malloc(cluster_size);
+    if (data == NULL) return -ENOMEM;
+    int32_t err = fs_cluster_unpack(fs, ino, size / cluster_size, blks, data);
+    _memset(data + len, 0, cluster_size - len);
+    if (err == SUCCESS) err = fs_cluster_store(fs, ino, size / cluster_size, data, len);
+    free(data);
+    return err;
+}
+
+// stores the last cluster of a compressed file whole once the file grows
+// past it, before the size changes
+int32_t fs_cluster_seal(fs_fs *fs, uint32_t ino, size_t old_size, size_t size) {
+    size_t cluster_size = fs_cluster_size(fs);
+    uint32_t c = old_size / cluster_size;
+    if (old_size % cluster_size == 0 || (uint64_t)(c + 1) * cluster_size > size) return SUCCESS;
+
+    uint8_t *data = (uint8_t *)malloc(cluster_size);
+    if (data == NULL) return -ENOMEM;
+    int32_t err = fs_cluster_load(fs, ino, c, data);
+    if (err == SUCCESS) err = fs_cluster_store(fs, ino, c, data, cluster_size);
+    free(data);
+    return err;
+}
+
+int32_t fs_ino_free_tail(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t max);
+int32_t fs_ino_detach(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t min);
+
+// Shrinking frees blocks from the end while the journal has room and
+// moves the rest to an orphan, see fs_ino_detach. If no inode is free for
+// it, the file is left at the size reached and -ENOSPC is returned.
+int32_t fs_ino_truncate(fs_fs *fs, uint32_t ino, size_t size) {
+    FS_STAT(fs, FS_OP_TRUNCATE);
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    size_t old_size = inode->size;
+    TRACE_OP(TRACE_TRUNCATE, ino, old_size, size);
+    bool is_inline = fs_inode_inline(inode);
+    bool compressed = fs_inode_compressed(inode);
+
+    // bytes past the end of inline contents are always zero
+    if (is_inline && size <= FS_INLINE_MAX) {
+        if (size < old_size) _memset(fs_inline_data(inode) + size, 0, old_size - size);
+        inode->size = size;
+        fs_put_inode(fs, inode, true);
+        return SUCCESS;
+    }
+    bool shrink_inline = !is_inline && size < old_size && size <= FS_INLINE_MAX
+        && fs_inode_inlinable(fs, inode);
+    fs_put_inode(fs, inode, false);
+
+    if (shrink_inline) return fs_ino_inline(fs, ino, size);
+    if (is_inline) ERR(fs_ino_uninline(fs, ino));
+
+    uint32_t block_size = fs->header->block_size;
+    if (DIV_CEIL(size, block_size) > UINT32_MAX) return -EFBIG;
+    uint32_t old_blocks = DIV_CEIL(old_size, block_size);
+    uint32_t new_blocks = DIV_CEIL(size, block_size);
+
+    if (size < old_size) {
+        fs_ccache_invalidate(fs, ino, size / fs_cluster_size(fs), UINT32_MAX);
+        if (compressed) ERR(fs_cluster_cut(fs, ino, size));
+        int32_t left = fs_ino_free_tail(fs, ino, new_blocks, UINT32_MAX);
+        if (left < 0) return left;
+        if (left > 0) {
+            // out of journal room, the rest goes to an orphan
+            ERR(fs_ino_detach(fs, ino, new_blocks, 0));
+            ERR(fs_ino_free_blocks(fs, ino, new_blocks));
+        }
+    }
+    else {
+        // Zero the stale tail of the old last block when growing. The new
+        // range is a hole until it is written.
+        uint32_t tail = old_size % block_size;
+        if (tail != 0) {
+            ERR(fs_ino_unshare(fs, ino, old_blocks - 1, old_blocks));
+            int32_t blk = fs_ino_bmap(fs, ino, old_blocks - 1, false);
+            if (blk > 0) {
+                fs_block *block = fs_get_data_block(fs, blk);
+                PIN(block);
+                _memset(block->bytes + tail, 0, block_size - tail);
+                fs_put_block(fs, block, true);
+            }
+        }
+        if (compressed) ERR(fs_cluster_seal(fs, ino, old_size, size));
+    }
+
+    inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    inode->size = size;
+    fs_put_inode(fs, inode, true);
+    return SUCCESS;
+}
+
+// allocates the holes among logical blocks [lblk, end) of a file
+int32_t fs_ino_allocate(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t end) {
+    while (lblk < end) {
+        uint32_t count;
+        int32_t blk = fs_ino_bmap_run(fs, ino, lblk, end - lblk, true, &count);
+        if (blk < 0) return blk;
+        lblk += count;
+    }
+    return SUCCESS;
+}
+
+void fs_free_inode(fs_fs *fs, uint32_t ino) {
+    bool dir = fs_ino_isdir(fs, ino);
+    if (dir) fs_dcache_invalidate_dir(fs, ino);
+    fs_ino_truncate(fs, ino, 0);
+    fs_ccache_invalidate(fs, ino, 0, UINT32_MAX);
+
+    MUTEX_LOCK(&fs->alloc_lock);
+    fs_group *group = fs_get_group(fs, fs_ino_group(fs, ino));
+    fs_inode *inode = group != NULL ? fs_get_inode(fs, ino) : NULL;
+    if (inode != NULL) {
+        inode->ino = group->free_ino;
+        fs_put_inode(fs, inode, true);
+        group->free_ino = ino;
+        group->inodes--;
+        group->dirs -= dir;
+        ATOMIC_ADD(&fs->header->inodes, -1);
+        FS_COUNT(fs, inodes_freed, 1);
+    }
+    if (group != NULL) fs_put_group(fs, group, inode != NULL);
+    MUTEX_UNLOCK(&fs->alloc_lock);
+}
+
+// Orphans are inodes without links whose blocks are freed in the
+// background. They stay in use and are chained through inode->time from
+// header->orphan_ino, so that a crash leaves them to the next mount.
+// Those a frontend still has open are passed over until fs_release_orphan.
+static inline bool fs_ino_busy(fs_fs *fs, uint32_t ino) {
+    return fs->busy != NULL && fs->busy(fs, ino);
+}
+
+static inline bool fs_inode_large(fs_fs *fs, fs_inode *inode) {
+    if (fs_inode_inline(inode)) return false;
+    return DIV_CEIL(inode->size, fs->header->block_size) > FS_RECLAIM_BATCH;
+}
+
+int32_t fs_orphan_add(fs_fs *fs, uint32_t ino) {
+    MUTEX_LOCK(&fs->alloc_lock);
+    fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode != NULL) {
+        inode->time = fs->header->orphan_ino;
+        fs_put_inode(fs, inode, true);
+        fs->header->orphan_ino = ino;
+    }
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return inode != NULL ? SUCCESS : -EIO;
+}
+
+// unlinks ino from the orphan list, usually its head
+int32_t fs_orphan_remove(fs_fs *fs, uint32_t ino) {
+    MUTEX_LOCK(&fs->alloc_lock);
+    uint32_t prev = INO_INVALID;
+    uint32_t cur = fs->header->orphan_ino;
+    uint32_t next = INO_INVALID;
+    for (uint32_t n = 0; n < fs->header->inodes_total && cur != INO_INVALID; n++) {
+        fs_inode *inode = fs_get_inode(fs, cur);
+        if (inode == NULL) break;
+        next = inode->time;
+        fs_put_inode(fs, inode, false);
+        if (cur == ino) break;
+        prev = cur;
+        cur = next;
+    }
+
+    int32_t err = cur == ino ? SUCCESS : -EIO;
+    if (err == SUCCESS && prev == INO_INVALID) fs->header->orphan_ino = next;
+    else if (err == SUCCESS) {
+        fs_inode *inode = fs_get_inode(fs, prev);
+        if (inode != NULL) {
+            inode->time = next;
+            fs_put_inode(fs, inode, true);
+        }
+        else err = -EIO;
+    }
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return err;
+}
+
+// the first orphan that is not open, INO_INVALID without one
+uint32_t fs_orphan_first(fs_fs *fs) {
+    MUTEX_LOCK(&fs->alloc_lock);
+    uint32_t ino = fs->header->orphan_ino;
+    for (uint32_t n = 0; n < fs->header->inodes_total && ino != INO_INVALID && fs_ino_busy(fs, ino); n++) {
+        fs_inode *inode = fs_get_inode(fs, ino);
+        if (inode == NULL) {
+            ino = INO_INVALID;
+            break;
+        }
+        uint32_t next = inode->time;
+        fs_put_inode(fs, inode, false);
+        ino = next;
+    }
+    MUTEX_UNLOCK(&fs->alloc_lock);
+    return ino;
+}
+
+// Frees up to max blocks of ino from logical block lblk onwards, starting
+// at the end and stopping when the journal runs out of room. The size is
+// lowered past each chunk freed, so that a crash leaves a shorter file.
+// Returns 1 while blocks past lblk remain.
+int32_t fs_ino_free_tail(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t max) {
+    uint32_t block_size = fs->header->block_size;
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    bool is_inline = fs_inode_inline(inode);
+    // chunks of compressed files are whole clusters
+    uint32_t n = fs_inode_compressed(inode) ? fs_cluster_blocks(fs) : FS_FREE_CHUNK;
+    uint64_t end = DIV_CEIL(inode->size, block_size);
+    fs_put_inode(fs, inode, false);
+    if (is_inline) return 0;
+
+    uint32_t freed = 0;
+    while (end > lblk) {
+        if (freed >= max || !fs_journal_room(fs, FS_JOURNAL_STEP)) return 1;
+        uint64_t cut = MAX((end - 1) / n * n, lblk);
+        ERR(fs_ino_free_blocks(fs, ino, cut));
+        inode = fs_get_inode(fs, ino);
+        PIN(inode);
+        inode->size = MIN(inode->size, cut * block_size);
+        fs_put_inode(fs, inode, true);
+        freed += end - cut;
+        end = cut;
+    }
+    return 0;
+}
+
+// frees an inode that lost its last link, open ones, large ones and those
+// the journal has no room for are left to the reclaimer
+int32_t fs_release_inode(fs_fs *fs, uint32_t ino) {
+    if (fs_ino_busy(fs, ino)) return fs_orphan_add(fs, ino);
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    bool large = fs_inode_large(fs, inode);
+    fs_put_inode(fs, inode, false);
+
+    int32_t left = large ? 1 : fs_ino_free_tail(fs, ino, 0, UINT32_MAX);
+    if (left < 0) return left;
+    if (left == 0) {
+        fs_free_inode(fs, ino);
+        return SUCCESS;
+    }
+    if (fs_ino_isdir(fs, ino)) fs_dcache_invalidate_dir(fs, ino);
+    return fs_orphan_add(fs, ino);
+}
+
+// Frees up to FS_RECLAIM_BATCH blocks from the end of an orphan, and the
+// inode itself once none are left. Returns 1 while orphans remain.
+int32_t fs_reclaim(fs_fs *fs, uint32_t ino) {
+    if (ino == INO_INVALID || ino > fs->header->max_ino) return -EIO;
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    bool orphan = inode->ino == ino && inode->refs == 0;
+    fs_put_inode(fs, inode, false);
+    if (!orphan) return -EIO;
+
+    int32_t left = fs_ino_free_tail(fs, ino, 0, FS_RECLAIM_BATCH);
+    if (left != 0) return left;
+
+    ERR(fs_orphan_remove(fs, ino));
+    fs_free_inode(fs, ino);
+    return fs_orphan_first(fs) != INO_INVALID;
+}
+
+// frees an orphan that was kept while open, unless the reclaimer has
+// already taken it since it was closed
+int32_t fs_release_orphan(fs_fs *fs, uint32_t ino) {
+    if (fs_orphan_remove(fs, ino) < 0) return SUCCESS;
+    return fs_release_inode(fs, ino);
+}
+
+// reclaims every orphan, committing the journal in between
+int32_t fs_reclaim_all(fs_fs *fs) {
+    uint32_t ino;
+    while ((ino = fs_orphan_first(fs)) != INO_INVALID) {
+        ERR(fs_journal_begin(fs));
+        int32_t left = fs_reclaim(fs, ino);
+        fs_journal_end(fs);
+        ERR(left);
+        ERR(fs_journal_tick(fs));
+    }
+    return SUCCESS;
+}
+
+// Moves the subtrees below the indirect block in *src that lie wholly at
+// or past relative block from into a new indirect block in *dst, and
+// descends into the subtree that from falls into.
+int32_t fs_split_tree(fs_fs *fs, uint32_t *src, uint32_t *dst, uint32_t from, uint32_t depth) {
+    if (*src == BLK_INVALID || depth == 0) return SUCCESS;
+    uint32_t len = fs->header->blockp_len;
+    uint32_t span = 1;
+    for (uint32_t d = 1; d < depth; d++) span *= len;
+
+    int32_t blk = fs_bmap_step(fs, dst, true, BLK_INVALID);
+    if (blk < 0) return blk;
+    uint32_t *from_block = (uint32_t *)fs_get_block(fs, *src);
+    PIN(from_block);
+    uint32_t *to_block = (uint32_t *)fs_get_block(fs, blk);
+    if (to_block == NULL) {
+        fs_put_block(fs, from_block, false);
+        return -EIO;
+    }
+
+    uint32_t j = from / span;
+    for (uint32_t k = from % span ? j + 1 : j; k < len; k++) {
+        to_block[k] = from_block[k];
+        from_block[k] = BLK_INVALID;
+    }
+    int32_t err = from % span ? fs_split_tree(fs, &from_block[j], &to_block[j], from % span, depth - 1) : SUCCESS;
+    fs_put_block(fs, to_block, true);
+    fs_put_block(fs, from_block, true);
+    return err;
+}
+
+int32_t fs_init_inode(fs_fs *fs, uint32_t ino, uint16_t mode);
+
+// Moves the blocks of a file from logical block lblk onwards to a new
+// orphan if there are more than min of them, leaving at most part of a
+// cluster to be freed by the truncate that follows. Returns -ENOSPC if no
+// inode is free.
+int32_t fs_ino_detach(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t min) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    // the cluster a compressed file is cut in stays whole for the truncate
+    uint32_t n = fs_inode_compressed(inode) ? fs_cluster_blocks(fs) : 1;
+    if (DIV_CEIL((uint64_t)lblk, n) * n > UINT32_MAX) {
+        fs_put_inode(fs, inode, false);
+        return SUCCESS;
+    }
+    lblk = DIV_CEIL(lblk, n) * n;
+    bool large = !fs_inode_inline(inode)
+        && DIV_CEIL(inode->size, fs->header->block_size) > (uint64_t)lblk + min;
+    fs_put_inode(fs, inode, false);
+    if (!large) return SUCCESS;
+
+    uint32_t holder = fs_alloc_inode(fs, ino, S_IFREG >> 3);
+    if (holder == INO_INVALID) return -ENOSPC;
+    int32_t err = fs_init_inode(fs, holder, S_IFREG >> 3);
+    fs_inode *dst = err == SUCCESS ? fs_get_inode(fs, holder) : NULL;
+    inode = dst != NULL ? fs_get_inode(fs, ino) : NULL;
+    if (inode == NULL) {
+        if (dst != NULL) fs_put_inode(fs, dst, false);
+        fs_free_inode(fs, holder);
+        return -EIO;
+    }
+
+    dst->mode &= ~FS_MODE_INLINE;
+    dst->size = inode->size;
+    for (uint32_t i = lblk; i < FS_BLOCK_POINTERS; i++) {
+        dst->block[i] = inode->block[i];
+        inode->block[i] = BLK_INVALID;
+    }
+
+    uint64_t base = FS_BLOCK_POINTERS;
+    uint64_t span = 1;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS && err == SUCCESS; level++) {
+        span *= fs->header->blockp_len;
+        uint32_t *src_root = fs_inode_root(inode, level);
+        uint32_t *dst_root = fs_inode_root(dst, level);
+        if (lblk <= base) {
+            *dst_root = *src_root;
+            *src_root = BLK_INVALID;
+        }
+        else if (lblk < base + span) err = fs_split_tree(fs, src_root, dst_root, lblk - base, level + 1);
+        base += span;
+    }
+
+    fs_put_inode(fs, inode, true);
+    fs_put_inode(fs, dst, true);
+    ERR(fs_orphan_add(fs, holder));
+    return err;
+}
+
+// creates the refcount table with the first clone, see fs_refcount_ptr
+int32_t fs_refcount_init(fs_fs *fs) {
+    if (fs->header->refcount_ino != INO_INVALID) return SUCCESS;
+    uint32_t ino = fs_alloc_inode(fs, fs->header->root_ino, S_IFREG >> 3);
+    if (ino == INO_INVALID) return -ENOSPC;
+    int32_t err = fs_init_inode(fs, ino, S_IFREG >> 3);
+    if (err == SUCCESS) err = fs_ino_truncate(fs, ino, (uint64_t)fs->header->blocks_total * sizeof(uint32_t));
+    if (err < 0) {
+        fs_free_inode(fs, ino);
+        return err;
+    }
+
+    // held by the header
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    inode->refs = 1;
+    fs_put_inode(fs, inode, true);
+    fs->header->refcount_ino = ino;
+    return SUCCESS;
+}
+
+// Copies the indirect blocks below *src to *dst and shares the data
+// blocks, lblk being the first logical block below *src. When the journal
+// runs out of room, the copy so far becomes a file of its own, see
+// fs_journal_step, so a crash can leave a shorter prefix of the source.
+int32_t fs_clone_tree(fs_fs *fs, fs_inode *to, size_t size, uint32_t *src, uint32_t *dst, uint32_t depth, uint64_t lblk) {
+    if (*src == BLK_INVALID) return SUCCESS;
+    if (depth == 0) {
+        uint32_t n = fs_inode_compressed(to) ? fs_cluster_blocks(fs) : 1;
+        if (lblk % n == 0 && !fs_journal_room(fs, FS_JOURNAL_STEP)) {
+            to->size = MIN(size, lblk * fs->header->block_size);
+            fs_bdirty(fs, to);
+            ERR(fs_journal_step(fs));
+        }
+        ERR(fs_refcount_inc(fs, *src));
+        *dst = *src;
+        fs_bdirty(fs, dst);
+        return SUCCESS;
+    }
+
+    int32_t blk = fs_bmap_step(fs, dst, true, BLK_INVALID);
+    if (blk < 0) return blk;
+    uint32_t *from_block = (uint32_t *)fs_get_block(fs, *src);
+    PIN(from_block);
+    uint32_t *to_block = (uint32_t *)fs_get_block(fs, blk);
+    if (to_block == NULL) {
+        fs_put_block(fs, from_block, false);
+        return -EIO;
+    }
+
+    uint32_t len = fs->header->blockp_len;
+    uint64_t span = 1;
+    for (uint32_t d = 1; d < depth; d++) span *= len;
+    int32_t err = SUCCESS;
+    for (uint32_t j = 0; j < len && err == SUCCESS; j++) {
+        err = fs_clone_tree(fs, to, size, &from_block[j], &to_block[j], depth - 1, lblk + j * span);
+    }
+    fs_put_block(fs, to_block, true);
+    fs_put_block(fs, from_block, false);
+    return err;
+}
+
+// Makes the regular file dst a copy of src that shares its data blocks,
+// so that only the indirect blocks are copied. Writes to either file copy
+// shared blocks first.
+int32_t fs_ino_clone(fs_fs *fs, uint32_t src, uint32_t dst) {
+    FS_STAT(fs, FS_OP_CLONE);
+    TRACE_OP(TRACE_CLONE, dst, src, 0);
+    if (src == dst) return -EINVAL;
+    if (!fs_ino_isreg(fs, src) || !fs_ino_isreg(fs, dst)) return -EINVAL;
+    ERR(fs_ino_truncate(fs, dst, 0));
+    ERR(fs_refcount_init(fs));
+
+    fs_inode *from = fs_get_inode(fs, src);
+    PIN(from);
+    fs_inode *to = fs_get_inode(fs, dst);
+    if (to == NULL) {
+        fs_put_inode(fs, from, false);
+        return -EIO;
+    }
+
+    // the inline contents of dst are zero, which leaves every slot empty
+    size_t size = from->size;
+    uint16_t layout = FS_MODE_INLINE | FS_MODE_COMPRESS;
+    to->mode = (to->mode & ~layout) | (from->mode & layout);
+    int32_t err = SUCCESS;
+    if (fs_inode_inline(from)) _memcpy(fs_inline_data(to), fs_inline_data(from), FS_INLINE_MAX);
+    for (uint32_t i = 0; i < FS_BLOCK_POINTERS && !fs_inode_inline(from) && err == SUCCESS; i++) {
+        err = fs_clone_tree(fs, to, size, &from->block[i], &to->block[i], 0, i);
+    }
+    uint64_t base = FS_BLOCK_POINTERS;
+    uint64_t span = 1;
+    for (uint32_t level = 0; level < FS_BLOCK_LEVELS && !fs_inode_inline(from) && err == SUCCESS; level++) {
+        span *= fs->header->blockp_len;
+        err = fs_clone_tree(fs, to, size, fs_inode_root(from, level), fs_inode_root(to, level), level + 1, base);
+        base += span;
+    }
+    to->size = size;
+    op_stat.bytes = size;
+    fs_put_inode(fs, to, true);
+    fs_put_inode(fs, from, false);
+
+    // drops the references taken so far
+    if (err < 0) fs_ino_truncate(fs, dst, 0);
+    return err;
+}
+
+// Reads and writes of compressed files go a cluster at a time. Parts of
+// compressed clusters are taken from and put back into a decompressed
+// copy, the cluster at EOF goes block by block.
+int32_t fs_ino_read_clusters(fs_fs *fs, uint32_t ino, uint8_t *buffer, size_t size, size_t offset) {
+    size_t cluster_size = fs_cluster_size(fs);
+    uint8_t *data = NULL;
+    size_t done = 0;
+    int32_t err = SUCCESS;
+    while (done < size && err >= 0) {
+        size_t pos = offset + done;
+        uint32_t c = pos / cluster_size;
+        size_t skip = pos % cluster_size;
+        size_t n = MIN(cluster_size - skip, size - done);
+
+        uint32_t blks[FS_CLUSTER_BLOCKS_MAX];
+        int32_t packed = fs_cluster_map(fs, ino, c, blks);
+        if (packed <= 0) err = packed < 0 ? packed : fs_ino_read_blocks(fs, ino, buffer + done, n, pos);
+        else if (n == cluster_size) err = fs_cluster_unpack(fs, ino, c, blks, buffer + done);
+        else {
+            if (data == NULL) data = (uint8_t *)malloc(cluster_size);
+            err = data != NULL ? fs_cluster_unpack(fs, ino, c, blks, data) : -ENOMEM;
+            if (err == SUCCESS) _memcpy(buffer + done, data + skip, n);
+        }
+        done += n;
+    }
+    free(data);
+    return err < 0 ? err : (int32_t)done;
+}
+
+int32_t fs_ino_write_clusters(fs_fs *fs, uint32_t ino, const uint8_t *buffer, size_t size, size_t offset) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    uint64_t file_size = inode->size;
+    fs_put_inode(fs, inode, false);
+
+    size_t cluster_size = fs_cluster_size(fs);
+    uint8_t *data = NULL;
+    size_t done = 0;
+    int32_t err = SUCCESS;
+    while (done < size && err >= 0) {
+        if (done > 0 && !fs_journal_room(fs, FS_JOURNAL_STEP)) break;
+        size_t pos = offset + done;
+        uint32_t c = pos / cluster_size;
+        size_t skip = pos % cluster_size;
+        size_t n = MIN(cluster_size - skip, size - done);
+
+        bool tail = (uint64_t)(c + 1) * cluster_size > file_size;
+        if (tail) err = fs_ino_write_blocks(fs, ino, buffer + done, n, pos);
+        else if (n == cluster_size) err = fs_cluster_store(fs, ino, c, buffer + done, cluster_size);
+        else {
+            if (data == NULL) data = (uint8_t *)malloc(cluster_size);
+            err = data != NULL ? fs_cluster_load(fs, ino, c, data) : -ENOMEM;
+            if (err == SUCCESS) _memcpy(data + skip, buffer + done, n);
+            if (err == SUCCESS) err = fs_cluster_store(fs, ino, c, data, cluster_size);
+        }
+        if (err < 0) break;
+        done += tail ? (size_t)err : n;
+        if (tail && (size_t)err < n) break;
+    }
+    free(data);
+    return err < 0 && done == 0 ? err : (int32_t)done;
+}
+
+// Switches compression of a directory, whose new files and directories
+// take it over, or of an empty regular file.
+int32_t fs_ino_compress(fs_fs *fs, uint32_t ino, bool on) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    uint16_t type = inode->mode & (S_IFMT >> 3);
+    bool allowed = type == (S_IFDIR >> 3) || (type == (S_IFREG >> 3) && inode->size == 0);
+    bool change = on != (bool)(inode->mode & FS_MODE_COMPRESS);
+    if (change && allowed) inode->mode ^= FS_MODE_COMPRESS;
+    fs_put_inode(fs, inode, change && allowed);
+    return change && !allowed ? -EINVAL : SUCCESS;
+}
+
+int32_t fs_ino_pread(fs_fs *fs, uint32_t ino, void *buffer, size_t size, size_t offset) {
+    FS_STAT(fs, FS_OP_PREAD);
+    TRACE_OP(TRACE_READ, ino, offset, size);
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    size_t file_size = inode->size;
+    size = offset < file_size ? MIN(size, file_size - offset) : 0;
+    if (fs_inode_inline(inode)) {
+        if (size > 0) _memcpy(buffer, fs_inline_data(inode) + offset, size);
+        fs_put_inode(fs, inode, false);
+        op_stat.bytes = size;
+        return size;
+    }
+    bool compressed = fs_inode_compressed(inode);
+    fs_put_inode(fs, inode, false);
+    if (size == 0) return 0;
+
+    int32_t done = compressed
+        ? fs_ino_read_clusters(fs, ino, (uint8_t *)buffer, size, offset)
+        : fs_ino_read_blocks(fs, ino, (uint8_t *)buffer, size, offset);
+    if (done > 0) op_stat.bytes = done;
+    return done;
+}
+
+int32_t fs_ino_read(fs_fs *fs, uint32_t ino, void *buffer, size_t size) {
+    return fs_ino_pread(fs, ino, buffer, size, 0);
+}
+
+// Loads up to count blocks of the file from lblk on into the buffer
+// cache, stopping at its end. Each run of uncached blocks takes one
+// device request if the device can read runs. Returns the blocks looked
+// at, holes and cached ones included. Does nothing without a cache.
+int32_t fs_ino_prefetch(fs_fs *fs, uint32_t ino, uint32_t lblk, uint32_t count) {
+    if (fs->raw != NULL || ino == INO_INVALID || ino > fs->header->max_ino) return 0;
+    uint32_t block_size = fs->header->block_size;
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    uint64_t blocks = DIV_CEIL(inode->size, block_size);
+    bool mapped = inode->ino == ino && !fs_inode_inline(inode);
+    fs_put_inode(fs, inode, false);
+    if (!mapped || lblk >= blocks) return 0;
+    count = MIN(count, blocks - lblk);
+
+    uint8_t *buffer = NULL;
+    if (fs->dev->read_blocks != NULL) buffer = (uint8_t *)malloc((size_t)count * block_size);
+    uint32_t done = 0;
+    int32_t err = SUCCESS;
+    while (done < count && err == SUCCESS) {
+        uint32_t run;
+        int32_t blk = fs_ino_bmap_run(fs, ino, lblk + done, count - done, false, &run);
+        if (blk < 0) {
+            err = blk;
+            break;
+        }
+        uint32_t i = 0;
+        while (blk != BLK_INVALID && i < run) {
+            uint32_t first = fs->data_start + blk + i;
+            uint32_t n = buffer != NULL ? fs_bcache_uncached(fs, first, run - i) : 0;
+            if (n > 0) {
+                // the caller holds the inode, nothing writes the run meanwhile
+                err = fs->dev->read_blocks(fs->dev->ctx, first, n, buffer, block_size);
+                if (err == SUCCESS && fs_bcache_fill(fs, first, n, buffer) < n) err = -ENOMEM;
+                if (err < 0) break;
+                i += n;
+                continue;
+            }
+            fs_block *block = fs_get_data_block(fs, blk + i);
+            if (block == NULL) {
+                err = -EIO;
+                break;
+            }
+            fs_put_block(fs, block, false);
+            i++;
+        }
+        done += err < 0 ? i : run;
+    }
+    free(buffer);
+    return done > 0 || err == SUCCESS ? (int32_t)done : err;
+}
+
+// only extends the file if the write ends past EOF
+int32_t fs_ino_pwrite(fs_fs *fs, uint32_t ino, const void *buffer, size_t size, size_t offset) {
+    FS_STAT(fs, FS_OP_PWRITE);
+    TRACE_OP(TRACE_WRITE, ino, offset, size);
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    size_t file_size = inode->size;
+    bool compressed = fs_inode_compressed(inode);
+    if (fs_inode_inline(inode) && offset + size <= FS_INLINE_MAX) {
+        _memcpy(fs_inline_data(inode) + offset, buffer, size);
+        inode->size = MAX(file_size, offset + size);
+        fs_put_inode(fs, inode, true);
+        op_stat.bytes = size;
+        return size;
+    }
+    fs_put_inode(fs, inode, false);
+
+    if (offset + size > file_size) ERR(fs_ino_truncate(fs, ino, offset + size));
+
+    int32_t done = compressed
+        ? fs_ino_write_clusters(fs, ino, (const uint8_t *)buffer, size, offset)
+        : fs_ino_write_blocks(fs, ino, (const uint8_t *)buffer, size, offset);
+    if (done > 0) op_stat.bytes = done;
+    return done;
+}
+
+int32_t fs_ino_write(fs_fs *fs, uint32_t ino, const void *buffer, size_t size) {
+    ERR(fs_ino_truncate(fs, ino, size));
+    return fs_ino_pwrite(fs, ino, buffer, size, 0);
+}
+
+int32_t fs_ino_write_cstr(fs_fs *fs, uint32_t ino, const char *string) {
+    size_t size = _strlen(string);
+    return fs_ino_write(fs, ino, (uint8_t *)string, size);
+}
+
+// TODO improve directory handling
+fs_dentry *fs_dir_entry(fs_dir *dir) {
+    if (dir->size <= 0) return NULL;
+    return (fs_dentry *)dir->buffer;
+}
+
+static inline uint16_t fs_dentry_size(uint16_t len) {
+    return offsetof(fs_dentry, name) + len + 1;
+}
+
+// TODO improve
+fs_dentry *fs_dir_next(fs_dir *dir) {
+    fs_dentry *dentry = fs_dir_entry(dir);
+    if (dentry == NULL) return NULL;
+    dir->size -= fs_dentry_size(dentry->len);
+    dir->buffer += fs_dentry_size(dentry->len);
+    return fs_dir_entry(dir);
+}
+
+fs_dentry *fs_dir_search(fs_dir *dir, const char *name) {
+    fs_dentry *dentry = fs_dir_entry(dir);
+    while (dentry != NULL) {
+        if (!_strcmp(&dentry->name, name)) return dentry;
+        dentry = fs_dir_next(dir);
+    }
+    return NULL;
+}
+
+// reads a whole linear directory, only used for legacy images
+int32_t fs_ino_readdir(fs_fs *fs, uint32_t ino, fs_dir *dir, size_t size) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    bool isdir = inode->mode & (S_IFDIR >> 3);
+    dir->size = inode->size;
+    fs_put_inode(fs, inode, false);
+    if (!isdir) return -ENOTDIR;
+
+    int32_t read = fs_ino_read(fs, ino, dir->buffer, size);
+    if (read < 0) return read;
+    if (read != dir->size) return -EFBIG;
+    return SUCCESS;
+}
+
+// pins block 0 of an indexed directory, NULL for linear ones
+fs_dir_header *fs_dir_get_header(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    if (inode == NULL) return NULL;
+    bool indexed = inode->size >= fs->header->block_size;
+    uint32_t blk = inode->block[0];
+    fs_put_inode(fs, inode, false);
+    if (!indexed) return NULL;
+
+    fs_dir_header *header = (fs_dir_header *)fs_get_block(fs, blk);
+    if (header == NULL) return NULL;
+    if (header->ino != INO_INVALID || header->magic != FS_DIR_MAGIC) {
+        fs_put_block(fs, header, false);
+        return NULL;
+    }
+    return header;
+}
+
+fs_dir_bucket *fs_dir_get_bucket(fs_fs *fs, uint32_t ino, uint32_t bucket) {
+    int32_t blk = fs_ino_bmap(fs, ino, 1 + bucket, false);
+    if (blk <= 0) return NULL;
+    return (fs_dir_bucket *)fs_get_block(fs, blk);
+}
+
+fs_dentry *fs_dir_bucket_search(fs_dir_bucket *bucket, const char *name) {
+    fs_dir dir = { bucket->used, bucket->dentries };
+    return fs_dir_search(&dir, name);
+}
+
+// Directories grow by linear hashing: a hash picks one of buckets
+// buckets, or one of twice as many once that one has been split. Buckets
+// are split one at a time in order, until their number has doubled.
+static inline uint32_t fs_dir_bucket_of(fs_dir_header *header, uint32_t hash) {
+    uint32_t b = hash & (header->buckets - 1);
+    return b < header->split ? hash & (header->buckets * 2 - 1) : b;
+}
+
+static inline uint32_t fs_dir_buckets(fs_dir_header *header) {
+    return header->buckets + header->split;
+}
+
+static inline bool fs_dir_bucket_fits(fs_fs *fs, fs_dir_bucket *bucket, uint16_t len) {
+    uint32_t capacity = fs->header->block_size - offsetof(fs_dir_bucket, dentries);
+    return bucket->used + fs_dentry_size(len) <= capacity;
+}
+
+bool fs_dir_bucket_add(fs_fs *fs, fs_dir_bucket *bucket, uint32_t ino, const char *name, uint16_t len) {
+    if (!fs_dir_bucket_fits(fs, bucket, len)) return false;
+
+    fs_dentry *dentry = (fs_dentry *)(bucket->dentries + bucket->used);
+    dentry->ino = ino;
+    dentry->len = len;
+    _memcpy(&dentry->name, name, len + 1);
+    bucket->used += fs_dentry_size(len);
+    return true;
+}
+
+void fs_dir_bucket_remove(fs_dir_bucket *bucket, fs_dentry *dentry) {
+    uint8_t *start = (uint8_t *)dentry;
+    uint8_t *end = start + fs_dentry_size(dentry->len);
+    size_t tail = bucket->dentries + bucket->used - end;
+    _memcpy(start, end, tail);
+    bucket->used -= end - start;
+}
+
+// Splits the next bucket b into b and the new last bucket b + buckets,
+// which takes the dentries whose hash has the buckets bit set. Logs a few
+// blocks, whatever the size of the directory. Once there are
+// FS_DIR_BUCKETS_MAX buckets a full one cannot take another name, which
+// fails with -EMLINK rather than -ENOSPC as the disk may have room left.
+int32_t fs_dir_split(fs_fs *fs, uint32_t ino) {
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    PIN(header);
+    uint32_t buckets = header->buckets;
+    uint32_t b = header->split;
+    fs_put_block(fs, header, false);
+    if (buckets * 2 > FS_DIR_BUCKETS_MAX) return -EMLINK;
+
+    uint32_t block_size = fs->header->block_size;
+    ERR(fs_ino_truncate(fs, ino, (uint64_t)(2 + buckets + b) * block_size));
+    int32_t err = fs_ino_allocate(fs, ino, 1 + buckets + b, 2 + buckets + b);
+    if (err < 0) {
+        fs_ino_truncate(fs, ino, (uint64_t)(1 + buckets + b) * block_size);
+        return err;
+    }
+
+    fs_dir_bucket *old = fs_dir_get_bucket(fs, ino, b);
+    PIN(old);
+    fs_dir_bucket *new = fs_dir_get_bucket(fs, ino, b + buckets);
+    if (new == NULL) {
+        fs_put_block(fs, old, false);
+        return -EIO;
+    }
+
+    uint16_t offset = 0;
+    while (offset < old->used) {
+        fs_dentry *dentry = (fs_dentry *)(old->dentries + offset);
+        if (fs_dir_hash(&dentry->name) & buckets) {
+            fs_dir_bucket_add(fs, new, dentry->ino, &dentry->name, dentry->len);
+            fs_dir_bucket_remove(old, dentry);
+        }
+        else {
+            offset += fs_dentry_size(dentry->len);
+        }
+    }
+    fs_put_block(fs, old, true);
+    fs_put_block(fs, new, true);
+
+    header = fs_dir_get_header(fs, ino);
+    PIN(header);
+    header->split = b + 1;
+    if (header->split == buckets) {
+        header->buckets = buckets * 2;
+        header->split = 0;
+    }
+    fs_put_block(fs, header, true);
+    return SUCCESS;
+}
+
+int32_t fs_dir_init(fs_fs *fs, uint32_t ino) {
+    ERR(fs_ino_truncate(fs, ino, 2 * fs->header->block_size));
+    ERR(fs_ino_allocate(fs, ino, 0, 2));
+
+    int32_t blk = fs_ino_bmap(fs, ino, 0, false);
+    if (blk <= 0) return -EIO;
+    fs_dir_header *header = (fs_dir_header *)fs_get_block(fs, blk);
+    PIN(header);
+    header->ino = INO_INVALID;
+    header->magic = FS_DIR_MAGIC;
+    header->buckets = 1;
+    header->entries = 0;
+    header->split = 0;
+    fs_put_block(fs, header, true);
+    return SUCCESS;
+}
+
+int32_t fs_dir_insert(fs_fs *fs, uint32_t ino, uint32_t child_ino, const char *name) {
+    uint16_t len = _strlen(name);
+    if (len >= FS_NAME_LEN_MAX) return -ENAMETOOLONG;
+
+    uint32_t hash = fs_dir_hash(name);
+    while (true) {
+        fs_dir_header *header = fs_dir_get_header(fs, ino);
+        PIN(header);
+        fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, fs_dir_bucket_of(header, hash));
+        if (bucket == NULL) {
+            fs_put_block(fs, header, false);
+            return -EIO;
+        }
+
+        if (fs_dir_bucket_search(bucket, name) != NULL) {
+            fs_put_block(fs, bucket, false);
+            fs_put_block(fs, header, false);
+            return -EEXIST;
+        }
+
+        bool added = fs_dir_bucket_add(fs, bucket, child_ino, name, len);
+        if (added) header->entries++;
+        fs_put_block(fs, bucket, added);
+        fs_put_block(fs, header, added);
+        if (added) return SUCCESS;
+
+        ERR(fs_dir_split(fs, ino));
+    }
+}
+
+// rebuilds a linear directory as an indexed one
+int32_t fs_dir_convert(fs_fs *fs, uint32_t ino) {
+    READDIR(fs, ino);
+    ERR(fs_ino_truncate(fs, ino, 0));
+    ERR(fs_dir_init(fs, ino));
+
+    fs_dentry *dentry = fs_dir_entry(&dir);
+    while (dentry != NULL) {
+        ERR(fs_dir_insert(fs, ino, dentry->ino, &dentry->name));
+        dentry = fs_dir_next(&dir);
+    }
+    return SUCCESS;
+}
+
+// converts linear and initialises empty directories before a change
+int32_t fs_dir_prepare(fs_fs *fs, uint32_t ino) {
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    if (header != NULL) {
+        fs_put_block(fs, header, false);
+        return SUCCESS;
+    }
+
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    bool empty = inode->size == 0;
+    fs_put_inode(fs, inode, false);
+    return empty ? fs_dir_init(fs, ino) : fs_dir_convert(fs, ino);
+}
+
+// Converts the directory if needed and splits buckets until the one name
+// falls into has room for it. Each split is a step of its own, see
+// fs_journal_step, so that a large directory grows over several commits.
+// Runs before the operation changes anything else.
+int32_t fs_dir_make_room(fs_fs *fs, uint32_t ino, const char *name) {
+    uint16_t len = _strlen(name);
+    if (len >= FS_NAME_LEN_MAX) return -ENAMETOOLONG;
+    ERR(fs_dir_prepare(fs, ino));
+
+    uint32_t hash = fs_dir_hash(name);
+    bool split = false;
+    while (true) {
+        fs_dir_header *header = fs_dir_get_header(fs, ino);
+        PIN(header);
+        fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, fs_dir_bucket_of(header, hash));
+        fs_put_block(fs, header, false);
+        PIN(bucket);
+        bool fits = fs_dir_bucket_fits(fs, bucket, len);
+        fs_put_block(fs, bucket, false);
+        if (fits) break;
+
+        ERR(fs_journal_step(fs));
+        ERR(fs_dir_split(fs, ino));
+        split = true;
+    }
+    // the rest of the operation gets a step as well
+    return split ? fs_journal_step(fs) : SUCCESS;
+}
+
+int32_t fs_dir_add(fs_fs *fs, uint32_t ino, uint32_t child_ino, const char *name) {
+    if (!fs_ino_isdir(fs, ino)) return -ENOTDIR;
+    ERR(fs_dir_make_room(fs, ino, name));
+    return fs_dir_insert(fs, ino, child_ino, name);
+}
+
+// returns the ino of the removed dentry
+int32_t fs_dir_remove(fs_fs *fs, uint32_t ino, const char *name) {
+    if (!fs_ino_isdir(fs, ino)) return -ENOTDIR;
+    ERR(fs_dir_prepare(fs, ino));
+
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    PIN(header);
+    fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, fs_dir_bucket_of(header, fs_dir_hash(name)));
+    if (bucket == NULL) {
+        fs_put_block(fs, header, false);
+        return -EIO;
+    }
+
+    fs_dentry *dentry = fs_dir_bucket_search(bucket, name);
+    if (dentry == NULL) {
+        fs_put_block(fs, bucket, false);
+        fs_put_block(fs, header, false);
+        return -ENOENT;
+    }
+
+    uint32_t child_ino = dentry->ino;
+    fs_dir_bucket_remove(bucket, dentry);
+    header->entries--;
+    fs_put_block(fs, bucket, true);
+    fs_put_block(fs, header, true);
+    return child_ino;
+}
+
+int32_t fs_dir_lookup(fs_fs *fs, uint32_t ino, const char *name) {
+    if (!fs_ino_isdir(fs, ino)) return -ENOTDIR;
+
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    if (header == NULL) {
+        READDIR(fs, ino);
+        fs_dentry *dentry = fs_dir_search(&dir, name);
+        if (dentry == NULL) return -ENOENT;
+        return dentry->ino;
+    }
+
+    fs_dir_bucket *bucket = fs_dir_get_bucket(fs, ino, fs_dir_bucket_of(header, fs_dir_hash(name)));
+    fs_put_block(fs, header, false);
+    PIN(bucket);
+
+    fs_dentry *dentry = fs_dir_bucket_search(bucket, name);
+    int32_t child_ino = dentry == NULL ? -ENOENT : (int32_t)dentry->ino;
+    fs_put_block(fs, bucket, false);
+    return child_ino;
+}
+
+// iterates over the dentries of an indexed directory
+fs_dentry *fs_dir_iter_next(fs_dir_iter *it) {
+    fs_dir_header *header = fs_dir_get_header(it->fs, it->ino);
+    if (header == NULL) return NULL;
+    uint32_t buckets = fs_dir_buckets(header);
+    fs_put_block(it->fs, header, false);
+
+    while (it->bucket < buckets) {
+        fs_dir_bucket *bucket = fs_dir_get_bucket(it->fs, it->ino, it->bucket);
+        if (bucket == NULL) return NULL;
+
+        if (it->offset < bucket->used) {
+            fs_dentry *dentry = (fs_dentry *)(bucket->dentries + it->offset);
+            uint16_t size = fs_dentry_size(dentry->len);
+            _memcpy(it->bytes, dentry, size);
+            it->offset += size;
+            fs_put_block(it->fs, bucket, false);
+            return &it->dentry;
+        }
+
+        fs_put_block(it->fs, bucket, false);
+        it->bucket++;
+        it->offset = 0;
+    }
+    return NULL;
+}
+
+int32_t fs_dir_empty(fs_fs *fs, uint32_t ino) {
+    fs_dir_header *header = fs_dir_get_header(fs, ino);
+    if (header != NULL) {
+        bool empty = header->entries <= 2;
+        fs_put_block(fs, header, false);
+        return empty;
+    }
+
     READDIR(fs, ino);
-    fs_dentry *dentry = fs_dir_search(&dir, name);
-    if (dentry == NULL) return -ENOENT;
-    return dentry->ino;
+    fs_dentry *dentry = fs_dir_entry(&dir);
+    while (dentry != NULL) {
+        if (_strcmp(&dentry->name, ".") && _strcmp(&dentry->name, "..")) return false;
+        dentry = fs_dir_next(&dir);
+    }
+    return true;
+}
+
+int32_t fs_ino_refs_inc(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    inode->refs++;
+    fs_put_inode(fs, inode, true);
+    return SUCCESS;
+}
+
+int32_t fs_ino_refs_dec(fs_fs *fs, uint32_t ino) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+    inode->refs--;
+    bool unused = inode->refs == 0;
+    fs_put_inode(fs, inode, true);
+    if (unused) return fs_release_inode(fs, ino);
+    return SUCCESS;
+}
+
+int32_t fs_ino_link(fs_fs *fs, uint32_t parent_ino, uint32_t ino, const char *name) {
+    FS_STAT(fs, FS_OP_LINK);
+    TRACE_OP(TRACE_LINK, ino, parent_ino, 0);
+    ERR(fs_dir_add(fs, parent_ino, ino, name));
+    fs_dcache_insert(fs, parent_ino, name, ino);
+    return fs_ino_refs_inc(fs, ino);
+}
+
+int32_t fs_ino_unlink(fs_fs *fs, uint32_t parent_ino, const char *name) {
+    FS_STAT(fs, FS_OP_UNLINK);
+    int32_t ino = fs_dir_remove(fs, parent_ino, name);
+    CHECK_INO(ino);
+    TRACE_OP(TRACE_UNLINK, ino, parent_ino, 0);
+    fs_dcache_insert(fs, parent_ino, name, INO_INVALID);
+    return fs_ino_refs_dec(fs, ino);
+}
+
+int32_t fs_init_inode(fs_fs *fs, uint32_t ino, uint16_t mode) {
+    fs_inode *inode = fs_get_inode(fs, ino);
+    PIN(inode);
+
+    inode->ino = ino;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->mode = mode;
+    if (fs_inode_inlinable(fs, inode)) inode->mode |= FS_MODE_INLINE;
+    inode->refs = 0;
+    inode->size = 0;
+    inode->time = time(NULL);
+    for (size_t i = 0; i < FS_BLOCK_POINTERS; i++) {
+        inode->block[i] = BLK_INVALID;
+    }
+    inode->block_p = BLK_INVALID;
+    inode->block_pp = BLK_INVALID;
+    inode->block_ppp = BLK_INVALID;
+
+    fs_put_inode(fs, inode, true);
+    return SUCCESS;
+}
+
+int32_t fs_ino_mk(fs_fs *fs, uint32_t parent_ino, const char *name, uint16_t mode) {
+    FS_STAT(fs, FS_OP_MK);
+    if (!fs_ino_isdir(fs, parent_ino)) return -ENOTDIR;
+    ERR(fs_dir_make_room(fs, parent_ino, name));
+
+    int32_t ino = fs_alloc_inode(fs, parent_ino, mode);
+    if (ino == INO_INVALID) return -ENOSPC;
+
+    int32_t err = fs_init_inode(fs, ino, mode);
+    uint16_t type = mode & (S_IFMT >> 3);
+    bool compress = type == (S_IFREG >> 3) || type == (S_IFDIR >> 3);
+    if (err == SUCCESS && compress && fs_ino_compressed(fs, parent_ino)) err = fs_ino_compress(fs, ino, true);
+    if (err == SUCCESS) err = fs_ino_link(fs, parent_ino, ino, name);
+    if (err < 0) {
+        fs_free_inode(fs, ino);
+        return err;
+    }
+    TRACE_OP(TRACE_MK, ino, parent_ino, 0);
+    return ino;
+}
+
+int32_t fs_ino_mkdir(fs_fs *fs, uint32_t parent_ino, const char *name, uint16_t mode) {
+    int32_t ino = fs_ino_mk(fs, parent_ino, name, mode | (S_IFDIR >> 3));
+    CHECK_INO(ino);
+
+    ERR(fs_ino_link(fs, ino, ino, "."));
+    ERR(fs_ino_link(fs, ino, parent_ino, ".."));
+    return ino;
+}
+
+int32_t fs_ino_rmdir(fs_fs *fs, uint32_t parent_ino, const char *name) {
+    int32_t ino = fs_dir_lookup(fs, parent_ino, name);
+    CHECK_INO(ino);
+    if (!fs_ino_isdir(fs, ino)) return -ENOTDIR;
+    if (!fs_dir_empty(fs, ino)) return -ENOTEMPTY;
+
+    // drop the references held by "." and ".." so the inode is freed
+    ERR(fs_ino_unlink(fs, ino, ".."));
+    ERR(fs_ino_unlink(fs, ino, "."));
+    return fs_ino_unlink(fs, parent_ino, name);
+}
+
+int32_t fs_ino_mknod(fs_fs *fs, uint32_t parent_ino, const char *name, uint16_t mode) {
+    return fs_ino_mk(fs, parent_ino, name, mode);
+}
+
+int32_t fs_ino_symlink(fs_fs *fs, uint32_t parent_ino, const char *name, const char *target) {
+    int32_t ino = fs_ino_mk(fs, parent_ino, name, (S_IFLNK >> 3) | S_IRWXU | S_IRWXG | S_IRWXO);
+    CHECK_INO(ino);
+
+    int32_t err = fs_ino_write_cstr(fs, ino, target);
+    if (err < 0) {
+        fs_ino_unlink(fs, parent_ino, name);
+        return err;
+    }
+    return ino;
+}
+
+int32_t fs_name_to_ino(fs_fs *fs, uint32_t ino, const char *name) {
+    if (*name == '\0') return ino;
+
+    int32_t child_ino;
+    if (fs_dcache_lookup(fs, ino, name, &child_ino)) return child_ino;
+
+    child_ino = fs_dir_lookup(fs, ino, name);
+    if (child_ino > 0) fs_dcache_insert(fs, ino, name, child_ino);
+    if (child_ino == -ENOENT) fs_dcache_insert(fs, ino, name, INO_INVALID);
+    return child_ino;
+}
+
+int32_t fs_path_to_parent_ino_rel(fs_fs *fs, const char *path, int32_t ino) {
+    char name[FS_NAME_LEN_MAX];
+    if (*path == '/') path++;
+
+    for (const char *ptr = path; *ptr != '\0'; ptr++) {
+        if (*ptr != '/') continue;
+        size_t len = ptr - path;
+        if (len >= FS_NAME_LEN_MAX) return -ENAMETOOLONG;
+        _memcpy(name, path, len);
+        *(name + len) = '\0';
+        ino = fs_name_to_ino(fs, ino, name);
+        CHECK_INO(ino);
+        ptr++;
+        path = ptr;
+    }
+    return ino;
+}
+
+int32_t fs_path_to_parent_ino(fs_fs *fs, const char *path) {
+    FS_STAT(fs, FS_OP_PATH);
+    return fs_path_to_parent_ino_rel(fs, path, fs->header->root_ino);
+}
+
+const char *fs_path_get_name(const char *path) {
+    size_t len = _strlen(path);
+    for (const char *ptr = path + len - 1; ptr >= path; ptr--) {
+        if (*ptr == '/') return ptr + 1;
+    }
+    return NULL;
+}
+
+int32_t fs_path_to_ino_rel(fs_fs *fs, const char *path, uint32_t ino) {
+    int32_t parent_ino = fs_path_to_parent_ino_rel(fs, path, ino);
+    CHECK_INO(parent_ino);
+
+    const char *name = fs_path_get_name(path);
+    if (name == NULL) return -EINVAL;
+
+    return fs_name_to_ino(fs, parent_ino, name);
+}
+
+int32_t fs_path_to_ino(fs_fs *fs, const char *path) {
+    FS_STAT(fs, FS_OP_PATH);
+    if (*path != '/') return -EINVAL;
+    return fs_path_to_ino_rel(fs, path, fs->header->root_ino);
+}
+
+int32_t fs_init_blocks(fs_fs *fs) {
+    for (uint32_t i = 0; i < fs->header->blocks_bitmap; i++) {
+        fs_block *block = fs_bget_fill(fs, fs->bitmap_start + i, false, true);
+        PIN(block);
+        _memset(block, 0, fs->header->block_size);
+        fs_bput(fs, block, true);
+    }
+
+    uint8_t *bitmap = fs_get_bitmap(fs, BLK_INVALID);
+    PIN(bitmap);
+    fs_bitmap_set(bitmap, BLK_INVALID);
+    fs_bput(fs, bitmap, true);
+
+    fs->header->free_blk = 1;
+    return SUCCESS;
+}
+
+int32_t fs_init_inodes(fs_fs *fs) {
+    for (uint32_t i = 0; i < fs->header->blocks_inode; i++) {
+        fs_block *block = fs_bget_fill(fs, fs->inode_start + i, false, true);
+        PIN(block);
+        _memset(block, 0, fs->header->block_size);
+        fs_bput(fs, block, true);
+    }
+
+    // one free list per group, inode 0 is never used and 1 is the root
+    size_t size = fs->header->inodes_total;
+    uint32_t per_group = fs->header->inodes_group;
+    for (size_t i = 0; i < size; i++) {
+        fs_inode *inode = fs_inode_ptr(fs, i);
+        PIN(inode);
+        bool last = i == size - 1 || (i + 1) % per_group == 0;
+        inode->ino = (i >= 2 && !last) ? i + 1 : INO_INVALID;
+        fs_put_inode(fs, inode, true);
+    }
+    return SUCCESS;
+}
+
+int32_t fs_init_groups(fs_fs *fs) {
+    for (uint32_t i = 1; i < fs->header->blocks_header; i++) {
+        fs_block *block = fs_bget_fill(fs, i, false, true);
+        PIN(block);
+        _memset(block, 0, fs->header->block_size);
+        fs_bput(fs, block, true);
+    }
+
+    for (uint32_t g = 0; g < fs->header->groups; g++) {
+        fs_group *group = fs_get_group(fs, g);
+        PIN(group);
+        uint32_t first = MAX(g * fs->header->inodes_group, 2);
+        group->free_ino = fs_group_inodes(fs, g) > (g == 0) ? first : INO_INVALID;
+        group->inodes = g == 0;     // the root
+        group->dirs = g == 0;
+        fs_put_group(fs, group, true);
+    }
+    return SUCCESS;
+}
+
+// computes where the regions described by the header start
+void fs_layout(fs_fs *fs) {
+    fs->bitmap_start = fs->header->blocks_header;
+    fs->journal.start = fs->bitmap_start + fs->header->blocks_bitmap;
+    fs->inode_start = fs->journal.start + fs->header->blocks_journal;
+    fs->data_start = fs->inode_start + fs->header->blocks_inode;
+}
+
+// Enables the journal if the image has one that takes a whole operation
+// besides the header, small images do not.
+void fs_journal_init(fs_fs *fs) {
+    fs_journal *journal = &fs->journal;
+    uint32_t capacity = fs_journal_capacity(fs);
+    journal->limit = MIN(capacity - (capacity > 0), FS_BCACHE_SIZE / 2);
+    journal->capacity = journal->limit >= FS_JOURNAL_CREDITS ? capacity : 0;
+    journal->interval = FS_JOURNAL_INTERVAL;
+    journal->last = fs_now_ms();
+    journal->pending = 0;
+    journal->reserved = 0;
+    for (size_t i = 0; fs->bcache != NULL && i < FS_BCACHE_SIZE; i++) {
+        journal->pending += fs_buf_logged(fs, &fs->bcache->bufs[i]);
+    }
+}
+
+static inline bool fs_block_size_valid(uint32_t block_size) {
+    bool pow2 = (block_size & (block_size - 1)) == 0;
+    return pow2 && block_size >= FS_BLOCK_SIZE_MIN && block_size <= FS_BLOCK_SIZE_MAX;
+}
+
+// Formats an image of size bytes in blocks of the attached block size,
+// with one inode per FS_INODE_RATIO bytes. Only the metadata regions are
+// written.
+int32_t fs_format(fs_fs *fs, uint64_t size) {
+    uint32_t block_size = fs->block_size;
+    uint32_t per_block = block_size / sizeof(fs_inode);
+    uint64_t blocks = MIN(size / block_size, INT32_MAX);
+    uint64_t inodes = MIN(size / FS_INODE_RATIO, INT32_MAX - per_block);
+    uint32_t journal = blocks / 16 > 2 ? MIN(blocks / 16, FS_JOURNAL_BLOCKS) : 0;
+    _memset(fs->header, 0, block_size);
+
+    fs->header->magic = FS_MAGIC;
+    fs->header->version = FS_VERSION;
+    fs->header->blocks_all = blocks;
+    fs->header->blocks_bitmap = DIV_CEIL(blocks, block_size * 8);
+    // the header, then a descriptor for each bitmap block
+    fs->header->blocks_header = 1 + DIV_CEIL(fs->header->blocks_bitmap, block_size / sizeof(fs_group));
+    fs->header->blocks_inode = MAX(DIV_CEIL(inodes, per_block), 1);
+    fs->header->blocks_journal = journal;
+    fs->header->inodes = 1;
+    fs->header->inodes_total = fs->header->blocks_inode * per_block;
+    fs->header->blocks = 0;
+
+    uint64_t meta = fs->header->blocks_header
+        + fs->header->blocks_bitmap
+        + fs->header->blocks_journal
+        + fs->header->blocks_inode;
+    if (meta + 2 > blocks) return -ENOSPC;
+    fs->header->blocks_total = blocks - meta;
+
+    fs->header->header_size = sizeof(fs_header);
+    fs->header->inode_size = sizeof(fs_inode);
+    fs->header->block_size = block_size;
+    fs->header->blockp_len = block_size / sizeof(uint32_t);
+    fs->header->name_max = FS_PATH_LEN_MAX;
+
+    fs->header->max_ino = fs->header->inodes_total - 1;
+
+    // inode ranges start on an inode table block
+    fs->header->groups = DIV_CEIL(fs->header->blocks_total, block_size * 8);
+    uint32_t group_blocks = DIV_CEIL(fs->header->blocks_inode, fs->header->groups);
+    fs->header->inodes_group = group_blocks * per_block;
+
+    uint32_t root_ino = 1;
+    fs->header->root_ino = root_ino;
+
+    fs_layout(fs);
+    ERR(fs_init_blocks(fs));
+    ERR(fs_init_inodes(fs));
+    ERR(fs_init_groups(fs));
+
+    fs_block *journal_block = fs_bget_fill(fs, fs->journal.start, false, true);
+    PIN(journal_block);
+    _memset(journal_block, 0, block_size);
+    fs_bput(fs, journal_block, true);
+
+    // create root inode
+    ERR(fs_init_inode(fs, root_ino, (S_IFDIR >> 3)));
+    ERR(fs_ino_link(fs, root_ino, root_ino, "."));
+    ERR(fs_ino_link(fs, root_ino, root_ino, ".."));
+    return SUCCESS;
+}
+
+// checks the header against an image of size bytes
+// Images older than FS_VERSION_MIN are refused, not converted. Version 4
+// keeps one free list in the header and has no room for the group
+// descriptors, its files have to be copied to a newly formatted image.
+static inline bool fs_version_supported(uint32_t version) {
+    return version >= FS_VERSION_MIN && version <= FS_VERSION;
+}
+
+int32_t fs_check_header(fs_header *header, uint64_t size) {
+    if (header->magic != FS_MAGIC) return -EINVAL;
+    if (!fs_version_supported(header->version)) return -EINVAL;
+    if (!fs_block_size_valid(header->block_size)) return -EINVAL;
+    if (header->inode_size != sizeof(fs_inode)) return -EINVAL;
+    if ((uint64_t)header->blocks_all * header->block_size > size) return -EINVAL;
+    if (header->refcount_ino > header->max_ino) return -EINVAL;
+    if (header->groups == 0 || header->groups > header->blocks_bitmap) return -EINVAL;
+    if ((uint64_t)header->groups * header->inodes_group < header->inodes_total) return -EINVAL;
+    return SUCCESS;
+}
+
+void fs_init_locks(fs_fs *fs) {
+    RWLOCK_INIT(&fs->ns_lock);
+    for (size_t i = 0; i < FS_LOCK_STRIPES; i++) {
+        RWLOCK_INIT(&fs->ino_locks[i]);
+    }
+    MUTEX_INIT(&fs->alloc_lock);
+    MUTEX_INIT(&fs->ref_lock);
+}
+
+void fs_attach_raw(fs_fs *fs, void *raw, uint32_t block_size) {
+    _memset(&fs->journal, 0, sizeof(fs_journal));
+    fs->dcache = NULL;
+    fs->ccache = NULL;
+    fs->stats = NULL;
+    fs->sync = NULL;
+    fs->busy = NULL;
+    fs->block_size = block_size;
+    fs->raw = (uint8_t *)raw;
+    fs->dev = NULL;
+    fs->bcache = NULL;
+    fs->header = (fs_header *)raw;
+}
+
+// The header block stays pinned for as long as the fs is attached. bcache
+// is zeroed before its first use and keeps its slots from one attach to
+// the next if the block size stays the same.
+int32_t fs_attach_dev(fs_fs *fs, fs_dev *dev, fs_bcache *bcache, uint32_t block_size) {
+    _memset(&fs->journal, 0, sizeof(fs_journal));
+    fs->dcache = NULL;
+    fs->ccache = NULL;
+    fs->stats = NULL;
+    fs->sync = NULL;
+    fs->busy = NULL;
+    fs->block_size = block_size;
+    fs->raw = NULL;
+    fs->dev = dev;
+    fs->bcache = bcache;
+    ERR(fs_bcache_init(bcache, block_size));
+    fs->header = (fs_header *)fs_bget(fs, 0);
+    PIN(fs->header);
+    return SUCCESS;
+}
+
+// formats an image of size bytes, see fs_format
+int32_t fs_create(fs_fs *fs, void *raw, uint64_t size, uint32_t block_size) {
+    if (!fs_block_size_valid(block_size)) return -EINVAL;
+    fs_init_locks(fs);
+    fs_attach_raw(fs, raw, block_size);
+    return fs_format(fs, size);
+}
+
+// Attaches to an already formatted image of size bytes. Only the header
+// and a pending journal transaction are read, so the time taken does not
+// depend on the image size. Writes to a mapped image are not journaled.
+int32_t fs_open_raw(fs_fs *fs, void *raw, uint64_t size) {
+    fs_header *header = (fs_header *)raw;
+    ERR(fs_check_header(header, size));
+    fs_init_locks(fs);
+    fs_attach_raw(fs, raw, header->block_size);
+    fs_layout(fs);
+    fs_journal_init(fs);
+    ERR(fs_journal_replay(fs));
+    fs->journal.capacity = 0;
+    return SUCCESS;
+}
+
+// like fs_open_raw, then finishes reclaiming the orphans left by a crash
+int32_t fs_mount(fs_fs *fs, void *raw, uint64_t size) {
+    ERR(fs_open_raw(fs, raw, size));
+    return fs_reclaim_all(fs);
+}
+
+// the journal is enabled once the formatted image is on the device
+int32_t fs_create_dev(fs_fs *fs, fs_dev *dev, fs_bcache *bcache, uint64_t size, uint32_t block_size) {
+    if (!fs_block_size_valid(block_size)) return -EINVAL;
+    fs_init_locks(fs);
+    ERR(fs_attach_dev(fs, dev, bcache, block_size));
+    ERR(fs_format(fs, size));
+    fs_bdirty(fs, fs->header);
+    ERR(fs_bflush(fs));
+    fs_journal_init(fs);
+    return SUCCESS;
+}
+
+// Like fs_mount. The header fits into the smallest block size, so it is
+// read with that first. Replaying the journal drops everything cached.
+int32_t fs_mount_dev(fs_fs *fs, fs_dev *dev, fs_bcache *bcache, uint64_t size) {
+    fs_init_locks(fs);
+    ERR(fs_attach_dev(fs, dev, bcache, FS_BLOCK_SIZE_MIN));
+    ERR(fs_check_header(fs->header, size));
+    uint32_t block_size = fs->header->block_size;
+    if (block_size != FS_BLOCK_SIZE_MIN) ERR(fs_attach_dev(fs, dev, bcache, block_size));
+    fs_layout(fs);
+    fs_journal_init(fs);
+
+    int32_t replayed = fs_journal_replay(fs);
+    ERR(replayed);
+    if (replayed > 0) {
+        ERR(fs_attach_dev(fs, dev, bcache, block_size));
+        fs_layout(fs);
+        fs_journal_init(fs);
+    }
+    return fs_reclaim_all(fs);
+}
+
+// commits the journal and writes back every dirty buffer before running
+// the image's own sync
+int32_t fs_sync(fs_fs *fs) {
+    if (fs->raw == NULL) {
+        if (fs->journal.capacity == 0) fs_bdirty(fs, fs->header);
+        ERR(fs_bflush(fs));
+    }
+    if (fs->sync == NULL) return SUCCESS;
+    return fs->sync(fs);
+}
+
+mode_t fs_mode_to_unix(uint16_t mode) {
+    uint32_t file_type = mode & (S_IFMT >> 3);
+    uint32_t file_mode = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+    return file_mode | (file_type << 3);
 }
 
-int32_t fs_path_to_parent_ino_rel(fs_fs *fs, const char *path, int32_t ino) {
-    char name[FS_NAME_LEN_MAX];
-    if (*path == '/') path++;
-
-    for (const char *ptr = path; *ptr != '\0'; ptr++) {
-        if (*ptr != '/') continue;
-        size_t len = ptr - path;
-        _memcpy(name, path, len);
-        *(name + len) = '\0';
-        ino = fs_name_to_ino(fs, ino, name);
-        CHECK_INO(ino);
-        ptr++;
-        path = ptr;
-    }
-    return ino;
+int16_t fs_mode_to_sfs(mode_t mode) {
+    uint32_t file_type = mode & S_IFMT;
+    uint32_t file_mode = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+    return file_mode | (file_type >> 3);
 }
 
-int32_t fs_path_to_parent_ino(fs_fs *fs, const char *path) {
-    return fs_path_to_parent_ino_rel(fs, path, fs->header->root_ino);
+// Lock held until the end of the scope it is declared in. A modifying
+// operation reserves its journal credits before it takes the lock, and
+// releasing the lock lets the journal commit a batch.
+typedef struct sfs_lock {
+    sys_rwlock *lock;
+    bool tick;
+} sfs_lock;
+
+static inline sfs_lock sfs_lock_take(sys_rwlock *lock, bool exclusive, bool tick) {
+    if (tick) fs_journal_begin(FS);
+    if (exclusive) RWLOCK_WRITE(lock);
+    else RWLOCK_READ(lock);
+    return (sfs_lock){ lock, tick };
 }
 
-const char *fs_path_get_name(const char *path) {
-    size_t len = _strlen(path);
-    for (const char *ptr = path + len - 1; ptr >= path; ptr--) {
-        if (*ptr == '/') return ptr + 1;
+static inline void sfs_lock_release(sfs_lock *lock) {
+    RWLOCK_UNLOCK(lock->lock);
+    if (!lock->tick) return;
+    fs_journal_end(FS);
+#ifndef SFS_THREADS
+    // without the reclaimer thread every modifying operation frees a batch
+    uint32_t ino = fs_orphan_first(FS);
+    if (ino != INO_INVALID) {
+        fs_journal_begin(FS);
+        fs_reclaim(FS, ino);
+        fs_journal_end(FS);
     }
-    return NULL;
+#endif
+    fs_journal_tick(FS);
 }
 
-int32_t fs_path_to_ino_rel(fs_fs *fs, const char *path, uint16_t ino) {
-    int32_t parent_ino = fs_path_to_parent_ino_rel(fs, path, ino);
-    CHECK_INO(parent_ino);
+#define SFS_LOCK(name, lock, exclusive, tick) \
+sfs_lock name __attribute__((cleanup(sfs_lock_release))) = sfs_lock_take(lock, exclusive, tick)
 
-    const char *name = fs_path_get_name(path);
-    if (name == NULL) return -EINVAL;
+#define SFS_READ() SFS_LOCK(op_lock, &FS->ns_lock, false, false)
+#define SFS_WRITE() SFS_LOCK(op_lock, &FS->ns_lock, false, true)
+#define SFS_NAMESPACE() SFS_LOCK(op_lock, &FS->ns_lock, true, true)
+#define SFS_INODE(ino, exclusive) \
+SFS_LOCK(ino_lock, &FS->ino_locks[(ino) % FS_LOCK_STRIPES], exclusive, false)
 
-    return fs_name_to_ino(fs, parent_ino, name);
+static inline sfs_file *sfs_get_file(struct fuse_file_info *fi) {
+    if (fi == NULL) return NULL;
+    return (sfs_file *)(uintptr_t)fi->fh;
 }
 
-int32_t fs_path_to_ino(fs_fs *fs, const char *path) {
-    if (*path != '/') return -EINVAL;
-    return fs_path_to_ino_rel(fs, path, fs->header->root_ino);
+// uses the inode of an open handle and only falls back to the path without one
+int32_t sfs_file_ino(const char *path, struct fuse_file_info *fi) {
+    sfs_file *file = sfs_get_file(fi);
+    if (file != NULL) return file->ino;
+    return fs_path_to_ino(FS, path);
 }
 
-void fs_init_blocks(fs_fs *fs) {
-    size_t size = fs->header->blocks_total;
-
-    fs->header->free_blk = 1;
-    for (size_t i = 1; i < size - 1; i++) {
-        fs->blocks[i].free.next = i + 1;
-    }
-    fs->blocks[BLK_INVALID].free.next = BLK_INVALID;
-    fs->blocks[size - 1].free.next = BLK_INVALID;
+// Small writes are collected per handle and passed on together. At most
+// one handle of an inode holds pending data, which is only touched with
+// the inode locked exclusively, or shared to read it. The list of such
+// handles has its own lock, taken after the inode.
+sfs_file *sfs_wbuf_list;
+sys_mutex sfs_wbuf_lock = MUTEX_INITIALIZER;
+
+sfs_file *sfs_wbuf_find(uint32_t ino) {
+    MUTEX_LOCK(&sfs_wbuf_lock);
+    sfs_file *file = sfs_wbuf_list;
+    while (file != NULL && file->ino != ino) file = file->wnext;
+    MUTEX_UNLOCK(&sfs_wbuf_lock);
+    return file;
 }
 
-void fs_init_inodes(fs_fs *fs) {
-    size_t size = fs->header->inodes_total;
+// end of the pending data of ino, 0 without any
+uint64_t sfs_wbuf_end(uint32_t ino) {
+    sfs_file *file = sfs_wbuf_find(ino);
+    return file != NULL ? file->woff + file->wlen : 0;
+}
 
-    fs->header->free_ino = 2;
-    for (size_t i = fs->header->free_ino; i < size - 1; i++) {
-        fs_get_inode(fs, i)->ino = i + 1;
-    }
-    fs->inodes[INO_INVALID].ino = INO_INVALID;
-    fs_get_inode(fs, size - 1)->ino = INO_INVALID;
+// Pending data that cannot be written is dropped and the error sticks to
+// the handle that wrote it, to be returned once from its next flush, fsync
+// or release, whoever passed the data on.
+void sfs_wbuf_flush(sfs_file *file) {
+    MUTEX_LOCK(&sfs_wbuf_lock);
+    sfs_file **link = &sfs_wbuf_list;
+    while (*link != NULL && *link != file) link = &(*link)->wnext;
+    if (*link != NULL) *link = file->wnext;
+    MUTEX_UNLOCK(&sfs_wbuf_lock);
+    if (file->wlen == 0) return;
+
+    uint32_t len = file->wlen;
+    file->wlen = 0;
+    int32_t written = fs_ino_pwrite(FS, file->ino, file->wbuf, len, file->woff);
+    int32_t err = written < 0 ? written : (uint32_t)written == len ? SUCCESS : -ENOSPC;
+    if (err < 0) ATOMIC_STORE(&file->werr, err);
 }
 
-void fs_create(fs_fs *fs, fs_block *raw, size_t size) {
-    _memset(raw, 0, size);
+// takes the sticky error of the handle
+int32_t sfs_wbuf_error(sfs_file *file) {
+    int32_t werr = ATOMIC_LOAD(&file->werr);
+    if (werr != SUCCESS) ATOMIC_STORE(&file->werr, SUCCESS);
+    return werr;
+}
 
-    fs->header = (fs_header *)raw;
+// passes on the pending data of ino, the caller holds it exclusively
+void sfs_wbuf_flush_ino(uint32_t ino) {
+    sfs_file *file = sfs_wbuf_find(ino);
+    if (file != NULL) sfs_wbuf_flush(file);
+}
 
-    fs->header->blocks_all = size;
-    fs->header->blocks_header = 1;    // depends on sizeof(fs_header)
-    fs->header->blocks_inode = 64;
-    fs->header->inodes = 1;
-    fs->header->inodes_total = fs->header->blocks_inode * 8 * 2;
-    fs->header->blocks = 0;
-    fs->header->blocks_total = fs->header->blocks_all - fs->header->blocks_inode;
+// for operations that only hold ino shared, before they take their locks
+void sfs_wbuf_sync(uint32_t ino) {
+    if (sfs_wbuf_find(ino) == NULL) return;
+    SFS_WRITE();
+    SFS_INODE(ino, true);
+    sfs_wbuf_flush_ino(ino);
+}
 
-    fs->header->header_size = sizeof(fs_header);
-    fs->header->inode_size = sizeof(fs_inode);
-    fs->header->block_size = sizeof(fs_block);
-    fs->header->blockp_len = fs->header->block_size / sizeof(uint16_t);
-    fs->header->name_max = FS_PATH_LEN_MAX;
+// Appends to the pending data if the write continues it and fits, or
+// else passes on what is pending and starts over at offset.
+int32_t sfs_wbuf_write(sfs_file *file, const void *buffer, size_t size, size_t offset) {
+    if (size == 0) return 0;
+    bool append = file->wlen > 0 && offset == file->woff + file->wlen
+        && file->wlen + size <= SFS_WBUF_SIZE;
+    if (!append) {
+        sfs_wbuf_flush_ino(file->ino);
+        if (file->wbuf == NULL) file->wbuf = (uint8_t *)malloc(SFS_WBUF_SIZE);
+        if (file->wbuf == NULL) return fs_ino_pwrite(FS, file->ino, buffer, size, offset);
+        file->woff = offset;
+        MUTEX_LOCK(&sfs_wbuf_lock);
+        file->wnext = sfs_wbuf_list;
+        sfs_wbuf_list = file;
+        MUTEX_UNLOCK(&sfs_wbuf_lock);
+    }
+    _memcpy(file->wbuf + file->wlen, buffer, size);
+    file->wlen += size;
+    return size;
+}
 
-    fs->header->max_ino = fs->header->inodes_total - 1;
-   
-    uint16_t root_ino = 1;
-    fs->header->root_ino = root_ino;
+// Virtual files in the root directory. Stats are kept from the first open
+// of the stats file on, which is empty until then, and the trace file only
+// exists if tracing is compiled in. Their contents are rendered when they
+// are opened, truncating the stats file resets the counters.
+static inline uint32_t sfs_virtual_at(uint32_t parent_ino, const char *name) {
+    if (parent_ino != FS->header->root_ino) return SFS_VIRTUAL_NONE;
+    if (_strcmp(name, FS_STATS_PATH + 1) == 0) return SFS_VIRTUAL_STATS;
+    if (SFS_TRACE > 0 && _strcmp(name, TRACE_PATH + 1) == 0) return SFS_VIRTUAL_TRACE;
+    return SFS_VIRTUAL_NONE;
+}
 
-    fs->inodes = (fs_inode *)(raw + fs->header->blocks_header);
-    fs->blocks = (fs_block *)fs->inodes  + fs->header->blocks_inode;
+static inline uint32_t sfs_virtual(const char *path) {
+    if (path[0] != '/') return SFS_VIRTUAL_NONE;
+    return sfs_virtual_at(FS->header->root_ino, path + 1);
+}
 
-    fs_init_blocks(fs);
-    fs_init_inodes(fs);
-    
-    // create root inode
-    fs_init_inode(fs, root_ino, (S_IFDIR >> 3));
-    fs_ino_link(fs, root_ino, root_ino, ".");
-    fs_ino_link(fs, root_ino, root_ino, "..");
+static inline uint32_t sfs_virtual_file(struct fuse_file_info *fi) {
+    sfs_file *file = sfs_get_file(fi);
+    return file != NULL ? file->kind : SFS_VIRTUAL_NONE;
 }
 
-mode_t fs_mode_to_unix(uint16_t mode) {
-    uint32_t file_type = mode & (S_IFMT >> 3);
-    uint32_t file_mode = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
-    return file_mode | (file_type << 3);
+size_t sfs_virtual_render(uint32_t kind, char *buffer, size_t size) {
+    if (kind == SFS_VIRTUAL_STATS) {
+        if (ATOMIC_ACQUIRE(&FS->stats) == NULL) return 0;
+        size_t len = fs_stats_print(FS, buffer, size);
+        return size > 0 ? MIN(len, size - 1) : len;
+    }
+#if SFS_TRACE > 0
+    if (buffer == NULL) return trace_snapshot_size();
+    return trace_snapshot(buffer, size);
+#else
+    return 0;
+#endif
 }
 
-int16_t fs_mode_to_sfs(mode_t mode) {
-    uint32_t file_type = mode & S_IFMT;
-    uint32_t file_mode = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
-    return file_mode | (file_type >> 3);
+int32_t sfs_virtual_stat(uint32_t kind, struct stat *st) {
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = sfs_virtual_render(kind, NULL, 0);
+    st->st_atime = st->st_ctime = st->st_mtime = time(NULL);
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    return SUCCESS;
 }
 
-int32_t sfs_getattr(const char *path, struct stat *st) {
-    int32_t ino = fs_path_to_ino(FS, path);
-    CHECK_INO(ino);
+int32_t sfs_virtual_truncate(uint32_t kind) {
+    if (kind != SFS_VIRTUAL_STATS) return -EACCES;
+    fs_stats_reset(FS);
+    return SUCCESS;
+}
 
+int32_t sfs_stat(uint32_t ino, struct stat *st) {
     fs_inode *inode = fs_get_inode(FS, ino);
+    PIN(inode);
     st->st_mode = fs_mode_to_unix(inode->mode);
     st->st_nlink = inode->refs;
-    st->st_size = inode->size;
+    st->st_size = MAX(inode->size, sfs_wbuf_end(ino));
     st->st_atime = inode->time;
     st->st_ctime = inode->time;
     st->st_mtime = inode->time;
     st->st_uid = USE_CURRENT_USER ? getuid() : inode->uid;
     st->st_gid = USE_CURRENT_USER ? getgid() : inode->gid;
 
+    fs_put_inode(FS, inode, false);
     return SUCCESS;
 }
 
-int32_t sfs_readlink(const char *path, char *buffer, size_t size) {
-    size_t len = _strlen(path);
-    if (len > size) return -ENAMETOOLONG;
-    _memcpy(buffer, path, len);
+int32_t sfs_getattr(const char *path, struct stat *st) {
+    FS_STAT(FS, SFS_OP_GETATTR);
+    uint32_t kind = sfs_virtual(path);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_virtual_stat(kind, st);
+    SFS_READ();
+    int32_t ino = fs_path_to_ino(FS, path);
+    CHECK_INO(ino);
+    SFS_INODE(ino, false);
+    return sfs_stat(ino, st);
+}
+
+int32_t sfs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_GETATTR);
+    uint32_t kind = sfs_virtual_file(fi);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_virtual_stat(kind, st);
+    SFS_READ();
+    int32_t ino = sfs_file_ino(path, fi);
+    CHECK_INO(ino);
+    SFS_INODE(ino, false);
+    return sfs_stat(ino, st);
+}
+
+// short targets are inline, so this needs no block reads
+int32_t sfs_ino_readlink(uint32_t ino, char *buffer, size_t size) {
+    fs_inode *inode = fs_get_inode(FS, ino);
+    PIN(inode);
+    bool islnk = fs_mode_islnk(inode->mode);
+    fs_put_inode(FS, inode, false);
+    if (!islnk || size == 0) return -EINVAL;
+
+    int32_t len = fs_ino_pread(FS, ino, buffer, size - 1, 0);
+    if (len < 0) return len;
+    buffer[len] = '\0';
     return SUCCESS;
 }
 
-int32_t sfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    UNUSED(dev);
+int32_t sfs_readlink(const char *path, char *buffer, size_t size) {
+    FS_STAT(FS, SFS_OP_READLINK);
+    SFS_READ();
+    int32_t ino = fs_path_to_ino(FS, path);
+    CHECK_INO(ino);
+    SFS_INODE(ino, false);
+    return sfs_ino_readlink(ino, buffer, size);
+}
 
+int32_t sfs_symlink(const char *target, const char *path) {
+    FS_STAT(FS, SFS_OP_SYMLINK);
+    if (sfs_virtual(path) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
     int32_t parent_ino = fs_path_to_parent_ino(FS, path);
     CHECK_INO(parent_ino);
 
     const char *name = fs_path_get_name(path);
     if (name == NULL) return -EINVAL;
 
+    ERR(fs_ino_symlink(FS, parent_ino, name, target));
+    return SUCCESS;
+}
+
+// creates a regular file and returns its ino
+int32_t sfs_make_file_at(uint32_t parent_ino, const char *name, mode_t mode) {
+    if (sfs_virtual_at(parent_ino, name) != SFS_VIRTUAL_NONE) return -EEXIST;
     int32_t file_mode = fs_mode_to_sfs((mode & (S_IRWXU | S_IRWXG | S_IRWXO)) | S_IFREG);
-    ERR(fs_ino_mknod(FS, parent_ino, name, file_mode));
+    return fs_ino_mknod(FS, parent_ino, name, file_mode);
+}
+
+int32_t sfs_make_file(const char *path, mode_t mode) {
+    int32_t parent_ino = fs_path_to_parent_ino(FS, path);
+    CHECK_INO(parent_ino);
+
+    const char *name = fs_path_get_name(path);
+    if (name == NULL) return -EINVAL;
+    return sfs_make_file_at(parent_ino, name, mode);
+}
+
+int32_t sfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    FS_STAT(FS, SFS_OP_MKNOD);
+    SFS_NAMESPACE();
+    UNUSED(dev);
+    ERR(sfs_make_file(path, mode));
     return SUCCESS;
 }
 
 int32_t sfs_mkdir(const char *path, mode_t mode) {
+    FS_STAT(FS, SFS_OP_MKDIR);
+    if (sfs_virtual(path) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
     int32_t parent_ino = fs_path_to_parent_ino(FS, path);
     CHECK_INO(parent_ino);
 
@@ -636,40 +4156,38 @@ int32_t sfs_mkdir(const char *path, mode_t mode) {
 }
 
 int32_t sfs_unlink(const char *path) {
+    FS_STAT(FS, SFS_OP_UNLINK);
+    SFS_NAMESPACE();
     int32_t parent_ino = fs_path_to_parent_ino(FS, path);
     CHECK_INO(parent_ino);
 
-    int32_t ino = fs_path_to_ino(FS, path);
-    CHECK_INO(ino);
-    if (fs_ino_isdir(FS, ino)) return -EISDIR;
-    
     const char *name = fs_path_get_name(path);
     if (name == NULL) return -EINVAL;
 
+    int32_t ino = fs_name_to_ino(FS, parent_ino, name);
+    CHECK_INO(ino);
+    if (fs_ino_isdir(FS, ino)) return -EISDIR;
+
+    sfs_wbuf_flush_ino(ino);
     return fs_ino_unlink(FS, parent_ino, name);
 }
 
 int32_t sfs_rmdir(const char *path) {
-    int32_t ino = fs_path_to_ino(FS, path);
-    CHECK_INO(ino);
-    if (!fs_ino_isdir(FS, ino)) return -ENOTDIR;
+    FS_STAT(FS, SFS_OP_RMDIR);
+    SFS_NAMESPACE();
+    int32_t parent_ino = fs_path_to_parent_ino(FS, path);
+    CHECK_INO(parent_ino);
 
     const char *name = fs_path_get_name(path);
     if (name == NULL) return -EINVAL; 
-    
-    READDIR(FS, ino);
-    fs_dentry *dentry = fs_dir_entry(&dir);
-    while (dentry != NULL) {
-        if (_strcmp(&dentry->name, ".") && _strcmp(&dentry->name, "..")) return -ENOTEMPTY;
-        dentry = fs_dir_next(&dir);
-    }
 
-    int32_t parent_ino = fs_path_to_parent_ino(FS, path);
-    CHECK_INO(parent_ino);
-    return fs_ino_unlink(FS, parent_ino, name);
+    return fs_ino_rmdir(FS, parent_ino, name);
 }
 
 int32_t sfs_rename(const char *src, const char *dest) {
+    FS_STAT(FS, SFS_OP_RENAME);
+    if (sfs_virtual(dest) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
     int32_t src_parent_ino = fs_path_to_parent_ino(FS, src);
     CHECK_INO(src_parent_ino);
 
@@ -689,32 +4207,230 @@ int32_t sfs_rename(const char *src, const char *dest) {
     return fs_ino_unlink(FS, src_parent_ino, src_name);
 }
 
-int32_t sfs_chmod(const char *path, mode_t mode) {
-    int32_t ino = fs_path_to_ino(FS, path);
-    CHECK_INO(ino);
+// attribute changes, the caller holds the inode exclusively
+int32_t sfs_ino_chmod(uint32_t ino, mode_t mode) {
+    fs_inode *inode = fs_get_inode(FS, ino);
+    PIN(inode);
+    inode->mode = (inode->mode & FS_MODE_FLAGS) | fs_mode_to_sfs(mode);
+    fs_put_inode(FS, inode, true);
+    return SUCCESS;
+}
+
+int32_t sfs_ino_chown(uint32_t ino, uid_t uid, gid_t gid) {
+    fs_inode *inode = fs_get_inode(FS, ino);
+    PIN(inode);
+    inode->uid = uid;
+    inode->gid = gid;
+    fs_put_inode(FS, inode, true);
+    return SUCCESS;
+}
 
+int32_t sfs_ino_utime(uint32_t ino, time_t sec) {
     fs_inode *inode = fs_get_inode(FS, ino);
-    inode->mode = fs_mode_to_sfs(mode);
+    PIN(inode);
+    inode->time = sec;
+    fs_put_inode(FS, inode, true);
     return SUCCESS;
 }
 
+// FS_IOC_GETFLAGS and SETFLAGS, of which only FS_COMPR_FL is kept
+int32_t sfs_ino_getflags(uint32_t ino) {
+    return fs_ino_compressed(FS, ino) ? FS_COMPR_FL : 0;
+}
+
+int32_t sfs_ino_setflags(uint32_t ino, uint32_t flags) {
+    if (flags & ~FS_COMPR_FL) return -EOPNOTSUPP;
+    sfs_wbuf_flush_ino(ino);
+    return fs_ino_compress(FS, ino, flags & FS_COMPR_FL);
+}
+
+int32_t sfs_chmod(const char *path, mode_t mode) {
+    FS_STAT(FS, SFS_OP_CHMOD);
+    SFS_WRITE();
+    int32_t ino = fs_path_to_ino(FS, path);
+    CHECK_INO(ino);
+    SFS_INODE(ino, true);
+    return sfs_ino_chmod(ino, mode);
+}
+
 int32_t sfs_chown(const char *path, uid_t uid, gid_t gid) {
+    FS_STAT(FS, SFS_OP_CHOWN);
+    SFS_WRITE();
     int32_t ino = fs_path_to_ino(FS, path);
     CHECK_INO(ino);
+    SFS_INODE(ino, true);
+    return sfs_ino_chown(ino, uid, gid);
+}
 
-    fs_inode *inode = fs_get_inode(FS, ino);
-    inode->uid = uid;
-    inode->gid = gid;
-    return SUCCESS;
+// shrinking a large file leaves most of its blocks to the reclaimer
+int32_t sfs_ino_truncate(uint32_t ino, off_t offset) {
+    if (offset < 0) return -EINVAL;
+    sfs_wbuf_flush_ino(ino);
+    uint64_t lblk = DIV_CEIL((uint64_t)offset, FS->header->block_size);
+    int32_t err = lblk <= UINT32_MAX ? fs_ino_detach(FS, ino, lblk, FS_RECLAIM_BATCH) : SUCCESS;
+    if (err < 0 && err != -ENOSPC) return err;
+    return fs_ino_truncate(FS, ino, offset);
 }
 
 int32_t sfs_truncate(const char *path, off_t offset) {
+    FS_STAT(FS, SFS_OP_TRUNCATE);
+    uint32_t kind = sfs_virtual(path);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_virtual_truncate(kind);
+    SFS_WRITE();
     int32_t ino = fs_path_to_ino(FS, path);
     CHECK_INO(ino);
-    return fs_ino_truncate(FS, ino, offset);
+    SFS_INODE(ino, true);
+    return sfs_ino_truncate(ino, offset);
+}
+
+int32_t sfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_TRUNCATE);
+    uint32_t kind = sfs_virtual_file(fi);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_virtual_truncate(kind);
+    SFS_WRITE();
+    int32_t ino = sfs_file_ino(path, fi);
+    CHECK_INO(ino);
+    SFS_INODE(ino, true);
+    return sfs_ino_truncate(ino, offset);
+}
+
+int32_t sfs_open_ino(uint32_t ino, struct fuse_file_info *fi) {
+    sfs_file *file = (sfs_file *)malloc(sizeof(sfs_file));
+    if (file == NULL) return -ENOMEM;
+
+    file->ino = ino;
+    file->flags = fi->flags;
+    file->kind = SFS_VIRTUAL_NONE;
+    file->text = NULL;
+    file->text_size = 0;
+    file->next = 0;
+    file->ahead = 0;
+    file->fetched = 0;
+    file->wbuf = NULL;
+    file->woff = 0;
+    file->wlen = 0;
+    file->werr = SUCCESS;
+    file->wnext = NULL;
+    fi->fh = (uintptr_t)file;
+    return SUCCESS;
+}
+
+// reads bypass the page cache, so every open sees a fresh snapshot
+int32_t sfs_open_virtual(uint32_t kind, struct fuse_file_info *fi) {
+    if (kind == SFS_VIRTUAL_STATS) ERR(fs_stats_enable(FS));
+    size_t size = kind == SFS_VIRTUAL_STATS ? FS_STATS_TEXT_MAX : sfs_virtual_render(kind, NULL, 0);
+    char *text = (char *)malloc(size);
+    if (text == NULL) return -ENOMEM;
+    int32_t err = sfs_open_ino(INO_INVALID, fi);
+    if (err < 0) {
+        free(text);
+        return err;
+    }
+
+    sfs_file *file = sfs_get_file(fi);
+    file->kind = kind;
+    file->text = text;
+    file->text_size = sfs_virtual_render(kind, text, size);
+    fi->direct_io = 1;
+    return SUCCESS;
+}
+
+int32_t sfs_open(const char *path, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_OPEN);
+    uint32_t kind = sfs_virtual(path);
+    if (kind != SFS_VIRTUAL_NONE) return sfs_open_virtual(kind, fi);
+    SFS_READ();
+    int32_t ino = fs_path_to_ino(FS, path);
+    CHECK_INO(ino);
+    if (fs_ino_isdir(FS, ino)) return -EISDIR;
+    return sfs_open_ino(ino, fi);
+}
+
+int32_t sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_CREATE);
+    SFS_NAMESPACE();
+    int32_t ino = sfs_make_file(path, mode);
+    CHECK_INO(ino);
+    return sfs_open_ino(ino, fi);
+}
+
+int32_t sfs_flush(const char *path, struct fuse_file_info *fi) {
+    UNUSED(path);
+    sfs_file *file = sfs_get_file(fi);
+    if (file == NULL || file->kind != SFS_VIRTUAL_NONE) return SUCCESS;
+    sfs_wbuf_sync(file->ino);
+    return sfs_wbuf_error(file);
+}
+
+int32_t sfs_fsync(const char *path, int32_t datasync, struct fuse_file_info *fi) {
+    FS_STAT(FS, SFS_OP_FSYNC);
+    SFS_NAMESPACE();
+    UNUSED(path);
+    UNUSED(datasync);
+    sfs_file *file = sfs_get_file(fi);
+    if (file != NULL && file->kind == SFS_VIRTUAL_NONE) {
+        sfs_wbuf_flush_ino(file->ino);
+        ERR(sfs_wbuf_error(file));
+    }
+    return fs_sync(FS);
+}
+
+// The flags are passed as an int, whatever size the request number says.
+int32_t sfs_ioctl_flags(const char *path, unsigned int request, struct fuse_file_info *fi, void *data) {
+    bool set = request == FS_IOC_SETFLAGS;
+    SFS_LOCK(op_lock, &FS->ns_lock, false, set);
+    int32_t ino = sfs_file_ino(path, fi);
+    CHECK_INO(ino);
+    SFS_INODE(ino, set);
+    if (set) return sfs_ino_setflags(ino, *(uint32_t *)data);
+
+    int32_t flags = sfs_ino_getflags(ino);
+    if (flags < 0) return flags;
+    *(uint32_t *)data = flags;
+    return SUCCESS;
+}
+
+int32_t sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    FS_STAT(FS, SFS_OP_IOCTL);
+    UNUSED(arg);
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+    unsigned int request = cmd;
+    bool attr = request == FS_IOC_GETFLAGS || request == FS_IOC_SETFLAGS;
+    if (request != SFS_IOC_CLONE && !attr) return -ENOTTY;
+    if (sfs_virtual_file(fi) != SFS_VIRTUAL_NONE) return -EACCES;
+    if (attr) return sfs_ioctl_flags(path, request, fi, data);
+
+    sfs_clone_arg *clone = (sfs_clone_arg *)data;
+    clone->src[SFS_CLONE_PATH_MAX - 1] = '\0';
+    SFS_NAMESPACE();
+    int32_t src_ino = fs_path_to_ino(FS, clone->src);
+    CHECK_INO(src_ino);
+    int32_t ino = sfs_file_ino(path, fi);
+    CHECK_INO(ino);
+    sfs_wbuf_flush_ino(src_ino);
+    sfs_wbuf_flush_ino(ino);
+    return fs_ino_clone(FS, src_ino, ino);
+}
+
+int32_t sfs_release(const char *path, struct fuse_file_info *fi) {
+    UNUSED(path);
+    sfs_file *file = sfs_get_file(fi);
+    int32_t err = SUCCESS;
+    if (file != NULL && file->kind == SFS_VIRTUAL_NONE) {
+        sfs_wbuf_sync(file->ino);
+        err = sfs_wbuf_error(file);
+        free(file->wbuf);
+    }
+    if (file != NULL) free(file->text);
+    free(file);
+    fi->fh = 0;
+    return err;
 }
 
 int32_t sfs_link(const char *dest, const char *src) {
+    FS_STAT(FS, SFS_OP_LINK);
+    if (sfs_virtual(src) != SFS_VIRTUAL_NONE) return -EEXIST;
+    SFS_NAMESPACE();
     int32_t dest_ino = fs_path_to_ino(FS, dest);
     CHECK_INO(dest_ino);
 
@@ -727,18 +4443,126 @@ int32_t sfs_link(const char *dest, const char *src) {
     return fs_ino_link(FS, src_parent_ino, dest_ino, name);
 }
 
+int32_t sfs_prefetch(uint32_t ino, uint32_t lblk, uint32_t count) {
+    SFS_READ();
+    SFS_INODE(ino, false);
+    return fs_ino_prefetch(FS, ino, lblk, count);
+}
+
+#ifdef SFS_THREADS
+// a single pending request, a newer one replaces it
+typedef struct sfs_prefetch_req {
+    uint32_t ino;
+    uint32_t lblk;
+    uint32_t count;     // 0 if there is none
+} sfs_prefetch_req;
+
+pthread_t sfs_prefetcher;
+bool sfs_prefetcher_running;
+bool sfs_prefetcher_stop;
+sfs_prefetch_req sfs_prefetch_next;
+pthread_mutex_t sfs_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sfs_prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+void *sfs_prefetch_loop(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&sfs_prefetch_lock);
+    while (!sfs_prefetcher_stop) {
+        if (sfs_prefetch_next.count == 0) {
+            pthread_cond_wait(&sfs_prefetch_cond, &sfs_prefetch_lock);
+            continue;
+        }
+        sfs_prefetch_req req = sfs_prefetch_next;
+        sfs_prefetch_next.count = 0;
+        pthread_mutex_unlock(&sfs_prefetch_lock);
+        sfs_prefetch(req.ino, req.lblk, req.count);
+        pthread_mutex_lock(&sfs_prefetch_lock);
+    }
+    pthread_mutex_unlock(&sfs_prefetch_lock);
+    return NULL;
+}
+#endif
+
+// hands the blocks to the prefetcher, without it reading them now would
+// only delay the caller
+void sfs_prefetch_queue(uint32_t ino, uint32_t lblk, uint32_t count) {
+#ifdef SFS_THREADS
+    if (!sfs_prefetcher_running) return;
+    pthread_mutex_lock(&sfs_prefetch_lock);
+    sfs_prefetch_next = (sfs_prefetch_req){ ino, lblk, count };
+    pthread_cond_signal(&sfs_prefetch_cond);
+    pthread_mutex_unlock(&sfs_prefetch_lock);
+#else
+    UNUSED(ino);
+    UNUSED(lblk);
+    UNUSED(count);
+#endif
+}
+
+// Sequential reads of a handle double its prefetch window up to
+// SFS_PREFETCH_MAX bytes and a small share of the cache, any other read
+// resets it. Mapped images are
+// in memory already. Concurrent reads of one handle can only misjudge
+// the pattern.
+void sfs_readahead(sfs_file *file, uint32_t ino, size_t offset, size_t n) {
+    if (FS->raw != NULL) return;
+    uint64_t next = ATOMIC_LOAD(&file->next);
+    ATOMIC_STORE(&file->next, offset + n);
+    if (offset != next) {
+        ATOMIC_STORE(&file->ahead, 0);
+        ATOMIC_STORE(&file->fetched, 0);
+        return;
+    }
+
+    uint32_t ahead = ATOMIC_LOAD(&file->ahead);
+    uint32_t max = MIN(SFS_PREFETCH_MAX / FS->header->block_size, FS_BCACHE_SIZE / SFS_PREFETCH_SHARE);
+    ahead = ahead == 0 ? SFS_PREFETCH_MIN : MIN(ahead * 2, MAX(max, SFS_PREFETCH_MIN));
+    ATOMIC_STORE(&file->ahead, ahead);
+
+    uint32_t end = DIV_CEIL(offset + n, FS->header->block_size);
+    uint32_t from = MAX(end, ATOMIC_LOAD(&file->fetched));
+    if (from >= end + ahead) return;
+    ATOMIC_STORE(&file->fetched, end + ahead);
+    sfs_prefetch_queue(ino, from, end + ahead - from);
+}
+
+// Contents of a regular file, through an open handle if there is one.
+// The caller holds the inode, exclusively to write.
+int32_t sfs_file_pread(sfs_file *file, uint32_t ino, char *buffer, size_t size, off_t offset) {
+    int32_t read = fs_ino_pread(FS, ino, buffer, size, offset);
+    if (read > 0 && file != NULL) sfs_readahead(file, ino, offset, read);
+    return read;
+}
+
+int32_t sfs_file_pwrite(sfs_file *file, uint32_t ino, const char *buffer, size_t size, off_t offset) {
+    if (file != NULL && size < SFS_WBUF_SIZE) return sfs_wbuf_write(file, buffer, size, offset);
+    sfs_wbuf_flush_ino(ino);
+    return fs_ino_pwrite(FS, ino, buffer, size, offset);
+}
+
 int32_t sfs_read(
     const char *path, char *buffer,
     size_t size,
     off_t offset,
     struct fuse_file_info *fi
 ) {
-    UNUSED(offset);
-    UNUSED(fi);
+    FS_STAT(FS, SFS_OP_READ);
+    sfs_file *file = sfs_get_file(fi);
+    if (file != NULL && file->kind != SFS_VIRTUAL_NONE) {
+        size_t pos = offset;
+        size_t n = pos < file->text_size ? MIN(size, file->text_size - pos) : 0;
+        if (n > 0) _memcpy(buffer, file->text + pos, n);
+        return n;
+    }
+    if (file != NULL) sfs_wbuf_sync(file->ino);
 
-    int32_t ino = fs_path_to_ino(FS, path);
+    SFS_READ();
+    int32_t ino = sfs_file_ino(path, fi);
     CHECK_INO(ino);
-    return fs_ino_read(FS, ino, buffer, size);
+    SFS_INODE(ino, false);
+    int32_t read = sfs_file_pread(file, ino, buffer, size, offset);
+    if (read > 0) op_stat.bytes = read;
+    return read;
 }
 
 int32_t sfs_write(
@@ -748,29 +4572,71 @@ int32_t sfs_write(
     off_t offset,
     struct fuse_file_info *fi
 ) {
-    UNUSED(offset);
-    UNUSED(fi);
+    FS_STAT(FS, SFS_OP_WRITE);
+    if (sfs_virtual_file(fi) != SFS_VIRTUAL_NONE) return -EACCES;
 
-    int32_t ino = fs_path_to_ino(FS, path);
+    SFS_WRITE();
+    int32_t ino = sfs_file_ino(path, fi);
     CHECK_INO(ino);
-    return fs_ino_write(FS, ino, buffer, size);
+    SFS_INODE(ino, true);
+    int32_t written = sfs_file_pwrite(sfs_get_file(fi), ino, buffer, size, offset);
+    if (written > 0) op_stat.bytes = written;
+    return written;
 }
 
 int32_t sfs_statfs(const char *path, struct statvfs *stfs) {
+    FS_STAT(FS, SFS_OP_STATFS);
+    SFS_READ();
     UNUSED(path);
     stfs->f_bsize = FS->header->block_size;
     stfs->f_frsize = FS->header->block_size;
     stfs->f_frsize = FS->header->block_size;
     stfs->f_blocks = FS->header->blocks_total;
-    stfs->f_bfree = FS->header->blocks_total - FS->header->blocks;
-    stfs->f_bavail = FS->header->blocks_total - FS->header->blocks;
+    stfs->f_bfree = FS->header->blocks_total - ATOMIC_LOAD(&FS->header->blocks);
+    stfs->f_bavail = stfs->f_bfree;
     stfs->f_files = FS->header->inodes_total;
-    stfs->f_ffree = FS->header->inodes_total - FS->header->inodes;
-    stfs->f_favail = FS->header->inodes_total - FS->header->inodes;
+    stfs->f_ffree = FS->header->inodes_total - ATOMIC_LOAD(&FS->header->inodes);
+    stfs->f_favail = stfs->f_ffree;
     stfs->f_namemax = FS->header->name_max;
     return SUCCESS;
 }
 
+// calls fill with every entry of the directory until it returns an error
+int32_t sfs_ino_readdir(uint32_t ino, int32_t (*fill)(void *ctx, const fs_dentry *dentry), void *ctx) {
+    if (!fs_ino_isdir(FS, ino)) return -ENOTDIR;
+
+    fs_dir_header *header = fs_dir_get_header(FS, ino);
+    if (header != NULL) {
+        fs_put_block(FS, header, false);
+        fs_dir_iter it = { .fs = FS, .ino = ino };
+        fs_dentry *dentry = fs_dir_iter_next(&it);
+        while (dentry != NULL) {
+            ERR(fill(ctx, dentry));
+            dentry = fs_dir_iter_next(&it);
+        }
+        return SUCCESS;
+    }
+
+    READDIR(FS, ino);
+    fs_dentry *dentry = fs_dir_entry(&dir);
+    while (dentry != NULL) {
+        ERR(fill(ctx, dentry));
+        dentry = fs_dir_next(&dir);
+    }
+    return SUCCESS;
+}
+
+typedef struct sfs_filler {
+    void *buffer;
+    fuse_fill_dir_t filler;
+} sfs_filler;
+
+int32_t sfs_fill_name(void *ctx, const fs_dentry *dentry) {
+    sfs_filler *f = (sfs_filler *)ctx;
+    f->filler(f->buffer, &dentry->name, NULL, 0);
+    return SUCCESS;
+}
+
 int32_t sfs_readdir(
     const char *path,
     void *b,
@@ -778,28 +4644,126 @@ int32_t sfs_readdir(
     off_t offset,
     struct fuse_file_info *fi
 ) {
+    FS_STAT(FS, SFS_OP_READDIR);
+    SFS_READ();
     UNUSED(offset);
     UNUSED(fi);
 
     int32_t ino = fs_path_to_ino(FS, path);
     CHECK_INO(ino);
+    sfs_filler ctx = { b, filler };
+    return sfs_ino_readdir(ino, sfs_fill_name, &ctx);
+}
 
-    READDIR(FS, ino);
-    fs_dentry *dentry = fs_dir_entry(&dir);
-    while (dentry != NULL) {
-        filler(b, &dentry->name, NULL, 0);
-        dentry = fs_dir_next(&dir);
+// One step of the reclaimer, locked like a modifying operation. Returns 1
+// while orphans remain.
+int32_t sfs_reclaim() {
+    SFS_WRITE();
+    uint32_t ino = fs_orphan_first(FS);
+    if (ino == INO_INVALID) return 0;
+    SFS_INODE(ino, true);
+    return fs_reclaim(FS, ino);
+}
+
+#ifdef SFS_THREADS
+pthread_t sfs_reclaimer;
+bool sfs_reclaimer_running;
+bool sfs_reclaimer_stop;
+
+void *sfs_reclaim_loop(void *arg) {
+    UNUSED(arg);
+    while (!__atomic_load_n(&sfs_reclaimer_stop, __ATOMIC_ACQUIRE)) {
+        if (sfs_reclaim() <= 0) usleep(FS_RECLAIM_IDLE * 1000);
     }
-    return SUCCESS;
+    return NULL;
+}
+#endif
+
+#ifdef SFS_THREADS
+pthread_t sfs_committer;
+bool sfs_committer_running;
+bool sfs_committer_stop;
+pthread_mutex_t sfs_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sfs_commit_cond = PTHREAD_COND_INITIALIZER;
+
+// Commits the batch of an idle mount once it is due. Without threads
+// batches are only committed at the end of an operation or at unmount.
+void *sfs_commit_loop(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&sfs_commit_lock);
+    while (!sfs_committer_stop) {
+        uint64_t ms = fs_journal_due(FS);
+        struct timespec at;
+        clock_gettime(CLOCK_REALTIME, &at);
+        at.tv_sec += ms / 1000;
+        at.tv_nsec += (ms % 1000) * 1000000;
+        if (at.tv_nsec >= 1000000000) {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&sfs_commit_cond, &sfs_commit_lock, &at);
+        if (sfs_committer_stop) break;
+        pthread_mutex_unlock(&sfs_commit_lock);
+        fs_journal_tick(FS);
+        pthread_mutex_lock(&sfs_commit_lock);
+    }
+    pthread_mutex_unlock(&sfs_commit_lock);
+    return NULL;
+}
+#endif
+
+void *sfs_init(struct fuse_conn_info *conn) {
+    // the kernel lowers these to what it supports, max_read is a mount option
+    conn->max_write = SFS_MAX_REQUEST;
+    conn->max_readahead = SFS_READAHEAD;
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+#ifdef SFS_THREADS
+    sfs_reclaimer_stop = false;
+    sfs_reclaimer_running = pthread_create(&sfs_reclaimer, NULL, sfs_reclaim_loop, NULL) == 0;
+    sfs_prefetcher_stop = false;
+    sfs_prefetcher_running = pthread_create(&sfs_prefetcher, NULL, sfs_prefetch_loop, NULL) == 0;
+    sfs_committer_stop = false;
+    sfs_committer_running = FS->journal.capacity > 0
+        && pthread_create(&sfs_committer, NULL, sfs_commit_loop, NULL) == 0;
+#endif
+    return NULL;
+}
+
+void sfs_destroy(void *private_data) {
+    UNUSED(private_data);
+#ifdef SFS_THREADS
+    if (sfs_reclaimer_running) {
+        __atomic_store_n(&sfs_reclaimer_stop, true, __ATOMIC_RELEASE);
+        pthread_join(sfs_reclaimer, NULL);
+    }
+    if (sfs_prefetcher_running) {
+        pthread_mutex_lock(&sfs_prefetch_lock);
+        sfs_prefetcher_stop = true;
+        pthread_cond_signal(&sfs_prefetch_cond);
+        pthread_mutex_unlock(&sfs_prefetch_lock);
+        pthread_join(sfs_prefetcher, NULL);
+    }
+    if (sfs_committer_running) {
+        pthread_mutex_lock(&sfs_commit_lock);
+        sfs_committer_stop = true;
+        pthread_cond_signal(&sfs_commit_cond);
+        pthread_mutex_unlock(&sfs_commit_lock);
+        pthread_join(sfs_committer, NULL);
+    }
+#endif
+    // like every commit, the last one excludes all operations
+    RWLOCK_WRITE(&FS->ns_lock);
+    fs_sync(FS);
+    RWLOCK_UNLOCK(&FS->ns_lock);
 }
 
 int32_t sfs_utimens(const char *path, const struct timespec tv[2]) {
+    FS_STAT(FS, SFS_OP_UTIMENS);
+    SFS_WRITE();
     int32_t ino = fs_path_to_ino(FS, path);
     CHECK_INO(ino);
-
-    fs_inode *inode = fs_get_inode(FS, ino);
-    inode->time = tv->tv_sec;
-    return SUCCESS;
+    SFS_INODE(ino, true);
+    return sfs_ino_utime(ino, tv->tv_sec);
 }
 
 #endif /* SFS_H */
@@ -1,18 +1,52 @@
+#ifndef SYS_H
+#define SYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-void _memcpy(void *dest, const void *src, size_t n) {
+// Freestanding memory and string routines. x86 uses SSE2 and, for large
+// copies and fills, AVX2 if it is enabled at build time or found through
+// CPUID. Other targets, or builds with -DSYS_SCALAR, copy a word at a time.
+#if !defined(SYS_SCALAR) && defined(__SSE2__)
+#define SYS_SSE2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// the string routines read whole words past the terminator, but never
+// across a page, which the address sanitizer does not know about
+#if !defined(__SANITIZE_ADDRESS__)
+#define SYS_OVERREAD
+#endif
+
+#define SYS_PAGE_SIZE 4096
+#define SYS_AVX2_MIN 256    // smaller sizes stay on SSE2
+
+typedef uint64_t sys_word __attribute__((may_alias, aligned(1)));
+
+static inline bool sys_has_zero(uint64_t word) {
+    return (word - 0x0101010101010101ull) & ~word & 0x8080808080808080ull;
+}
+
+// true if n bytes can be read from ptr without touching the next page
+static inline bool sys_page_safe(const void *ptr, size_t n) {
+    return ((uintptr_t)ptr & (SYS_PAGE_SIZE - 1)) <= SYS_PAGE_SIZE - n;
+}
+
+void sys_memcpy_byte(void *dest, const void *src, size_t n) {
     for (size_t i = 0; i < n; i++) {
         ((uint8_t*)dest)[i] = ((uint8_t *)src)[i];
     }
 }
 
-void _memset(void *s, uint8_t c, size_t n) {
+void sys_memset_byte(void *s, uint8_t c, size_t n) {
     for (size_t i = 0; i < n; i++) {
         ((uint8_t *)s)[i] = c;
     }
 }
 
-size_t _strcmp(const char *s1, const char *s2) {
+size_t sys_strcmp_byte(const char *s1, const char *s2) {
     while (*s1 != '\0') {
         if (*s1 != *s2) return 1;
         s1++;
@@ -21,7 +55,7 @@ size_t _strcmp(const char *s1, const char *s2) {
     return *s2 != '\0';
 }
 
-size_t _strlen(const char *s) {
+size_t sys_strlen_byte(const char *s) {
     size_t size = 0;
     while (*s != '\0') {
         size++;
@@ -29,3 +63,305 @@ size_t _strlen(const char *s) {
     }
     return size;
 }
+
+// All copies run forwards, so dest may overlap src from below.
+void sys_memcpy_word(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    while (n >= sizeof(uint64_t)) {
+        *(sys_word *)d = *(const sys_word *)s;
+        d += sizeof(uint64_t);
+        s += sizeof(uint64_t);
+        n -= sizeof(uint64_t);
+    }
+    sys_memcpy_byte(d, s, n);
+}
+
+void sys_memset_word(void *s, uint8_t c, size_t n) {
+    uint8_t *d = (uint8_t *)s;
+    uint64_t word = c * 0x0101010101010101ull;
+    while (n >= sizeof(uint64_t)) {
+        *(sys_word *)d = word;
+        d += sizeof(uint64_t);
+        n -= sizeof(uint64_t);
+    }
+    sys_memset_byte(d, c, n);
+}
+
+// compares a word at a time while both strings are equally aligned
+size_t sys_strcmp_word(const char *s1, const char *s2) {
+    if (((uintptr_t)s1 ^ (uintptr_t)s2) % sizeof(uint64_t) == 0) {
+        while ((uintptr_t)s1 % sizeof(uint64_t) != 0) {
+            if (*s1 != *s2) return 1;
+            if (*s1 == '\0') return 0;
+            s1++;
+            s2++;
+        }
+        while (true) {
+            uint64_t w1 = *(const sys_word *)s1;
+            uint64_t w2 = *(const sys_word *)s2;
+            if (w1 != w2 || sys_has_zero(w1)) break;
+            s1 += sizeof(uint64_t);
+            s2 += sizeof(uint64_t);
+        }
+    }
+    return sys_strcmp_byte(s1, s2);
+}
+
+size_t sys_strlen_word(const char *s) {
+    const char *p = s;
+    while ((uintptr_t)p % sizeof(uint64_t) != 0) {
+        if (*p == '\0') return p - s;
+        p++;
+    }
+    while (!sys_has_zero(*(const sys_word *)p)) p += sizeof(uint64_t);
+    while (*p != '\0') p++;
+    return p - s;
+}
+
+#ifdef SYS_SSE2
+void sys_memcpy_sse2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    while (n >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), e);
+        d += 64;
+        s += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        d += 16;
+        s += 16;
+        n -= 16;
+    }
+    sys_memcpy_word(d, s, n);
+}
+
+void sys_memset_sse2(void *s, uint8_t c, size_t n) {
+    uint8_t *d = (uint8_t *)s;
+    __m128i v = _mm_set1_epi8(c);
+    while (n >= 64) {
+        _mm_storeu_si128((__m128i *)d, v);
+        _mm_storeu_si128((__m128i *)(d + 16), v);
+        _mm_storeu_si128((__m128i *)(d + 32), v);
+        _mm_storeu_si128((__m128i *)(d + 48), v);
+        d += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        _mm_storeu_si128((__m128i *)d, v);
+        d += 16;
+        n -= 16;
+    }
+    sys_memset_word(d, c, n);
+}
+
+size_t sys_strcmp_sse2(const char *s1, const char *s2) {
+    __m128i zero = _mm_setzero_si128();
+    while (true) {
+        if (!sys_page_safe(s1, 16) || !sys_page_safe(s2, 16)) {
+            if (*s1 != *s2) return 1;
+            if (*s1 == '\0') return 0;
+            s1++;
+            s2++;
+            continue;
+        }
+        __m128i a = _mm_loadu_si128((const __m128i *)s1);
+        __m128i b = _mm_loadu_si128((const __m128i *)s2);
+        uint32_t end = _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero));
+        uint32_t diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xFFFF;
+        if (end | diff) {
+            uint32_t i = __builtin_ctz(end | diff);
+            return s1[i] != s2[i];
+        }
+        s1 += 16;
+        s2 += 16;
+    }
+}
+
+// aligned loads never cross a page
+size_t sys_strlen_sse2(const char *s) {
+    uintptr_t offset = (uintptr_t)s % 16;
+    const __m128i *p = (const __m128i *)(s - offset);
+    __m128i zero = _mm_setzero_si128();
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(p), zero)) >> offset;
+    if (mask) return __builtin_ctz(mask);
+    while (true) {
+        p++;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(p), zero));
+        if (mask) return (const char *)p - s + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+void sys_memcpy_avx2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    while (n >= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        _mm256_storeu_si256((__m256i *)(d + 64), c);
+        _mm256_storeu_si256((__m256i *)(d + 96), e);
+        d += 128;
+        s += 128;
+        n -= 128;
+    }
+    while (n >= 32) {
+        _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+    // the tail runs legacy SSE code, which stalls on dirty upper halves
+    _mm256_zeroupper();
+    sys_memcpy_sse2(d, s, n);
+}
+
+__attribute__((target("avx2")))
+void sys_memset_avx2(void *s, uint8_t c, size_t n) {
+    uint8_t *d = (uint8_t *)s;
+    __m256i v = _mm256_set1_epi8(c);
+    while (n >= 128) {
+        _mm256_storeu_si256((__m256i *)d, v);
+        _mm256_storeu_si256((__m256i *)(d + 32), v);
+        _mm256_storeu_si256((__m256i *)(d + 64), v);
+        _mm256_storeu_si256((__m256i *)(d + 96), v);
+        d += 128;
+        n -= 128;
+    }
+    while (n >= 32) {
+        _mm256_storeu_si256((__m256i *)d, v);
+        d += 32;
+        n -= 32;
+    }
+    _mm256_zeroupper();
+    sys_memset_sse2(d, c, n);
+}
+
+// AVX2 needs the CPU flag and the OS saving the upper register halves
+bool sys_detect_avx2() {
+    uint32_t a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) return false;
+
+    uint32_t xcr0, xcr0_high;
+    __asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0 & 6) != 6) return false;
+
+    if (__get_cpuid_max(0, NULL) < 7) return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
+int8_t sys_avx2 = -1;
+
+static inline bool sys_has_avx2() {
+#ifdef __AVX2__
+    return true;
+#else
+    int8_t avx2 = __atomic_load_n(&sys_avx2, __ATOMIC_RELAXED);
+    if (avx2 < 0) {
+        avx2 = sys_detect_avx2();
+        __atomic_store_n(&sys_avx2, avx2, __ATOMIC_RELAXED);
+    }
+    return avx2;
+#endif
+}
+#endif
+
+void _memcpy(void *dest, const void *src, size_t n) {
+#ifdef SYS_SSE2
+    if (n >= SYS_AVX2_MIN && sys_has_avx2()) sys_memcpy_avx2(dest, src, n);
+    else sys_memcpy_sse2(dest, src, n);
+#else
+    sys_memcpy_word(dest, src, n);
+#endif
+}
+
+void _memset(void *s, uint8_t c, size_t n) {
+#ifdef SYS_SSE2
+    if (n >= SYS_AVX2_MIN && sys_has_avx2()) sys_memset_avx2(s, c, n);
+    else sys_memset_sse2(s, c, n);
+#else
+    sys_memset_word(s, c, n);
+#endif
+}
+
+size_t _strcmp(const char *s1, const char *s2) {
+#if defined(SYS_SSE2) && defined(SYS_OVERREAD)
+    return sys_strcmp_sse2(s1, s2);
+#elif defined(SYS_OVERREAD)
+    return sys_strcmp_word(s1, s2);
+#else
+    return sys_strcmp_byte(s1, s2);
+#endif
+}
+
+size_t _strlen(const char *s) {
+#if defined(SYS_SSE2) && defined(SYS_OVERREAD)
+    return sys_strlen_sse2(s);
+#elif defined(SYS_OVERREAD)
+    return sys_strlen_word(s);
+#else
+    return sys_strlen_byte(s);
+#endif
+}
+
+// Locks for the multithreaded FUSE loop, build with -DSFS_THREADS.
+// Without it they compile to nothing for single-threaded (-s) use.
+#ifdef SFS_THREADS
+#include <pthread.h>
+
+typedef pthread_mutex_t sys_mutex;
+typedef pthread_rwlock_t sys_rwlock;
+
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_INIT(m) pthread_mutex_init((m), NULL)
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+
+#define RWLOCK_INIT(l) pthread_rwlock_init((l), NULL)
+#define RWLOCK_READ(l) pthread_rwlock_rdlock(l)
+#define RWLOCK_WRITE(l) pthread_rwlock_wrlock(l)
+#define RWLOCK_UNLOCK(l) pthread_rwlock_unlock(l)
+
+#define ATOMIC_ADD(ptr, n) __atomic_add_fetch((ptr), (n), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(ptr, v) __atomic_store_n((ptr), (v), __ATOMIC_RELAXED)
+// for pointers to memory set up before they are published
+#define ATOMIC_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_RELEASE(ptr, v) __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#else
+typedef uint8_t sys_mutex;
+typedef uint8_t sys_rwlock;
+
+#define MUTEX_INITIALIZER 0
+#define MUTEX_INIT(m) ((void)(m))
+#define MUTEX_LOCK(m) ((void)(m))
+#define MUTEX_UNLOCK(m) ((void)(m))
+
+#define RWLOCK_INIT(l) ((void)(l))
+#define RWLOCK_READ(l) ((void)(l))
+#define RWLOCK_WRITE(l) ((void)(l))
+#define RWLOCK_UNLOCK(l) ((void)(l))
+
+#define ATOMIC_ADD(ptr, n) (*(ptr) += (n))
+#define ATOMIC_LOAD(ptr) (*(ptr))
+#define ATOMIC_STORE(ptr, v) (*(ptr) = (v))
+#define ATOMIC_ACQUIRE(ptr) (*(ptr))
+#define ATOMIC_RELEASE(ptr, v) (*(ptr) = (v))
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 . assert.sh/assert.sh
 
 # make fix
+rm -f disk
 make run > /dev/null 2>&1 &
 
 sleep 0.5      # timeout
@@ -17,6 +18,18 @@ assert_raises "echo $Xs > mnt/b"
 assert        "cat mnt/b" "$Xs"
 assert_end read_write_long  # TODO even bigger
 
+assert_raises "echo $Xs >> mnt/b"
+assert        "wc -c < mnt/b" "2002"
+assert        "tail -c 1001 mnt/b | head -c 1000" "$Xs"
+assert_end append
+
+assert_raises "for i in \$(seq 1000); do echo line\$i; done > mnt/log"
+assert        "wc -l < mnt/log" "1000"
+assert        "tail -n 1 mnt/log" "line1000"
+assert        "(printf abc; stat -c %s mnt/log2 >&2) 2>&1 >> mnt/log2" "3"
+assert_raises "rm mnt/log mnt/log2"
+assert_end small_writes
+
 assert_raises "echo test789 > mnt/file1"
 assert        "cat mnt/file1" "test789"
 assert_end overwrite
@@ -25,6 +38,14 @@ assert_raises "ln mnt/file1 mnt/c"
 assert        "cat mnt/c" "test789"
 assert_end ln
 
+assert_raises "ln -s file1 mnt/s"
+assert        "readlink mnt/s" "file1"
+assert        "cat mnt/s" "test789"
+assert_raises "ln -s dir1/dir2/a-target-longer-than-the-inode mnt/s2"
+assert        "readlink mnt/s2" "dir1/dir2/a-target-longer-than-the-inode"
+assert_raises "rm mnt/s mnt/s2"
+assert_end symlink
+
 assert        "mkdir mnt/dir1"
 assert        "mkdir mnt/dir2"
 assert_raises "ls -la mnt/dir1 | grep \\.."
@@ -57,9 +78,65 @@ assert_raises "ls -la mnt/file1 | grep -- ---x-w-r--" 0
 assert_raises "chmod 777 mnt/x" 1   # does not exist
 assert_end chmod
 
+assert_raises "mkdir mnt/big && for i in \$(seq 300); do touch mnt/big/f\$i; done"
+assert        "ls mnt/big | wc -l" "300"
+assert        "cat mnt/big/f300"
+assert_raises "rm mnt/big/f* && rmdir mnt/big"
+assert_end large_dir
+
+assert_raises "truncate -s 20M mnt/sparse"    # larger than the disk
+assert        "stat -c %s mnt/sparse" "20971520"
+assert        "tail -c 4 mnt/sparse | od -An -tx1" " 00 00 00 00"
+assert_raises "echo end >> mnt/sparse"
+assert        "tail -c 4 mnt/sparse" "end"
+assert_raises "truncate -s 1M mnt/sparse"     # the cut off tail is freed in the background
+assert        "stat -c %s mnt/sparse" "1048576"
+assert_raises "rm mnt/sparse"
+assert_end sparse
+
+make reflink > /dev/null 2>&1
+assert_raises "head -c 300000 /dev/urandom > mnt/orig"
+assert_raises "./reflink mnt/orig mnt/clone"
+assert_raises "cmp mnt/orig mnt/clone"
+assert_raises "printf changed | dd of=mnt/clone conv=notrunc status=none"
+assert_raises "cmp -s mnt/orig mnt/clone" 1
+assert        "head -c 7 mnt/clone" "changed"
+assert_raises "rm mnt/orig mnt/clone"
+assert_end reflink
+
+assert_raises "mkdir mnt/logs && chattr +c mnt/logs"
+assert_raises "seq 100000 > mnt/logs/seq"
+assert        "lsattr mnt/logs/seq | cut -d' ' -f1 | tr -d -" "c"
+assert_raises "seq 100000 | cmp - mnt/logs/seq"
+assert_raises "truncate -s 1000 mnt/logs/seq && seq 100000 | head -c 1000 | cmp - mnt/logs/seq"
+assert_raises "rm -r mnt/logs"
+assert_end compress
+
 assert_raises "df -ha mnt"
 assert_end df
 
 # chown
 
+assert_raises "echo persist > mnt/p"
+fusermount -u mnt
+sleep 0.5
+make run > /dev/null 2>&1 &
+sleep 0.5
+assert        "cat mnt/p" "persist"
+assert        "cat mnt/file1" "test789"
+assert_end persist
+
 killall main
+sleep 0.5
+
+make fsck > /dev/null 2>&1
+assert_raises "./fsck disk"
+assert_end fsck
+
+make crash > /dev/null 2>&1
+assert_raises "./crash"
+assert_end crash
+
+make dirfull > /dev/null 2>&1
+assert_raises "./dirfull"
+assert_end dirfull
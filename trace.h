@@ -0,0 +1,183 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sys.h"
+
+// Binary event tracing. SFS_TRACE selects what is compiled in, 1 traces
+// file operations and 2 also every block mapping, copy, allocation and
+// free. At 0 the trace points compile to nothing.
+#ifndef SFS_TRACE
+#define SFS_TRACE 0
+#endif
+
+#define TRACE_MAGIC 0x54534653      // "SFST"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 4096        // events per thread, a power of two
+#define TRACE_RINGS_MAX 64
+#define TRACE_PATH "/.sfs_trace"
+
+enum {
+    TRACE_NONE,
+    TRACE_READ,         // ino, offset, size
+    TRACE_WRITE,        // ino, offset, size
+    TRACE_TRUNCATE,     // ino, old size, new size
+    TRACE_MK,           // ino, parent ino
+    TRACE_LINK,         // ino, parent ino
+    TRACE_UNLINK,       // ino, parent ino
+    TRACE_BMAP,         // ino, logical block, block << 32 | count
+    TRACE_COPY,         // -, block, bytes << 1 | write
+    TRACE_ALLOC,        // -, block, count
+    TRACE_FREE,         // -, block
+    TRACE_CLONE,        // ino, source ino
+    TRACE_TYPES
+};
+
+typedef struct trace_event {
+    uint64_t ns;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t ino;
+    uint64_t a;
+    uint64_t b;
+} trace_event;
+
+// Written only by the thread that owns it, so events need no locks. A
+// reader copies the ring while it is written and may see a torn event
+// at head.
+typedef struct trace_ring {
+    uint32_t tid;
+    uint32_t size;
+    uint64_t head;      // events ever written, the newest is at head - 1
+    trace_event events[TRACE_RING_SIZE];
+} trace_ring;
+
+// layout of a trace snapshot, followed by rings trace_ring structs
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rings;
+    uint32_t ring_size;
+} trace_header;
+
+#if SFS_TRACE > 0
+
+#define TRACE_NO_RING ((trace_ring *)1)     // trace_self of untraced threads
+
+trace_ring *trace_rings[TRACE_RINGS_MAX];
+uint32_t trace_ring_count;
+uint32_t trace_ring_free[TRACE_RINGS_MAX];  // rings of exited threads
+uint32_t trace_ring_frees;
+sys_mutex trace_ring_lock = MUTEX_INITIALIZER;
+static __thread trace_ring *trace_self;
+
+#ifdef SFS_THREADS
+pthread_key_t trace_ring_key;
+pthread_once_t trace_ring_once = PTHREAD_ONCE_INIT;
+
+// hands the ring of an exiting thread on, its events stay until overwritten
+void trace_ring_put(void *ring) {
+    MUTEX_LOCK(&trace_ring_lock);
+    trace_ring_free[trace_ring_frees++] = ((trace_ring *)ring)->tid;
+    MUTEX_UNLOCK(&trace_ring_lock);
+}
+
+void trace_ring_key_init() {
+    pthread_key_create(&trace_ring_key, trace_ring_put);
+}
+#endif
+
+// Reuses the ring of an exited thread or adds one. Rings are never freed,
+// a thread that finds all TRACE_RINGS_MAX taken is not traced.
+trace_ring *trace_ring_new() {
+    trace_ring *ring = NULL;
+    MUTEX_LOCK(&trace_ring_lock);
+    if (trace_ring_frees > 0) {
+        ring = trace_rings[trace_ring_free[--trace_ring_frees]];
+    } else if (trace_ring_count < TRACE_RINGS_MAX) {
+        ring = (trace_ring *)calloc(1, sizeof(trace_ring));
+        if (ring != NULL) {
+            ring->tid = trace_ring_count;
+            ring->size = TRACE_RING_SIZE;
+            ATOMIC_RELEASE(&trace_rings[ring->tid], ring);
+            ATOMIC_STORE(&trace_ring_count, ring->tid + 1);
+        }
+    }
+    MUTEX_UNLOCK(&trace_ring_lock);
+
+#ifdef SFS_THREADS
+    if (ring != NULL) {
+        pthread_once(&trace_ring_once, trace_ring_key_init);
+        pthread_setspecific(trace_ring_key, ring);
+    }
+#endif
+    return ring;
+}
+
+static inline trace_ring *trace_ring_get() {
+    if (trace_self == NULL) {
+        trace_ring *ring = trace_ring_new();
+        trace_self = ring != NULL ? ring : TRACE_NO_RING;
+    }
+    return trace_self != TRACE_NO_RING ? trace_self : NULL;
+}
+
+static inline void trace_emit(uint16_t type, uint32_t ino, uint64_t a, uint64_t b) {
+    trace_ring *ring = trace_ring_get();
+    if (ring == NULL) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t head = ring->head;
+    trace_event *event = &ring->events[head % TRACE_RING_SIZE];
+    event->ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    event->type = type;
+    event->ino = ino;
+    event->a = a;
+    event->b = b;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t trace_rings_used() {
+    return ATOMIC_LOAD(&trace_ring_count);
+}
+
+size_t trace_snapshot_size() {
+    return sizeof(trace_header) + trace_rings_used() * sizeof(trace_ring);
+}
+
+// copies every ring into buffer, which holds at least size bytes
+size_t trace_snapshot(void *buffer, size_t size) {
+    uint32_t rings = 0;
+    uint8_t *ptr = (uint8_t *)buffer + sizeof(trace_header);
+    for (uint32_t i = 0; i < trace_rings_used(); i++) {
+        trace_ring *ring = ATOMIC_ACQUIRE(&trace_rings[i]);
+        if (ring == NULL || ptr + sizeof(trace_ring) > (uint8_t *)buffer + size) continue;
+        _memcpy(ptr, ring, sizeof(trace_ring));
+        ptr += sizeof(trace_ring);
+        rings++;
+    }
+
+    trace_header header = { TRACE_MAGIC, TRACE_VERSION, rings, TRACE_RING_SIZE };
+    _memcpy(buffer, &header, sizeof(header));
+    return ptr - (uint8_t *)buffer;
+}
+
+#endif
+
+#if SFS_TRACE >= 1
+#define TRACE_OP(type, ino, a, b) trace_emit(type, ino, a, b)
+#else
+#define TRACE_OP(type, ino, a, b) ((void)0)
+#endif
+
+#if SFS_TRACE >= 2
+#define TRACE_BLOCK(type, ino, a, b) trace_emit(type, ino, a, b)
+#else
+#define TRACE_BLOCK(type, ino, a, b) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+// Decodes a snapshot of the trace rings, read from mnt/.sfs_trace or a
+// copy of it, and prints the events of all threads in time order.
+
+typedef struct dump_event {
+    trace_event event;
+    uint32_t tid;
+} dump_event;
+
+int dump_cmp(const void *a, const void *b) {
+    uint64_t x = ((const dump_event *)a)->event.ns;
+    uint64_t y = ((const dump_event *)b)->event.ns;
+    return (x > y) - (x < y);
+}
+
+void dump_print(dump_event *e, uint64_t base) {
+    trace_event *ev = &e->event;
+    printf("%12.3f us  t%-2u ", (ev->ns - base) / 1e3, e->tid);
+    switch (ev->type) {
+    case TRACE_READ:
+        printf("read     ino %u offset %lu size %lu\n", ev->ino, ev->a, ev->b);
+        break;
+    case TRACE_WRITE:
+        printf("write    ino %u offset %lu size %lu\n", ev->ino, ev->a, ev->b);
+        break;
+    case TRACE_TRUNCATE:
+        printf("truncate ino %u from %lu to %lu\n", ev->ino, ev->a, ev->b);
+        break;
+    case TRACE_MK:
+        printf("mk       ino %u parent %lu\n", ev->ino, ev->a);
+        break;
+    case TRACE_LINK:
+        printf("link     ino %u parent %lu\n", ev->ino, ev->a);
+        break;
+    case TRACE_UNLINK:
+        printf("unlink   ino %u parent %lu\n", ev->ino, ev->a);
+        break;
+    case TRACE_BMAP:
+        printf("bmap     ino %u lblk %lu blk %lu count %lu\n",
+            ev->ino, ev->a, ev->b >> 32, ev->b & UINT32_MAX);
+        break;
+    case TRACE_COPY:
+        printf("%s    blk %lu bytes %lu\n", ev->b & 1 ? "store" : "load ", ev->a, ev->b >> 1);
+        break;
+    case TRACE_ALLOC:
+        printf("alloc    blk %lu count %lu\n", ev->a, ev->b);
+        break;
+    case TRACE_FREE:
+        printf("free     blk %lu\n", ev->a);
+        break;
+    case TRACE_CLONE:
+        printf("clone    ino %u from %lu\n", ev->ino, ev->a);
+        break;
+    default:
+        printf("type %u  ino %u a %lu b %lu\n", ev->type, ev->ino, ev->a, ev->b);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != TRACE_MAGIC
+        || header.version != TRACE_VERSION
+        || header.ring_size != TRACE_RING_SIZE) {
+        fprintf(stderr, "not a trace snapshot of this version\n");
+        return 1;
+    }
+
+    trace_ring *ring = (trace_ring *)malloc(sizeof(trace_ring));
+    dump_event *events = (dump_event *)malloc((size_t)header.rings * TRACE_RING_SIZE * sizeof(dump_event));
+    size_t count = 0;
+    for (uint32_t i = 0; i < header.rings; i++) {
+        if (fread(ring, sizeof(trace_ring), 1, file) != 1) {
+            fprintf(stderr, "truncated snapshot\n");
+            return 1;
+        }
+        // the slot at head is reused next, so the oldest event may be torn
+        uint64_t first = ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE + 1 : 0;
+        for (uint64_t j = first; j < ring->head; j++) {
+            trace_event *event = &ring->events[j % TRACE_RING_SIZE];
+            if (event->type == TRACE_NONE || event->type >= TRACE_TYPES) continue;
+            events[count].event = *event;
+            events[count].tid = ring->tid;
+            count++;
+        }
+    }
+
+    qsort(events, count, sizeof(dump_event), dump_cmp);
+    for (size_t i = 0; i < count; i++) dump_print(&events[i], events[0].event.ns);
+    fprintf(stderr, "%u threads, %lu events\n", header.rings, count);
+
+    free(events);
+    free(ring);
+    if (file != stdin) fclose(file);
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+// drives a mounted file system through the kernel with plain system calls
+
+#define WORKLOAD_CHUNK 4096
+
+char workload_path[4096];
+
+const char *workload_at(const char *root, const char *name) {
+    snprintf(workload_path, sizeof(workload_path), "%s/%s", root, name);
+    return workload_path;
+}
+
+// numbers taken over failed calls mean nothing, so any failure ends the run
+void workload_check(bool ok, const char *what) {
+    if (ok) return;
+    perror(what);
+    exit(1);
+}
+
+void workload_expect(ssize_t ret, ssize_t want, const char *what) {
+    if (ret == want) return;
+    if (ret < 0) perror(what);
+    else fprintf(stderr, "%s: %ld of %ld bytes\n", what, ret, want);
+    exit(1);
+}
+
+// sequential and random 4 KiB writes and reads on one file
+void workload_io(const char *root, size_t size, size_t ops) {
+    char chunk[WORKLOAD_CHUNK];
+    memset(chunk, 1, sizeof(chunk));
+    size_t chunks = size / sizeof(chunk);
+    bench_lat lat;
+    uint64_t start;
+
+    int fd = open(workload_at(root, "io"), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    workload_check(fd >= 0, "open");
+
+    bench_lat_init(&lat, "fuse.write.seq.4k", chunks);
+    for (size_t i = 0; i < chunks; i++) {
+        start = bench_ns();
+        ssize_t n = pwrite(fd, chunk, sizeof(chunk), i * sizeof(chunk));
+        bench_lat_add(&lat, start);
+        workload_expect(n, sizeof(chunk), "pwrite");
+    }
+    workload_check(fsync(fd) == 0, "fsync");
+    bench_lat_report(&lat);
+
+    // keep the page cache from answering the reads
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    bench_lat_init(&lat, "fuse.read.seq.4k", chunks);
+    for (size_t i = 0; i < chunks; i++) {
+        start = bench_ns();
+        ssize_t n = pread(fd, chunk, sizeof(chunk), i * sizeof(chunk));
+        bench_lat_add(&lat, start);
+        workload_expect(n, sizeof(chunk), "pread");
+    }
+    bench_lat_report(&lat);
+
+    srand(42);
+    bench_lat_init(&lat, "fuse.write.rand.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        off_t offset = rand() % chunks * sizeof(chunk);
+        start = bench_ns();
+        ssize_t n = pwrite(fd, chunk, sizeof(chunk), offset);
+        bench_lat_add(&lat, start);
+        workload_expect(n, sizeof(chunk), "pwrite");
+    }
+    workload_check(fsync(fd) == 0, "fsync");
+    bench_lat_report(&lat);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    bench_lat_init(&lat, "fuse.read.rand.4k", ops);
+    for (size_t i = 0; i < ops; i++) {
+        off_t offset = rand() % chunks * sizeof(chunk);
+        posix_fadvise(fd, offset, sizeof(chunk), POSIX_FADV_DONTNEED);
+        start = bench_ns();
+        ssize_t n = pread(fd, chunk, sizeof(chunk), offset);
+        bench_lat_add(&lat, start);
+        workload_expect(n, sizeof(chunk), "pread");
+    }
+    bench_lat_report(&lat);
+
+    workload_check(close(fd) == 0, "close");
+    workload_check(unlink(workload_at(root, "io")) == 0, "unlink");
+}
+
+// creates, stats and unlinks many small files in one directory
+void workload_small(const char *root, size_t files) {
+    char data[100];
+    memset(data, 2, sizeof(data));
+    char name[64];
+    struct stat st;
+    bench_lat lat;
+    uint64_t start;
+
+    workload_check(mkdir(workload_at(root, "small"), 0755) == 0, "mkdir");
+
+    bench_lat_init(&lat, "fuse.create", files);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(name, "small/%ld", i);
+        const char *path = workload_at(root, name);
+        start = bench_ns();
+        int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        ssize_t n = fd >= 0 ? write(fd, data, sizeof(data)) : -1;
+        int closed = fd >= 0 ? close(fd) : -1;
+        bench_lat_add(&lat, start);
+        workload_check(fd >= 0, "open");
+        workload_expect(n, sizeof(data), "write");
+        workload_check(closed == 0, "close");
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "fuse.stat", files);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(name, "small/%ld", i);
+        const char *path = workload_at(root, name);
+        start = bench_ns();
+        int ret = stat(path, &st);
+        bench_lat_add(&lat, start);
+        workload_check(ret == 0, "stat");
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "fuse.unlink", files);
+    for (size_t i = 0; i < files; i++) {
+        sprintf(name, "small/%ld", i);
+        const char *path = workload_at(root, name);
+        start = bench_ns();
+        int ret = unlink(path);
+        bench_lat_add(&lat, start);
+        workload_check(ret == 0, "unlink");
+    }
+    bench_lat_report(&lat);
+
+    workload_check(rmdir(workload_at(root, "small")) == 0, "rmdir");
+}
+
+// random hits and misses in a directory with many entries
+void workload_lookup(const char *root, size_t entries, size_t ops) {
+    char name[64];
+    struct stat st;
+    bench_lat lat;
+    uint64_t start;
+
+    workload_check(mkdir(workload_at(root, "large"), 0755) == 0, "mkdir");
+    for (size_t i = 0; i < entries; i++) {
+        sprintf(name, "large/entry-%ld", i);
+        workload_check(mknod(workload_at(root, name), S_IFREG | 0644, 0) == 0, "mknod");
+    }
+
+    srand(42);
+    bench_lat_init(&lat, "fuse.lookup.hit", ops);
+    for (size_t i = 0; i < ops; i++) {
+        sprintf(name, "large/entry-%d", rand() % (int)entries);
+        const char *path = workload_at(root, name);
+        start = bench_ns();
+        int ret = stat(path, &st);
+        bench_lat_add(&lat, start);
+        workload_check(ret == 0, "stat");
+    }
+    bench_lat_report(&lat);
+
+    bench_lat_init(&lat, "fuse.lookup.miss", ops);
+    for (size_t i = 0; i < ops; i++) {
+        sprintf(name, "large/missing-%d", rand() % (int)entries);
+        const char *path = workload_at(root, name);
+        start = bench_ns();
+        int ret = stat(path, &st);
+        bench_lat_add(&lat, start);
+        workload_check(ret < 0 && errno == ENOENT, "stat of a missing file");
+    }
+    bench_lat_report(&lat);
+
+    for (size_t i = 0; i < entries; i++) {
+        sprintf(name, "large/entry-%ld", i);
+        workload_check(unlink(workload_at(root, name)) == 0, "unlink");
+    }
+    workload_check(rmdir(workload_at(root, "large")) == 0, "rmdir");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MOUNTPOINT [SCALE]\n", argv[0]);
+        return 1;
+    }
+    const char *root = argv[1];
+    size_t scale = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    if (scale == 0) scale = 1;
+
+    workload_io(root, scale * 16 * 1024 * 1024, scale * 4096);
+    workload_small(root, scale * 2000);
+    workload_lookup(root, scale * 5000, scale * 20000);
+    return 0;
+}